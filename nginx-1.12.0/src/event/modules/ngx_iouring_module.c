@@ -0,0 +1,1957 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include <linux/io_uring.h>
+
+
+/*
+ * The module polls sockets with io_uring instead of epoll.  Interest
+ * changes are queued as IORING_OP_POLL_ADD/IORING_OP_POLL_REMOVE requests
+ * and are submitted together with the wait for completions by a single
+ * io_uring_enter() per event loop iteration.
+ *
+ * Connections are polled with multishot edge-triggered requests, so
+ * the usual NGX_USE_CLEAR_EVENT semantics apply.  Listening sockets are
+ * polled with one-shot requests which are rearmed after each completion,
+ * which gives level-triggered behaviour: accept() may leave connections
+ * in the backlog.
+ *
+ * With "iouring_buffers" the module also provides completion-based I/O
+ * for connections switched to it with ngx_iouring_start().  Such
+ * a connection has a multishot IORING_OP_RECV request which selects
+ * buffers from a provided buffer ring, and the buffers filled are passed
+ * to the consumer as is by ngx_iouring_recv_buf(), without copying.
+ * The consumer returns them with ngx_iouring_free_buf().  Data are sent
+ * with IORING_OP_SENDMSG by the c->send_chain() of the connection, one
+ * request at a time; the buffers sent stay referenced by the request,
+ * and NGX_LOWLEVEL_BUFFERED is set until it completes.
+ *
+ * The recv request of a connection is cancelled once the connection
+ * holds NGX_IOURING_HELD buffers, though the kernel may fill some more
+ * before the cancellation is submitted, and the rest of the data stay
+ * in the socket until the buffers are returned.  The connections which
+ * found the ring empty are rearmed in order as buffers are returned.
+ *
+ * Other connections are polled, and their data are still read and written
+ * by the usual recv(), send() and writev() calls.
+ *
+ * A poll request holds a reference to the file, so unlike epoll
+ * the request has to be removed before a socket is closed.
+ *
+ * Each connection slot has a generation number, which is stored in
+ * the request user_data along with the slot index and the request type,
+ * and which is changed whenever a poll request is removed or added, or
+ * the connection stops completion-based I/O.  A completion of an older
+ * request is stale and is ignored.
+ *
+ * The requests are only executed in the context of the worker process,
+ * so recv and send requests are cancelled by the time io_uring_enter()
+ * submitting the cancellation returns, and their buffers may be reused.
+ */
+
+
+#define NGX_IOURING_NOTIFY   ((uint64_t) -1)
+
+#define NGX_IOURING_POLL     0
+#define NGX_IOURING_RECV     1
+#define NGX_IOURING_SEND     2
+
+#define ngx_iouring_generation(g)  ((uint32_t) ((g) << 2))
+
+#define ngx_iouring_data(slot, g, op)                                         \
+    ((uint64_t) ((slot) + 1) << 32 | ngx_iouring_generation(g) | (op))
+
+
+#define NGX_IOURING_BGID     0
+#define NGX_IOURING_HELD     8
+
+
+typedef struct {
+    ngx_uint_t  entries;
+    ngx_bufs_t  buffers;
+} ngx_iouring_conf_t;
+
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+typedef struct ngx_iouring_buf_s  ngx_iouring_buf_t;
+
+struct ngx_iouring_buf_s {
+    ngx_buf_t            buf;        /* must be first */
+    ngx_iouring_buf_t   *next;       /* received or sent */
+    ngx_uint_t           slot;
+    uint32_t             generation;
+    unsigned             pinned:1;   /* referenced by a send request */
+    unsigned             freed:1;
+};
+
+
+typedef struct {
+    ngx_iouring_buf_t   *head;       /* received, not yet consumed */
+    ngx_iouring_buf_t  **last;
+    ngx_iouring_buf_t   *pinned;     /* referenced by the send request */
+    ngx_uint_t           slot;
+    ngx_uint_t           held;
+    size_t               send;       /* bytes of the send request */
+    ngx_err_t            error;
+    ngx_err_t            send_error;
+    ngx_queue_t          queue;      /* found the buffer ring empty */
+    struct msghdr        msg;
+
+    unsigned             active:1;
+    unsigned             recv:1;     /* a recv request is armed */
+    unsigned             cancel:1;
+    unsigned             starved:1;
+    unsigned             eof:1;
+
+    struct iovec         iovs[NGX_IOVS_PREALLOCATE];
+} ngx_iouring_io_t;
+
+#endif
+
+
+typedef struct {
+    uint32_t           events;      /* events of the armed request,
+                                       0 if none */
+    uint32_t           generation;
+#if (NGX_HAVE_IOURING_BUF_RING)
+    ngx_iouring_io_t  *io;
+#endif
+} ngx_iouring_poll_t;
+
+
+static ngx_int_t ngx_iouring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_iouring_setup_ring(ngx_cycle_t *cycle,
+    ngx_iouring_conf_t *iucf);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_iouring_notify_init(ngx_log_t *log);
+static ngx_int_t ngx_iouring_notify_arm(ngx_log_t *log);
+static void ngx_iouring_notify_handler(ngx_event_t *ev);
+#endif
+static void ngx_iouring_done(ngx_cycle_t *cycle);
+static ngx_int_t ngx_iouring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_iouring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_iouring_add_connection(ngx_connection_t *c);
+static ngx_int_t ngx_iouring_del_connection(ngx_connection_t *c,
+    ngx_uint_t flags);
+static ngx_int_t ngx_iouring_arm(ngx_connection_t *c, uint32_t events);
+static struct io_uring_sqe *ngx_iouring_get_sqe(ngx_uint_t n, ngx_log_t *log);
+static ngx_int_t ngx_iouring_submit(ngx_log_t *log);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_iouring_notify(ngx_event_handler_pt handler);
+#endif
+static ngx_int_t ngx_iouring_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+#if (NGX_HAVE_IOURING_BUF_RING)
+static ngx_int_t ngx_iouring_setup_buffers(ngx_cycle_t *cycle,
+    ngx_iouring_conf_t *iucf);
+static void ngx_iouring_free_io(void);
+static void ngx_iouring_stop(ngx_connection_t *c, ngx_iouring_io_t *io);
+static void ngx_iouring_cancel(uint64_t data, ngx_log_t *log);
+static void ngx_iouring_recv_arm(ngx_connection_t *c, ngx_iouring_io_t *io);
+static ngx_int_t ngx_iouring_recv_event(ngx_connection_t *c,
+    ngx_iouring_io_t *io, ngx_int_t res, uint32_t cflags, ngx_uint_t flags);
+static ssize_t ngx_iouring_recv(ngx_connection_t *c, u_char *buf, size_t size);
+static ngx_chain_t *ngx_iouring_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static ngx_int_t ngx_iouring_sendmsg(ngx_connection_t *c,
+    ngx_iouring_io_t *io);
+static ngx_int_t ngx_iouring_send_event(ngx_connection_t *c,
+    ngx_iouring_io_t *io, ngx_int_t res, ngx_uint_t flags);
+static void ngx_iouring_unpin(ngx_iouring_io_t *io);
+static void ngx_iouring_return_buf(ngx_iouring_buf_t *d);
+static void ngx_iouring_post(ngx_event_t *ev, ngx_uint_t flags);
+#endif
+
+static void *ngx_iouring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_iouring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+static int                   ring = -1;
+
+static void                 *sq_ring;
+static size_t                sq_ring_size;
+static void                 *cq_ring;
+static size_t                cq_ring_size;
+static struct io_uring_sqe  *sqes;
+static size_t                sqes_size;
+
+static unsigned             *sq_head;
+static unsigned             *sq_tail;
+static unsigned              sq_mask;
+static unsigned              sq_entries;
+static unsigned              sq_pending;
+
+static unsigned             *cq_head;
+static unsigned             *cq_tail;
+static unsigned              cq_mask;
+static struct io_uring_cqe  *cqes;
+
+static ngx_iouring_poll_t   *polls;
+static ngx_uint_t            npolls;
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+static struct io_uring_buf_ring  *buf_ring;
+static unsigned                   buf_tail;
+static unsigned                   buf_mask;
+static ngx_iouring_buf_t         *bufs;
+static u_char                    *buf_data;
+static ngx_queue_t                starved;
+
+ngx_uint_t                        ngx_use_iouring_buffers;
+#endif
+
+#if (NGX_HAVE_EVENTFD)
+static int                   notify_fd = -1;
+static ngx_event_t           notify_event;
+static ngx_connection_t      notify_conn;
+#endif
+
+static ngx_str_t      iouring_name = ngx_string("iouring");
+
+static ngx_command_t  ngx_iouring_commands[] = {
+
+    { ngx_string("iouring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_iouring_conf_t, entries),
+      NULL },
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+    { ngx_string("iouring_buffers"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      0,
+      offsetof(ngx_iouring_conf_t, buffers),
+      NULL },
+
+#endif
+
+      ngx_null_command
+};
+
+
+static ngx_event_module_t  ngx_iouring_module_ctx = {
+    &iouring_name,
+    ngx_iouring_create_conf,             /* create configuration */
+    ngx_iouring_init_conf,               /* init configuration */
+
+    {
+        ngx_iouring_add_event,           /* add an event */
+        ngx_iouring_del_event,           /* delete an event */
+        ngx_iouring_add_event,           /* enable an event */
+        ngx_iouring_del_event,           /* disable an event */
+        ngx_iouring_add_connection,      /* add an connection */
+        ngx_iouring_del_connection,      /* delete an connection */
+#if (NGX_HAVE_EVENTFD)
+        ngx_iouring_notify,              /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_iouring_process_events,      /* process the events */
+        ngx_iouring_init,                /* init the events */
+        ngx_iouring_done,                /* done the events */
+    }
+};
+
+ngx_module_t  ngx_iouring_module = {
+    NGX_MODULE_V1,
+    &ngx_iouring_module_ctx,             /* module context */
+    ngx_iouring_commands,                /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * We call io_uring_setup() and io_uring_enter() directly as syscalls
+ * instead of liburing usage, the same way as the epoll module does
+ * with the native AIO syscalls.
+ */
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t size)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, size);
+}
+
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+static int
+io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_iouring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_iouring_conf_t  *iucf;
+
+    iucf = ngx_event_get_conf(cycle->conf_ctx, ngx_iouring_module);
+
+    if (ring == -1) {
+        if (ngx_iouring_setup_ring(cycle, iucf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_iouring_notify_init(cycle->log) != NGX_OK) {
+            ngx_iouring_module_ctx.actions.notify = NULL;
+        }
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+        /* file AIO completions are reported through the epoll module */
+        ngx_file_aio = 0;
+#endif
+    }
+
+    if (npolls < cycle->connection_n) {
+        if (polls) {
+#if (NGX_HAVE_IOURING_BUF_RING)
+            ngx_iouring_free_io();
+#endif
+            ngx_free(polls);
+        }
+
+        polls = ngx_calloc(sizeof(ngx_iouring_poll_t) * cycle->connection_n,
+                           cycle->log);
+        if (polls == NULL) {
+            return NGX_ERROR;
+        }
+
+        npolls = cycle->connection_n;
+    }
+
+    ngx_io = ngx_os_io;
+
+    ngx_event_actions = ngx_iouring_module_ctx.actions;
+
+    /* the module provides the same semantics as the epoll module */
+
+    ngx_event_flags = NGX_USE_CLEAR_EVENT
+                      |NGX_USE_GREEDY_EVENT
+                      |NGX_USE_EPOLL_EVENT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_setup_ring(ngx_cycle_t *cycle, ngx_iouring_conf_t *iucf)
+{
+    u_char                  *p;
+    unsigned                 i, *array;
+    struct io_uring_params   params;
+
+    ngx_memzero(&params, sizeof(struct io_uring_params));
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+    /*
+     * multishot recv requests appeared in Linux 6.0 along with
+     * IORING_SETUP_SINGLE_ISSUER, which also suits the ring: only
+     * the worker process submits requests
+     */
+
+    if (iucf->buffers.num) {
+        params.flags = IORING_SETUP_SINGLE_ISSUER;
+
+        ring = io_uring_setup(iucf->entries, &params);
+
+        if (ring == -1 && ngx_errno == NGX_EINVAL) {
+            ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                          "io_uring buffers are not supported, "
+                          "at least Linux 6.0 is required");
+
+            ngx_memzero(&params, sizeof(struct io_uring_params));
+
+            ring = io_uring_setup(iucf->entries, &params);
+        }
+
+    } else {
+        ring = io_uring_setup(iucf->entries, &params);
+    }
+
+#else
+
+    ring = io_uring_setup(iucf->entries, &params);
+
+#endif
+
+    if (ring == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "io_uring_setup() failed");
+        return NGX_ERROR;
+    }
+
+    /*
+     * multishot poll requests appeared in Linux 5.13 along with
+     * IORING_FEAT_RSRC_TAGS; older kernels fail them with EINVAL
+     */
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+        || !(params.features & IORING_FEAT_NODROP)
+        || !(params.features & IORING_FEAT_EXT_ARG)
+        || !(params.features & IORING_FEAT_RSRC_TAGS))
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "io_uring features 0x%xD are not supported, "
+                      "at least Linux 5.13 is required", params.features);
+        goto failed;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes
+                   + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (cq_ring_size > sq_ring_size) {
+        sq_ring_size = cq_ring_size;
+    }
+
+    cq_ring_size = sq_ring_size;
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+
+    if (sq_ring == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQ_RING) failed");
+        sq_ring = NULL;
+        goto failed;
+    }
+
+    /* IORING_FEAT_SINGLE_MMAP: the rings share the mapping */
+
+    cq_ring = sq_ring;
+
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQES);
+
+    if (sqes == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQES) failed");
+        sqes = NULL;
+        goto failed;
+    }
+
+    p = sq_ring;
+
+    sq_head = (unsigned *) (p + params.sq_off.head);
+    sq_tail = (unsigned *) (p + params.sq_off.tail);
+    sq_mask = *(unsigned *) (p + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_pending = 0;
+
+    array = (unsigned *) (p + params.sq_off.array);
+
+    for (i = 0; i < sq_entries; i++) {
+        array[i] = i;
+    }
+
+    p = cq_ring;
+
+    cq_head = (unsigned *) (p + params.cq_off.head);
+    cq_tail = (unsigned *) (p + params.cq_off.tail);
+    cq_mask = *(unsigned *) (p + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (p + params.cq_off.cqes);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d sq:%ud cq:%ud",
+                   ring, params.sq_entries, params.cq_entries);
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+    if (params.flags & IORING_SETUP_SINGLE_ISSUER
+        && ngx_iouring_setup_buffers(cycle, iucf) != NGX_OK)
+    {
+        goto failed;
+    }
+
+#endif
+
+    return NGX_OK;
+
+failed:
+
+    ngx_iouring_done(cycle);
+
+    return NGX_ERROR;
+}
+
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+static ngx_int_t
+ngx_iouring_setup_buffers(ngx_cycle_t *cycle, ngx_iouring_conf_t *iucf)
+{
+    u_char                   *p;
+    ngx_int_t                 i;
+    ngx_iouring_buf_t        *d;
+    struct io_uring_buf_reg   reg;
+
+    buf_ring = ngx_memalign(ngx_pagesize,
+                            iucf->buffers.num * sizeof(struct io_uring_buf),
+                            cycle->log);
+    if (buf_ring == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(buf_ring, iucf->buffers.num * sizeof(struct io_uring_buf));
+
+    bufs = ngx_calloc(iucf->buffers.num * sizeof(ngx_iouring_buf_t),
+                      cycle->log);
+    if (bufs == NULL) {
+        return NGX_ERROR;
+    }
+
+    buf_data = ngx_alloc(iucf->buffers.num * iucf->buffers.size, cycle->log);
+    if (buf_data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&reg, sizeof(struct io_uring_buf_reg));
+
+    reg.ring_addr = (uint64_t) (uintptr_t) buf_ring;
+    reg.ring_entries = iucf->buffers.num;
+    reg.bgid = NGX_IOURING_BGID;
+
+    if (io_uring_register(ring, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, ngx_errno,
+                      "io_uring_register(IORING_REGISTER_PBUF_RING) failed, "
+                      "io_uring buffers are not used");
+
+        ngx_free(buf_data);
+        ngx_free(bufs);
+        ngx_free(buf_ring);
+
+        buf_data = NULL;
+        bufs = NULL;
+        buf_ring = NULL;
+
+        return NGX_OK;
+    }
+
+    buf_tail = 0;
+    buf_mask = iucf->buffers.num - 1;
+
+    ngx_queue_init(&starved);
+
+    p = buf_data;
+
+    for (i = 0; i < iucf->buffers.num; i++) {
+        d = &bufs[i];
+
+        d->buf.start = p;
+        d->buf.end = p + iucf->buffers.size;
+
+        ngx_iouring_return_buf(d);
+
+        p += iucf->buffers.size;
+    }
+
+    ngx_use_iouring_buffers = 1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring buffers: %ui %uz",
+                   iucf->buffers.num, iucf->buffers.size);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_iouring_free_io(void)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < npolls; i++) {
+        if (polls[i].io) {
+            ngx_free(polls[i].io);
+        }
+    }
+}
+
+#endif
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_iouring_notify_init(ngx_log_t *log)
+{
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    notify_fd = eventfd(0, 0);
+#else
+    notify_fd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_iouring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    notify_conn.fd = notify_fd;
+    notify_conn.read = &notify_event;
+    notify_conn.log = log;
+
+    if (ngx_iouring_notify_arm(log) != NGX_OK) {
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_notify_arm(ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_iouring_get_sqe(1, log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = notify_fd;
+    sqe->poll32_events = EPOLLIN|EPOLLET;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = NGX_IOURING_NOTIFY;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_iouring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+#endif
+
+
+static void
+ngx_iouring_done(ngx_cycle_t *cycle)
+{
+    if (sqes && munmap(sqes, sqes_size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "munmap(IORING_OFF_SQES) failed");
+    }
+
+    if (sq_ring && munmap(sq_ring, sq_ring_size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "munmap(IORING_OFF_SQ_RING) failed");
+    }
+
+    sqes = NULL;
+    sq_ring = NULL;
+    cq_ring = NULL;
+
+    if (ring != -1 && close(ring) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    ring = -1;
+
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1 && close(notify_fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "eventfd close() failed");
+    }
+
+    notify_fd = -1;
+
+#endif
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+    /* the buffer ring is unregistered along with the ring */
+
+    if (polls) {
+        ngx_iouring_free_io();
+    }
+
+    if (buf_ring) {
+        ngx_free(buf_data);
+        ngx_free(bufs);
+        ngx_free(buf_ring);
+    }
+
+    buf_data = NULL;
+    bufs = NULL;
+    buf_ring = NULL;
+
+    ngx_use_iouring_buffers = 0;
+
+#endif
+
+    ngx_free(polls);
+
+    polls = NULL;
+    npolls = 0;
+}
+
+
+static ngx_int_t
+ngx_iouring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    uint32_t           events, prev;
+    ngx_event_t       *e;
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+    if (polls[c - ngx_cycle->connections].io
+        && polls[c - ngx_cycle->connections].io->active)
+    {
+        /* completions are reported without polling */
+        ev->active = 1;
+        return NGX_OK;
+    }
+
+#endif
+
+    if (event == NGX_READ_EVENT) {
+        e = c->write;
+        events = EPOLLIN|EPOLLRDHUP;
+        prev = EPOLLOUT;
+
+    } else {
+        e = c->read;
+        events = EPOLLOUT;
+        prev = EPOLLIN|EPOLLRDHUP;
+    }
+
+    if (e->active) {
+        events |= prev;
+    }
+
+    /*
+     * level-triggered requests are used for listening sockets only,
+     * NGX_EXCLUSIVE_EVENT is not supported
+     */
+
+    if (flags & NGX_CLEAR_EVENT) {
+        events |= EPOLLET;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring add event: fd:%d ev:%ui ev:%08XD",
+                   c->fd, event, events);
+
+    if (ngx_iouring_arm(c, events) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ev->active = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    uint32_t           events;
+    ngx_event_t       *e;
+    ngx_connection_t  *c;
+
+    /*
+     * unlike epoll, the request is not removed when the file descriptor
+     * is closed, so it is deleted even with NGX_CLOSE_EVENT
+     */
+
+    c = ev->data;
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+    if (polls[c - ngx_cycle->connections].io
+        && polls[c - ngx_cycle->connections].io->active)
+    {
+        ev->active = 0;
+        return NGX_OK;
+    }
+
+#endif
+
+    if (event == NGX_READ_EVENT) {
+        e = c->write;
+        events = EPOLLOUT;
+
+    } else {
+        e = c->read;
+        events = EPOLLIN|EPOLLRDHUP;
+    }
+
+    if (e->active) {
+        events |= polls[c - ngx_cycle->connections].events & EPOLLET;
+
+    } else {
+        events = 0;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring del event: fd:%d ev:%ui ev:%08XD",
+                   c->fd, event, events);
+
+    if (ngx_iouring_arm(c, events) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ev->active = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_add_connection(ngx_connection_t *c)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring add connection: fd:%d", c->fd);
+
+    if (ngx_iouring_arm(c, EPOLLIN|EPOLLOUT|EPOLLET|EPOLLRDHUP) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    c->read->active = 1;
+    c->write->active = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_del_connection(ngx_connection_t *c, ngx_uint_t flags)
+{
+#if (NGX_HAVE_IOURING_BUF_RING)
+    ngx_iouring_io_t  *io;
+#endif
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring del connection: fd:%d", c->fd);
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+    io = polls[c - ngx_cycle->connections].io;
+
+    if (io && io->active) {
+        ngx_iouring_stop(c, io);
+
+        c->read->active = 0;
+        c->write->active = 0;
+
+        return NGX_OK;
+    }
+
+#endif
+
+    if (ngx_iouring_arm(c, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    c->read->active = 0;
+    c->write->active = 0;
+
+    return NGX_OK;
+}
+
+
+/*
+ * replaces the request of the connection with a new one for the events,
+ * the removal is hard-linked to the addition, so the latter is started
+ * even if the removed request has already completed
+ */
+
+static ngx_int_t
+ngx_iouring_arm(ngx_connection_t *c, uint32_t events)
+{
+    ngx_uint_t            slot;
+    ngx_iouring_poll_t   *p;
+    struct io_uring_sqe  *sqe;
+
+    slot = c - ngx_cycle->connections;
+    p = &polls[slot];
+
+    sqe = ngx_iouring_get_sqe(2, c->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (p->events) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = ngx_iouring_data(slot, p->generation, NGX_IOURING_POLL);
+        sqe->user_data = 0;
+
+        if (events) {
+            sqe->flags = IOSQE_IO_HARDLINK;
+            sqe = ngx_iouring_get_sqe(1, c->log);
+        }
+    }
+
+    p->generation++;
+    p->events = events;
+
+    if (events == 0) {
+        return NGX_OK;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = events;
+    sqe->len = (events & EPOLLET) ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = ngx_iouring_data(slot, p->generation, NGX_IOURING_POLL);
+
+    return NGX_OK;
+}
+
+
+/*
+ * returns a cleared submission queue entry, n entries are guaranteed to be
+ * available without flushing the queue in between
+ */
+
+static struct io_uring_sqe *
+ngx_iouring_get_sqe(ngx_uint_t n, ngx_log_t *log)
+{
+    unsigned              tail;
+    struct io_uring_sqe  *sqe;
+
+    tail = *sq_tail;
+
+    if (tail + n - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_entries) {
+        if (ngx_iouring_submit(log) != NGX_OK) {
+            return NULL;
+        }
+
+        if (tail + n - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)
+            > sq_entries)
+        {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "io_uring submission queue is full");
+            return NULL;
+        }
+    }
+
+    sqe = &sqes[tail & sq_mask];
+
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    sq_pending++;
+
+    return sqe;
+}
+
+
+static ngx_int_t
+ngx_iouring_submit(ngx_log_t *log)
+{
+    int  n;
+
+    while (sq_pending) {
+        n = io_uring_enter(ring, sq_pending, 0, 0, NULL, 0);
+
+        if (n == -1) {
+            if (ngx_errno == NGX_EINTR) {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "io_uring_enter() failed");
+            return NGX_ERROR;
+        }
+
+        sq_pending -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_iouring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_iouring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags)
+{
+    int                               n;
+    unsigned                          head, tail;
+    uint32_t                          revents, generation, cflags;
+    uint64_t                          data;
+    ngx_int_t                         res;
+    ngx_uint_t                        slot, level, more;
+    ngx_err_t                         err;
+    ngx_event_t                      *rev, *wev;
+    ngx_queue_t                      *queue;
+    ngx_connection_t                 *c;
+    ngx_iouring_poll_t               *p;
+#if (NGX_HAVE_IOURING_BUF_RING)
+    ngx_uint_t                        op;
+    ngx_iouring_io_t                 *io;
+#endif
+    struct io_uring_cqe              *cqe;
+    struct __kernel_timespec          ts;
+    struct io_uring_getevents_arg     arg;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring timer: %M, submit: %ud", timer, sq_pending);
+
+    ngx_memzero(&arg, sizeof(struct io_uring_getevents_arg));
+
+    if (timer != NGX_TIMER_INFINITE) {
+        ts.tv_sec = timer / 1000;
+        ts.tv_nsec = (timer % 1000) * 1000000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+
+    /* queued requests are submitted along with waiting */
+
+    n = io_uring_enter(ring, sq_pending, 1,
+                       IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(struct io_uring_getevents_arg));
+
+    err = (n == -1) ? ngx_errno : 0;
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (n > 0) {
+        sq_pending -= n;
+    }
+
+    if (err == ETIME) {
+        err = 0;
+    }
+
+    if (err) {
+        if (err == NGX_EINTR) {
+
+            if (ngx_event_timer_alarm) {
+                ngx_event_timer_alarm = 0;
+                return NGX_OK;
+            }
+
+            level = NGX_LOG_INFO;
+
+        } else if (err == NGX_EAGAIN || err == NGX_EBUSY) {
+
+            /* completions have to be reaped first */
+
+            level = 0;
+
+        } else {
+            level = NGX_LOG_ALERT;
+        }
+
+        if (level) {
+            ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    head = *cq_head;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        if (timer != NGX_TIMER_INFINITE) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring_enter() returned no events without timeout");
+        return NGX_ERROR;
+    }
+
+    for ( /* void */ ; head != tail; head++) {
+        cqe = &cqes[head & cq_mask];
+
+        data = cqe->user_data;
+        res = cqe->res;
+        cflags = cqe->flags;
+        more = cflags & IORING_CQE_F_MORE;
+
+        /* the entry is released before handlers may add new requests */
+
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (data == 0) {
+            /* IORING_OP_POLL_REMOVE */
+            continue;
+        }
+
+#if (NGX_HAVE_EVENTFD)
+
+        if (data == NGX_IOURING_NOTIFY) {
+
+            if (!more && ngx_iouring_notify_arm(cycle->log) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (res > 0) {
+                notify_event.handler(&notify_event);
+            }
+
+            continue;
+        }
+
+#endif
+
+        slot = (ngx_uint_t) (data >> 32) - 1;
+        generation = (uint32_t) data & ~3;
+
+        c = &cycle->connections[slot];
+        p = &polls[slot];
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+        op = (ngx_uint_t) (data & 3);
+
+        if (op != NGX_IOURING_POLL) {
+            io = p->io;
+
+            if (io == NULL || !io->active
+                || ngx_iouring_generation(p->generation) != generation)
+            {
+                ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                               "io_uring: stale completion %p op:%ui res:%i",
+                               c, op, res);
+
+                if (cflags & IORING_CQE_F_BUFFER) {
+                    ngx_iouring_return_buf(
+                                 &bufs[cflags >> IORING_CQE_BUFFER_SHIFT]);
+                }
+
+                continue;
+            }
+
+            if (op == NGX_IOURING_RECV) {
+                if (ngx_iouring_recv_event(c, io, res, cflags, flags)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+            } else {
+                if (ngx_iouring_send_event(c, io, res, flags) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+            }
+
+            continue;
+        }
+
+#endif
+
+        if (c->fd == -1 || ngx_iouring_generation(p->generation) != generation)
+        {
+
+            /*
+             * the stale event from a request that was removed
+             * or from a file descriptor that was just closed
+             */
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring: stale event %p res:%i", c, res);
+            continue;
+        }
+
+        if (!more) {
+            p->events = 0;
+        }
+
+        if (res < 0) {
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring poll error on fd:%d: %i", c->fd, res);
+
+            revents = EPOLLERR;
+
+        } else {
+            revents = (uint32_t) res;
+        }
+
+        ngx_log_debug4(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: fd:%d ev:%04XD d:%XL more:%ui",
+                       c->fd, revents, data, more);
+
+        if (revents & (EPOLLERR|EPOLLHUP)) {
+
+            /*
+             * if the error events were returned, add EPOLLIN and EPOLLOUT
+             * to handle the events at least in one active handler
+             */
+
+            revents |= EPOLLIN|EPOLLOUT;
+        }
+
+        rev = c->read;
+
+        if ((revents & EPOLLIN) && rev->active) {
+
+#if (NGX_HAVE_EPOLLRDHUP)
+            if (revents & EPOLLRDHUP) {
+                rev->pending_eof = 1;
+            }
+
+            rev->available = 1;
+#endif
+
+            rev->ready = 1;
+
+            if (flags & NGX_POST_EVENTS) {
+                queue = rev->accept ? &ngx_posted_accept_events
+                                    : &ngx_posted_events;
+
+                ngx_post_event(rev, queue);
+
+            } else {
+                rev->handler(rev);
+            }
+        }
+
+        wev = c->write;
+
+        if ((revents & EPOLLOUT) && wev->active) {
+
+            if (c->fd == -1
+                || ngx_iouring_generation(p->generation) != generation)
+            {
+                /*
+                 * the stale event from a file descriptor
+                 * that was just closed in this iteration
+                 */
+
+                ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                               "io_uring: stale event %p", c);
+                continue;
+            }
+
+            wev->ready = 1;
+#if (NGX_THREADS)
+            wev->complete = 1;
+#endif
+
+            if (flags & NGX_POST_EVENTS) {
+                ngx_post_event(wev, &ngx_posted_events);
+
+            } else {
+                wev->handler(wev);
+            }
+        }
+
+        /*
+         * one-shot requests and multishot requests terminated
+         * by the kernel are rearmed while the events are active
+         */
+
+        if (!more && res >= 0 && c->fd != -1 && p->events == 0
+            && ngx_iouring_generation(p->generation) == generation
+            && (c->read->active || c->write->active))
+        {
+            revents = (c->read->active ? EPOLLIN|EPOLLRDHUP : 0)
+                      | (c->write->active ? EPOLLOUT : 0);
+
+            if (!c->read->accept) {
+                revents |= EPOLLET;
+            }
+
+            if (ngx_iouring_arm(c, revents) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+ngx_int_t
+ngx_iouring_start(ngx_connection_t *c)
+{
+    ngx_uint_t           slot;
+    ngx_iouring_io_t    *io;
+    ngx_iouring_poll_t  *p;
+
+    slot = c - ngx_cycle->connections;
+    p = &polls[slot];
+
+    if (p->io == NULL) {
+        p->io = ngx_alloc(sizeof(ngx_iouring_io_t), c->log);
+        if (p->io == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    io = p->io;
+
+    ngx_memzero(io, sizeof(ngx_iouring_io_t));
+
+    io->last = &io->head;
+    io->slot = slot;
+
+    /* the poll request is removed, its completions become stale */
+
+    if (ngx_iouring_arm(c, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring start: fd:%d", c->fd);
+
+    io->active = 1;
+
+    c->read->ready = 0;
+    c->read->active = 1;
+    c->write->ready = 1;
+    c->write->active = 1;
+
+    c->recv = ngx_iouring_recv;
+    c->send_chain = ngx_iouring_send_chain;
+
+    ngx_iouring_recv_arm(c, io);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_iouring_stop(ngx_connection_t *c, ngx_iouring_io_t *io)
+{
+    ngx_iouring_buf_t  *d, *next;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring stop: fd:%d recv:%ud send:%uz",
+                   c->fd, io->recv, io->send);
+
+    if (io->recv) {
+        ngx_iouring_cancel(ngx_iouring_data(io->slot,
+                                            polls[io->slot].generation,
+                                            NGX_IOURING_RECV),
+                           c->log);
+    }
+
+    if (io->send) {
+        ngx_iouring_cancel(ngx_iouring_data(io->slot,
+                                            polls[io->slot].generation,
+                                            NGX_IOURING_SEND),
+                           c->log);
+    }
+
+    /* the requests no longer reference the buffers after this */
+
+    (void) ngx_iouring_submit(c->log);
+
+    polls[io->slot].generation++;
+
+    io->active = 0;
+    io->recv = 0;
+    io->send = 0;
+    io->held = 0;
+
+    if (io->starved) {
+        ngx_queue_remove(&io->queue);
+        io->starved = 0;
+    }
+
+    ngx_iouring_unpin(io);
+
+    for (d = io->head; d; d = next) {
+        next = d->next;
+        ngx_iouring_return_buf(d);
+    }
+
+    io->head = NULL;
+    io->last = &io->head;
+}
+
+
+static void
+ngx_iouring_cancel(uint64_t data, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_iouring_get_sqe(1, log);
+    if (sqe == NULL) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->user_data = 0;
+}
+
+
+static void
+ngx_iouring_recv_arm(ngx_connection_t *c, ngx_iouring_io_t *io)
+{
+    struct io_uring_sqe  *sqe;
+
+    if (io->recv || io->eof || io->error || io->starved
+        || io->held >= NGX_IOURING_HELD)
+    {
+        return;
+    }
+
+    sqe = ngx_iouring_get_sqe(1, c->log);
+
+    if (sqe == NULL) {
+        /* reported to the consumer as a recv() error */
+        io->error = NGX_ENOMEM;
+        c->read->ready = 1;
+        ngx_post_event(c->read, &ngx_posted_events);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = NGX_IOURING_BGID;
+    sqe->user_data = ngx_iouring_data(io->slot, polls[io->slot].generation,
+                                      NGX_IOURING_RECV);
+
+    io->recv = 1;
+}
+
+
+static ngx_int_t
+ngx_iouring_recv_event(ngx_connection_t *c, ngx_iouring_io_t *io,
+    ngx_int_t res, uint32_t cflags, ngx_uint_t flags)
+{
+    ngx_iouring_buf_t  *d;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring recv: fd:%d res:%i flags:%XD held:%ui",
+                   c->fd, res, cflags, io->held);
+
+    if (!(cflags & IORING_CQE_F_MORE)) {
+        io->recv = 0;
+        io->cancel = 0;
+    }
+
+    if (res > 0) {
+        d = &bufs[cflags >> IORING_CQE_BUFFER_SHIFT];
+
+        d->buf.pos = d->buf.start;
+        d->buf.last = d->buf.start + res;
+        d->buf.temporary = 1;
+        d->buf.flush = 0;
+        d->buf.last_buf = 0;
+        d->buf.tag = (ngx_buf_tag_t) &ngx_iouring_module;
+
+        d->next = NULL;
+        d->slot = io->slot;
+        d->generation = polls[io->slot].generation;
+        d->pinned = 0;
+        d->freed = 0;
+
+        *io->last = d;
+        io->last = &d->next;
+
+        if (++io->held >= NGX_IOURING_HELD && io->recv && !io->cancel) {
+
+            /* the consumer does not keep up, the rest stays in the socket */
+
+            ngx_iouring_cancel(ngx_iouring_data(io->slot,
+                                                polls[io->slot].generation,
+                                                NGX_IOURING_RECV),
+                               c->log);
+            io->cancel = 1;
+        }
+
+    } else if (res == 0) {
+        io->eof = 1;
+
+    } else if (res == -ENOBUFS) {
+
+        /* rearmed as soon as a buffer is returned to the ring */
+
+        io->starved = 1;
+        ngx_queue_insert_tail(&starved, &io->queue);
+
+        return NGX_OK;
+
+    } else if (res == -ECANCELED) {
+        ngx_iouring_recv_arm(c, io);
+        return NGX_OK;
+
+    } else {
+        io->error = -res;
+    }
+
+    ngx_iouring_recv_arm(c, io);
+
+    c->read->ready = 1;
+
+    ngx_iouring_post(c->read, flags);
+
+    return NGX_OK;
+}
+
+
+ssize_t
+ngx_iouring_recv_buf(ngx_connection_t *c, ngx_buf_t **bp)
+{
+    ssize_t             n;
+    ngx_event_t        *rev;
+    ngx_iouring_io_t   *io;
+    ngx_iouring_buf_t  *d;
+
+    io = polls[c - ngx_cycle->connections].io;
+    rev = c->read;
+
+    d = io->head;
+
+    if (d) {
+        io->head = d->next;
+
+        if (io->head == NULL) {
+            io->last = &io->head;
+
+            if (!io->eof && !io->error) {
+                rev->ready = 0;
+            }
+        }
+
+        n = d->buf.last - d->buf.pos;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "io_uring recv buf: fd:%d %z", c->fd, n);
+
+        *bp = &d->buf;
+
+        return n;
+    }
+
+    rev->ready = 0;
+
+    if (io->error) {
+        rev->error = 1;
+        ngx_connection_error(c, io->error, "recv() failed");
+        return NGX_ERROR;
+    }
+
+    if (io->eof) {
+        rev->eof = 1;
+        return 0;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_iouring_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ssize_t            n;
+    ngx_buf_t         *b;
+    ngx_iouring_io_t  *io;
+
+    io = polls[c - ngx_cycle->connections].io;
+
+    if (io->head == NULL) {
+        return ngx_iouring_recv_buf(c, &b);
+    }
+
+    /* the data are copied for the users of c->recv() */
+
+    b = &io->head->buf;
+
+    n = ngx_min((size_t) (b->last - b->pos), size);
+
+    ngx_memcpy(buf, b->pos, n);
+    b->pos += n;
+
+    if (b->pos == b->last) {
+        (void) ngx_iouring_recv_buf(c, &b);
+        ngx_iouring_free_buf(b);
+    }
+
+    return n;
+}
+
+
+void
+ngx_iouring_free_buf(ngx_buf_t *b)
+{
+    ngx_iouring_io_t   *io;
+    ngx_iouring_buf_t  *d;
+
+    d = (ngx_iouring_buf_t *) b;
+    io = polls[d->slot].io;
+
+    if (io->active && polls[d->slot].generation == d->generation) {
+        io->held--;
+        ngx_iouring_recv_arm(&ngx_cycle->connections[d->slot], io);
+    }
+
+    if (d->pinned) {
+        d->freed = 1;
+        return;
+    }
+
+    ngx_iouring_return_buf(d);
+}
+
+
+static ngx_chain_t *
+ngx_iouring_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
+{
+    ngx_chain_t        *cl, *ln;
+    ngx_iovec_t         vec;
+    ngx_iouring_io_t   *io;
+    ngx_iouring_buf_t  *d;
+
+    io = polls[c - ngx_cycle->connections].io;
+
+    if (io->send_error) {
+        c->write->error = 1;
+        ngx_connection_error(c, io->send_error, "sendmsg() failed");
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (io->send) {
+        /* one request at a time keeps the data in order */
+        c->write->ready = 0;
+        return in;
+    }
+
+    /* the maximum limit size is the maximum size_t value - the page size */
+
+    if (limit == 0 || limit > (off_t) (NGX_MAX_SIZE_T_VALUE - ngx_pagesize)) {
+        limit = NGX_MAX_SIZE_T_VALUE - ngx_pagesize;
+    }
+
+    vec.iovs = io->iovs;
+    vec.nalloc = NGX_IOVS_PREALLOCATE;
+
+    cl = ngx_output_chain_to_iovec(&vec, in, (size_t) limit, c->log);
+
+    if (cl == NGX_CHAIN_ERROR) {
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (vec.size == 0) {
+        return cl;
+    }
+
+    ngx_memzero(&io->msg, sizeof(struct msghdr));
+
+    io->msg.msg_iov = io->iovs;
+    io->msg.msg_iovlen = vec.count;
+
+    if (ngx_iouring_sendmsg(c, io) != NGX_OK) {
+        return NGX_CHAIN_ERROR;
+    }
+
+    /* ring buffers are not returned until the request completes */
+
+    for (ln = in; ln != cl; ln = ln->next) {
+        if (ln->buf->tag != (ngx_buf_tag_t) &ngx_iouring_module
+            || ngx_buf_size(ln->buf) == 0)
+        {
+            continue;
+        }
+
+        d = (ngx_iouring_buf_t *) ln->buf;
+
+        if (!d->pinned) {
+            d->pinned = 1;
+            d->next = io->pinned;
+            io->pinned = d;
+        }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring sendmsg: fd:%d %uz of %ui iovs",
+                   c->fd, vec.size, vec.count);
+
+    io->send = vec.size;
+
+    c->buffered |= NGX_LOWLEVEL_BUFFERED;
+    c->write->ready = 0;
+
+    return ngx_chain_update_sent(in, vec.size);
+}
+
+
+static ngx_int_t
+ngx_iouring_sendmsg(ngx_connection_t *c, ngx_iouring_io_t *io)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_iouring_get_sqe(1, c->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &io->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->user_data = ngx_iouring_data(io->slot, polls[io->slot].generation,
+                                      NGX_IOURING_SEND);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_send_event(ngx_connection_t *c, ngx_iouring_io_t *io,
+    ngx_int_t res, ngx_uint_t flags)
+{
+    size_t         n;
+    struct iovec  *iov;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring send: fd:%d res:%i of %uz", c->fd, res, io->send);
+
+    if (res > 0 && (size_t) res < io->send) {
+
+        /* the rest is sent with a new request from the same buffers */
+
+        c->sent += res;
+        io->send -= res;
+
+        n = res;
+        iov = io->msg.msg_iov;
+
+        while (n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            io->msg.msg_iovlen--;
+        }
+
+        iov->iov_base = (u_char *) iov->iov_base + n;
+        iov->iov_len -= n;
+
+        io->msg.msg_iov = iov;
+
+        return ngx_iouring_sendmsg(c, io);
+    }
+
+    if (res > 0) {
+        c->sent += res;
+        c->buffered &= ~NGX_LOWLEVEL_BUFFERED;
+
+    } else {
+        /* NGX_LOWLEVEL_BUFFERED is kept to report the error on next send */
+        io->send_error = res ? -res : NGX_ECONNRESET;
+    }
+
+    io->send = 0;
+
+    ngx_iouring_unpin(io);
+
+    c->write->ready = 1;
+#if (NGX_THREADS)
+    c->write->complete = 1;
+#endif
+
+    ngx_iouring_post(c->write, flags);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_iouring_unpin(ngx_iouring_io_t *io)
+{
+    ngx_iouring_buf_t  *d, *next;
+
+    for (d = io->pinned; d; d = next) {
+        next = d->next;
+
+        d->pinned = 0;
+
+        if (d->freed) {
+            ngx_iouring_return_buf(d);
+        }
+    }
+
+    io->pinned = NULL;
+}
+
+
+static void
+ngx_iouring_return_buf(ngx_iouring_buf_t *d)
+{
+    ngx_queue_t          *q;
+    ngx_iouring_io_t     *io;
+    struct io_uring_buf  *buf;
+
+    buf = &buf_ring->bufs[buf_tail & buf_mask];
+
+    buf->addr = (uint64_t) (uintptr_t) d->buf.start;
+    buf->len = d->buf.end - d->buf.start;
+    buf->bid = d - bufs;
+
+    __atomic_store_n(&buf_ring->tail, (uint16_t) ++buf_tail, __ATOMIC_RELEASE);
+
+    if (ngx_queue_empty(&starved)) {
+        return;
+    }
+
+    q = ngx_queue_head(&starved);
+    ngx_queue_remove(q);
+
+    io = ngx_queue_data(q, ngx_iouring_io_t, queue);
+    io->starved = 0;
+
+    ngx_iouring_recv_arm(&ngx_cycle->connections[io->slot], io);
+}
+
+
+static void
+ngx_iouring_post(ngx_event_t *ev, ngx_uint_t flags)
+{
+    if (flags & NGX_POST_EVENTS) {
+        ngx_post_event(ev, &ngx_posted_events);
+
+    } else {
+        ev->handler(ev);
+    }
+}
+
+#endif
+
+
+static void *
+ngx_iouring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_iouring_conf_t  *iucf;
+
+    iucf = ngx_palloc(cycle->pool, sizeof(ngx_iouring_conf_t));
+    if (iucf == NULL) {
+        return NULL;
+    }
+
+    iucf->entries = NGX_CONF_UNSET;
+    iucf->buffers.num = 0;
+    iucf->buffers.size = 0;
+
+    return iucf;
+}
+
+
+static char *
+ngx_iouring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_iouring_conf_t *iucf = conf;
+
+    ngx_conf_init_uint_value(iucf->entries, 1024);
+
+    if (iucf->buffers.num
+        && (iucf->buffers.num > 32768
+            || (iucf->buffers.num & (iucf->buffers.num - 1))))
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "the \"iouring_buffers\" number must be a power of 2 "
+                      "not greater than 32768");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
@@ -526,6 +526,16 @@ u_char *ngx_acceptex_log_error(ngx_log_t *log, u_char *buf, size_t len);
 ngx_int_t ngx_send_lowat(ngx_connection_t *c, size_t lowat);
 
 
+#if (NGX_HAVE_IOURING_BUF_RING)
+extern ngx_uint_t             ngx_use_iouring_buffers;
+extern ngx_module_t           ngx_iouring_module;
+
+ngx_int_t ngx_iouring_start(ngx_connection_t *c);
+ssize_t ngx_iouring_recv_buf(ngx_connection_t *c, ngx_buf_t **bp);
+void ngx_iouring_free_buf(ngx_buf_t *b);
+#endif
+
+
 /* used in ngx_log_debugX() */
 #define ngx_event_ident(p)  ((ngx_connection_t *) (p))->fd
 
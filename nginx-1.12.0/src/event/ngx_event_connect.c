@@ -145,6 +145,35 @@ ngx_event_connect_peer(ngx_peer_connection_t *pc)
         }
     }
 
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+
+    if (pc->fastopen) {
+        int  fastopen = 1;
+
+        /* connect() returns at once, the SYN carries the first send() */
+
+        if (setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                       (const void *) &fastopen, sizeof(int))
+            == -1)
+        {
+            err = ngx_socket_errno;
+
+            if (err != NGX_EOPNOTSUPP && err != NGX_ENOPROTOOPT) {
+                ngx_log_error(NGX_LOG_ALERT, pc->log, err,
+                              "setsockopt(TCP_FASTOPEN_CONNECT) failed, "
+                              "ignored");
+            }
+
+            pc->fastopen = 0;
+        }
+    }
+
+#else
+
+    pc->fastopen = 0;
+
+#endif
+
     if (type == SOCK_STREAM) {
         c->recv = ngx_recv;
         c->send = ngx_send;
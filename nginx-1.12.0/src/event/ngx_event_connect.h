@@ -62,6 +62,7 @@ struct ngx_peer_connection_s {
 
     unsigned                         cached:1;
     unsigned                         transparent:1;
+    unsigned                         fastopen:1;
 
                                      /* ngx_connection_log_error_e */
     unsigned                         log_error:2;
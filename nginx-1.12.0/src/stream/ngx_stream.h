@@ -60,6 +60,9 @@ typedef struct {
     int                            tcp_keepidle;
     int                            tcp_keepintvl;
     int                            tcp_keepcnt;
+#endif
+#if (NGX_HAVE_TCP_FASTOPEN)
+    int                            fastopen;
 #endif
     int                            backlog;
     int                            type;
@@ -220,6 +223,9 @@ struct ngx_stream_session_s {
 
     unsigned                       ssl:1;
 
+    /* a filter needs relayed data in memory, e.g. to encrypt it */
+    unsigned                       filter_need_in_memory:1;
+
     unsigned                       stat_processing:1;
 
     unsigned                       health_check:1;
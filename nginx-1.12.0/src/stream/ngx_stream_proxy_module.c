@@ -24,14 +24,35 @@ typedef struct {
     ngx_msec_t                       timeout;
     ngx_msec_t                       next_upstream_timeout;
     size_t                           buffer_size;
+    size_t                           min_buffer_size;
+    size_t                           max_buffer_size;
     size_t                           upload_rate;
     size_t                           download_rate;
     ngx_uint_t                       responses;
     ngx_uint_t                       next_upstream_tries;
+    ngx_uint_t                       connect_race;
+    ngx_msec_t                       connect_race_delay;
     ngx_flag_t                       next_upstream;
     ngx_flag_t                       proxy_protocol;
+    ngx_uint_t                       keepalive_framing;
     ngx_stream_upstream_local_t     *local;
 
+#if (NGX_HAVE_SPLICE)
+    ngx_flag_t                       splice;
+#endif
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    size_t                           zerocopy_threshold;
+#endif
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+    ngx_flag_t                       iouring;
+#endif
+
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+    ngx_flag_t                       fastopen;
+#endif
+
 #if (NGX_STREAM_SSL)
     ngx_flag_t                       ssl_enable;
     ngx_flag_t                       ssl_session_reuse;
@@ -56,6 +77,155 @@ typedef struct {
 } ngx_stream_proxy_srv_conf_t;
 
 
+#define NGX_STREAM_PROXY_BUFFER_SHIFT    10         /* 1K */
+#define NGX_STREAM_PROXY_BUFFER_CLASSES  15         /* 1K .. 16M */
+#define NGX_STREAM_PROXY_FREE_BUFFERS    (4 * 1024 * 1024)
+
+#define NGX_STREAM_PROXY_BUFFER_GROW     2
+#define NGX_STREAM_PROXY_BUFFER_SHRINK   8
+
+
+typedef struct ngx_stream_proxy_buffer_s  ngx_stream_proxy_buffer_t;
+
+struct ngx_stream_proxy_buffer_s {
+    ngx_stream_proxy_buffer_t       *next;
+};
+
+
+typedef struct {
+    size_t                           nfree;
+    ngx_stream_proxy_buffer_t       *free;
+} ngx_stream_proxy_buffers_t;
+
+
+typedef struct {
+    size_t                           size;     /* 0 if not adaptive */
+    ngx_uint_t                       full;
+    ngx_uint_t                       partial;
+} ngx_stream_proxy_adaptive_t;
+
+
+#if (NGX_HAVE_SPLICE)
+
+#define NGX_STREAM_PROXY_FREE_PIPES  64
+
+
+typedef struct ngx_stream_proxy_pipe_s  ngx_stream_proxy_pipe_t;
+
+struct ngx_stream_proxy_pipe_s {
+    ngx_fd_t                         fd[2];
+    size_t                           size;
+    size_t                           capacity;
+    ngx_uint_t                       active;   /* unsigned  active:1; */
+    ngx_stream_proxy_pipe_t         *next;
+};
+
+
+#endif
+
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+typedef struct {
+    uint32_t                         sent;
+    uint32_t                         completed;
+    ngx_uint_t                       enabled;  /* unsigned  enabled:1; */
+} ngx_stream_proxy_zerocopy_t;
+
+
+#define NGX_STREAM_PROXY_ZEROCOPY_REAP   100        /* ms */
+#define NGX_STREAM_PROXY_ZEROCOPY_HOLD   60         /* s */
+
+
+typedef struct ngx_stream_proxy_zerocopy_held_s
+    ngx_stream_proxy_zerocopy_held_t;
+
+struct ngx_stream_proxy_zerocopy_held_s {
+    ngx_socket_t                     fd;
+    ngx_stream_proxy_zerocopy_t      zerocopy;
+    ngx_buf_t                        buf;
+    time_t                           start;
+    ngx_stream_proxy_zerocopy_held_t *next;
+};
+
+#endif
+
+
+/*
+ * messages prefixed with their big-endian length, e.g. DNS over TCP;
+ * the values are the size of the length prefix
+ */
+
+#define NGX_STREAM_PROXY_FRAMING_OFF       0
+#define NGX_STREAM_PROXY_FRAMING_LENGTH16  2
+#define NGX_STREAM_PROXY_FRAMING_LENGTH32  4
+
+
+typedef struct {
+    ngx_uint_t                       messages; /* complete messages */
+    ngx_uint_t                       header;   /* prefix bytes seen */
+    size_t                           length;
+    size_t                           left;     /* bytes of the current
+                                                  message body */
+} ngx_stream_proxy_framing_t;
+
+
+typedef struct {
+    ngx_peer_connection_t           *peers;    /* connects in parallel
+                                                  to the primary one */
+    ngx_stream_upstream_rr_peer_t  **current;  /* peers they were given */
+    ngx_stream_upstream_rr_weight_t **weight;
+    ngx_uint_t                       npeers;
+    ngx_uint_t                       active;
+    ngx_event_t                      event;    /* staggers the next one */
+} ngx_stream_proxy_race_t;
+
+
+typedef struct {
+    ngx_stream_proxy_adaptive_t      adaptive[2];  /* indexed by
+                                                      from_upstream */
+    ngx_stream_proxy_race_t         *race;
+    ngx_stream_proxy_framing_t       framing[2];   /* indexed by
+                                                      from_upstream */
+#if (NGX_HAVE_SPLICE)
+    ngx_stream_proxy_pipe_t         *pipe[2];
+#endif
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    ngx_stream_proxy_zerocopy_t      zerocopy;
+#endif
+#if (NGX_HAVE_IOURING_BUF_RING)
+    ngx_uint_t                       iouring;
+#endif
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+    size_t                           fastopen;     /* preread bytes sent
+                                                      with SYN */
+#endif
+} ngx_stream_proxy_ctx_t;
+
+
+/*
+ * the connections are switched to io_uring completions once the data
+ * in the proxy buffers are sent, the ring buffers are passed on after that
+ */
+
+#define NGX_STREAM_PROXY_IOURING_OFF      0
+#define NGX_STREAM_PROXY_IOURING_PENDING  1
+#define NGX_STREAM_PROXY_IOURING_ACTIVE   2
+
+
+/*
+ * the upstream buffer cannot be reused while the kernel still
+ * references its pages for MSG_ZEROCOPY sends to the client
+ */
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+#define ngx_stream_proxy_pinned(ctx, from_upstream)                          \
+    ((from_upstream) && (ctx)->zerocopy.sent != (ctx)->zerocopy.completed)
+#else
+#define ngx_stream_proxy_pinned(ctx, from_upstream)  0
+#endif
+
+
 static void ngx_stream_proxy_handler(ngx_stream_session_t *s);
 static ngx_int_t ngx_stream_proxy_eval(ngx_stream_session_t *s,
     ngx_stream_proxy_srv_conf_t *pscf);
@@ -70,8 +240,56 @@ static void ngx_stream_proxy_process_connection(ngx_event_t *ev,
     ngx_uint_t from_upstream);
 static void ngx_stream_proxy_connect_handler(ngx_event_t *ev);
 static ngx_int_t ngx_stream_proxy_test_connect(ngx_connection_t *c);
+static void ngx_stream_proxy_race_interleave(ngx_resolver_addr_t *addrs,
+    ngx_uint_t naddrs, ngx_pool_t *pool);
+static ngx_int_t ngx_stream_proxy_race_start(ngx_stream_session_t *s);
+static void ngx_stream_proxy_race_timer_handler(ngx_event_t *ev);
+static void ngx_stream_proxy_race_next(ngx_stream_session_t *s);
+static void ngx_stream_proxy_race_handler(ngx_event_t *ev);
+static void ngx_stream_proxy_race_free(ngx_stream_session_t *s,
+    ngx_uint_t i, ngx_uint_t state);
+static void ngx_stream_proxy_race_win(ngx_stream_session_t *s,
+    ngx_peer_connection_t *peer);
+static ngx_int_t ngx_stream_proxy_race_promote(ngx_stream_session_t *s);
+static void ngx_stream_proxy_race_close(ngx_stream_session_t *s);
 static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
+static void ngx_stream_proxy_parse_framing(ngx_stream_proxy_framing_t *f,
+    ngx_uint_t header, u_char *p, u_char *last);
+static ngx_uint_t ngx_stream_proxy_keepalive_boundary(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_proxy_alloc_buffer(ngx_buf_t *b, size_t size,
+    ngx_log_t *log);
+static void ngx_stream_proxy_free_buffer(ngx_buf_t *b);
+static void ngx_stream_proxy_cleanup_buffers(void *data);
+static void ngx_stream_proxy_adapt_buffer(ngx_stream_proxy_srv_conf_t *pscf,
+    ngx_stream_proxy_adaptive_t *a, ngx_buf_t *b, ssize_t n);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_stream_proxy_init_splice(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_proxy_splice(ngx_stream_session_t *s,
+    ngx_stream_proxy_pipe_t *p, ngx_uint_t from_upstream,
+    ngx_uint_t do_write);
+static ngx_stream_proxy_pipe_t *ngx_stream_proxy_get_pipe(ngx_log_t *log);
+static void ngx_stream_proxy_free_pipe(ngx_stream_proxy_pipe_t *p);
+static void ngx_stream_proxy_cleanup_pipes(void *data);
+#endif
+#if (NGX_HAVE_MSG_ZEROCOPY)
+static ngx_int_t ngx_stream_proxy_init_zerocopy(ngx_stream_session_t *s);
+static ngx_chain_t *ngx_stream_proxy_zerocopy_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static ngx_int_t ngx_stream_proxy_zerocopy_reap(ngx_socket_t fd,
+    ngx_log_t *log, ngx_stream_proxy_zerocopy_t *zc);
+static void ngx_stream_proxy_zerocopy_close(ngx_stream_session_t *s);
+static void ngx_stream_proxy_zerocopy_held_handler(ngx_event_t *ev);
+#endif
+#if (NGX_HAVE_IOURING_BUF_RING)
+static void ngx_stream_proxy_init_iouring(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_proxy_iouring_start(ngx_stream_session_t *s);
+static ngx_uint_t ngx_stream_proxy_iouring_free(ngx_chain_t *cl,
+    ngx_uint_t all);
+#endif
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+static ngx_int_t ngx_stream_proxy_fastopen(ngx_stream_session_t *s);
+#endif
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
 static void ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc);
 static u_char *ngx_stream_proxy_log_error(ngx_log_t *log, u_char *buf,
@@ -84,6 +302,8 @@ static char *ngx_stream_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_stream_proxy_bind(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_stream_proxy_adaptive_buffer_size(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 
 #if (NGX_STREAM_SSL)
 
@@ -109,6 +329,19 @@ static ngx_conf_bitmask_t  ngx_stream_proxy_ssl_protocols[] = {
 #endif
 
 
+static ngx_conf_enum_t  ngx_stream_proxy_keepalive_framing[] = {
+    { ngx_string("off"), NGX_STREAM_PROXY_FRAMING_OFF },
+    { ngx_string("length16"), NGX_STREAM_PROXY_FRAMING_LENGTH16 },
+    { ngx_string("length32"), NGX_STREAM_PROXY_FRAMING_LENGTH32 },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_conf_num_bounds_t  ngx_stream_proxy_connect_race_bounds = {
+    ngx_conf_check_num_bounds, 1, 16
+};
+
+
 static ngx_conf_deprecated_t  ngx_conf_deprecated_proxy_downstream_buffer = {
     ngx_conf_deprecated, "proxy_downstream_buffer", "proxy_buffer_size"
 };
@@ -169,6 +402,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, buffer_size),
       &ngx_conf_deprecated_proxy_upstream_buffer },
 
+    { ngx_string("proxy_adaptive_buffer_size"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE12,
+      ngx_stream_proxy_adaptive_buffer_size,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("proxy_upload_rate"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_size_slot,
@@ -211,6 +451,20 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, next_upstream_timeout),
       NULL },
 
+    { ngx_string("proxy_connect_race"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, connect_race),
+      &ngx_stream_proxy_connect_race_bounds },
+
+    { ngx_string("proxy_connect_race_delay"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, connect_race_delay),
+      NULL },
+
     { ngx_string("proxy_protocol"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -218,6 +472,57 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, proxy_protocol),
       NULL },
 
+    { ngx_string("proxy_keepalive_framing"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, keepalive_framing),
+      &ngx_stream_proxy_keepalive_framing },
+
+#if (NGX_HAVE_SPLICE)
+
+    { ngx_string("proxy_splice"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, splice),
+      NULL },
+
+#endif
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+    { ngx_string("proxy_zerocopy_threshold"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, zerocopy_threshold),
+      NULL },
+
+#endif
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+    { ngx_string("proxy_iouring"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, iouring),
+      NULL },
+
+#endif
+
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+
+    { ngx_string("proxy_fastopen"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, fastopen),
+      NULL },
+
+#endif
+
 #if (NGX_STREAM_SSL)
 
     { ngx_string("proxy_ssl"),
@@ -348,12 +653,14 @@ ngx_module_t  ngx_stream_proxy_module = {
 static void
 ngx_stream_proxy_handler(ngx_stream_session_t *s)
 {
-    u_char                           *p;
+    size_t                            size;
     ngx_str_t                        *host;
     ngx_uint_t                        i;
     ngx_connection_t                 *c;
+    ngx_pool_cleanup_t               *cln;
     ngx_resolver_ctx_t               *ctx, temp;
     ngx_stream_upstream_t            *u;
+    ngx_stream_proxy_ctx_t           *pctx;
     ngx_stream_core_srv_conf_t       *cscf;
     ngx_stream_proxy_srv_conf_t      *pscf;
     ngx_stream_upstream_srv_conf_t   *uscf, **uscfp;
@@ -397,21 +704,45 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
         return;
     }
 
-    if (c->type == SOCK_STREAM) {
-        p = ngx_pnalloc(c->pool, pscf->buffer_size);
-        if (p == NULL) {
-            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-            return;
-        }
+    /*
+     * the proxy buffers are taken from a per-worker pool when data
+     * are read and are returned there once the data are sent,
+     * so idle sessions do not hold them
+     */
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
 
-        u->downstream_buf.start = p;
-        u->downstream_buf.end = p + pscf->buffer_size;
-        u->downstream_buf.pos = p;
-        u->downstream_buf.last = p;
+    cln->handler = ngx_stream_proxy_cleanup_buffers;
+    cln->data = u;
 
-        if (c->read->ready) {
-            ngx_post_event(c->read, &ngx_posted_events);
-        }
+    pctx = ngx_pcalloc(c->pool, sizeof(ngx_stream_proxy_ctx_t));
+    if (pctx == NULL) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    /*
+     * TCP buffers start at proxy_buffer_size and then follow the traffic
+     * within proxy_adaptive_buffer_size; UDP buffers must hold a whole
+     * datagram and keep the configured size
+     */
+
+    if (c->type == SOCK_STREAM && pscf->max_buffer_size) {
+        size = ngx_max(pscf->buffer_size, pscf->min_buffer_size);
+        size = ngx_min(size, pscf->max_buffer_size);
+
+        pctx->adaptive[0].size = size;
+        pctx->adaptive[1].size = size;
+    }
+
+    ngx_stream_set_ctx(s, pctx, ngx_stream_proxy_module);
+
+    if (c->type == SOCK_STREAM && c->read->ready) {
+        ngx_post_event(c->read, &ngx_posted_events);
     }
 
     if (pscf->upstream_value) {
@@ -650,9 +981,13 @@ static void
 ngx_stream_proxy_connect(ngx_stream_session_t *s)
 {
     ngx_int_t                     rc;
+    ngx_str_t                    *name;
     ngx_connection_t             *c, *pc;
     ngx_stream_upstream_t        *u;
     ngx_stream_proxy_srv_conf_t  *pscf;
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+    ngx_stream_proxy_ctx_t       *ctx;
+#endif
 
     c = s->connection;
 
@@ -681,10 +1016,54 @@ ngx_stream_proxy_connect(ngx_stream_session_t *s)
     u->state->first_byte_time = (ngx_msec_t) -1;
     u->state->response_time = ngx_current_msec;
 
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+
+    /*
+     * with data already at hand, e.g. the payload after the shadowsocks
+     * address header, it is sent in the SYN instead of after the handshake
+     */
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+    ctx->fastopen = 0;
+
+    u->peer.fastopen = pscf->fastopen
+                       && c->type == SOCK_STREAM
+                       && !u->proxy_protocol
+#if (NGX_STREAM_SSL)
+                       && pscf->ssl == NULL
+#endif
+                       && c->buffer
+                       && c->buffer->pos < c->buffer->last;
+
+#endif
+
     rc = ngx_event_connect_peer(&u->peer);
 
     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0, "proxy connect: %i", rc);
 
+    if (u->peer.name) {
+
+        /*
+         * a peer of a server resolved at run time may be freed once
+         * released, while its name is still logged for this attempt
+         */
+
+        name = ngx_palloc(c->pool, sizeof(ngx_str_t));
+        if (name == NULL) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        name->len = u->peer.name->len;
+        name->data = ngx_pstrdup(c->pool, u->peer.name);
+        if (name->data == NULL) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        u->peer.name = name;
+    }
+
     if (rc == NGX_ERROR) {
         ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
@@ -707,12 +1086,35 @@ ngx_stream_proxy_connect(ngx_stream_session_t *s)
 
     pc = u->peer.connection;
 
+    if (pc->pool == NULL) {
+        pc->pool = c->pool;
+    }
+
     pc->data = s;
     pc->log = c->log;
-    pc->pool = c->pool;
     pc->read->log = c->log;
     pc->write->log = c->log;
 
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+
+    if (rc == NGX_OK && u->peer.fastopen) {
+        rc = ngx_stream_proxy_fastopen(s);
+
+        if (rc == NGX_ERROR) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        if (rc == NGX_DECLINED) {
+            ngx_stream_proxy_next_upstream(s);
+            return;
+        }
+
+        /* rc == NGX_AGAIN */
+    }
+
+#endif
+
     if (rc != NGX_AGAIN) {
         ngx_stream_proxy_init_upstream(s);
         return;
@@ -722,6 +1124,11 @@ ngx_stream_proxy_connect(ngx_stream_session_t *s)
     pc->write->handler = ngx_stream_proxy_connect_handler;
 
     ngx_add_timer(pc->write, pscf->connect_timeout);
+
+    if (ngx_stream_proxy_race_start(s) != NGX_OK) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
 }
 
 
@@ -729,14 +1136,18 @@ static void
 ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
 {
     int                           tcp_nodelay;
+    size_t                        preread;
     u_char                       *p;
     ngx_chain_t                  *cl;
     ngx_connection_t             *c, *pc;
     ngx_log_handler_pt            handler;
     ngx_stream_upstream_t        *u;
     ngx_stream_core_srv_conf_t   *cscf;
+    ngx_stream_proxy_ctx_t       *ctx;
     ngx_stream_proxy_srv_conf_t  *pscf;
 
+    ngx_stream_proxy_race_close(s);
+
     u = s->upstream;
     pc = u->peer.connection;
 
@@ -815,23 +1226,57 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
 
     c->log->action = "proxying connection";
 
-    if (u->upstream_buf.start == NULL) {
-        p = ngx_pnalloc(c->pool, pscf->buffer_size);
-        if (p == NULL) {
-            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-            return;
-        }
+#if (NGX_HAVE_SPLICE)
+
+    if (pscf->splice && ngx_stream_proxy_init_splice(s) != NGX_OK) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+#endif
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+    if (pscf->zerocopy_threshold && ngx_stream_proxy_init_zerocopy(s) != NGX_OK)
+    {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+#endif
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+    if (pscf->iouring) {
+        ngx_stream_proxy_init_iouring(s);
+    }
+
+#endif
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    preread = c->buffer ? c->buffer->last - c->buffer->pos : 0;
+
+    if (pscf->keepalive_framing) {
+
+        /* the preread data, even if sent with SYN, start the exchange */
+
+        ngx_memzero(ctx->framing, sizeof(ctx->framing));
 
-        u->upstream_buf.start = p;
-        u->upstream_buf.end = p + pscf->buffer_size;
-        u->upstream_buf.pos = p;
-        u->upstream_buf.last = p;
+        if (preread) {
+            ngx_stream_proxy_parse_framing(&ctx->framing[0],
+                                           pscf->keepalive_framing,
+                                           c->buffer->pos, c->buffer->last);
+        }
     }
 
-    if (c->buffer && c->buffer->pos < c->buffer->last) {
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+    preread -= ctx->fastopen;
+#endif
+
+    if (preread) {
         ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
-                       "stream proxy add preread buffer: %uz",
-                       c->buffer->last - c->buffer->pos);
+                       "stream proxy add preread buffer: %uz", preread);
 
         cl = ngx_chain_get_free_buf(c->pool, &u->free);
         if (cl == NULL) {
@@ -840,6 +1285,7 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
         }
 
         *cl->buf = *c->buffer;
+        cl->buf->pos = cl->buf->last - preread;
 
         cl->buf->tag = (ngx_buf_tag_t) &ngx_stream_proxy_module;
         cl->buf->flush = 1;
@@ -1003,6 +1449,7 @@ static void
 ngx_stream_proxy_ssl_init_connection(ngx_stream_session_t *s)
 {
     ngx_int_t                     rc;
+    ngx_pool_t                   *pool;
     ngx_connection_t             *pc;
     ngx_stream_upstream_t        *u;
     ngx_stream_proxy_srv_conf_t  *pscf;
@@ -1013,6 +1460,16 @@ ngx_stream_proxy_ssl_init_connection(ngx_stream_session_t *s)
 
     pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
 
+    /* an SSL connection may outlive the session in the keepalive cache */
+
+    pool = ngx_create_pool(128, pc->log);
+    if (pool == NULL) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    pc->pool = pool;
+
     if (ngx_ssl_create_connection(pscf->ssl, pc, NGX_SSL_BUFFER|NGX_SSL_CLIENT)
         != NGX_OK)
     {
@@ -1243,6 +1700,13 @@ ngx_stream_proxy_resolve_handler(ngx_resolver_ctx_t *ctx)
     ur->naddrs = ctx->naddrs;
     ur->addrs = ctx->addrs;
 
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    if (pscf->connect_race > 1) {
+        ngx_stream_proxy_race_interleave(ur->addrs, ur->naddrs,
+                                         s->connection->pool);
+    }
+
 #if (NGX_DEBUG)
     {
     u_char      text[NGX_SOCKADDR_STRLEN];
@@ -1271,8 +1735,6 @@ ngx_stream_proxy_resolve_handler(ngx_resolver_ctx_t *ctx)
 
     u->peer.start_time = ngx_current_msec;
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
-
     if (pscf->next_upstream_tries
         && u->peer.tries > pscf->next_upstream_tries)
     {
@@ -1447,14 +1909,483 @@ ngx_stream_proxy_test_connect(ngx_connection_t *c)
 }
 
 
+/*
+ * connect racing (RFC 8305): when a name resolves to several addresses,
+ * further connects are started every proxy_connect_race_delay while the
+ * primary one is pending, or at once when an attempt fails; the first
+ * established connection is used and the rest are closed
+ */
+
 static void
-ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
-    ngx_uint_t do_write)
+ngx_stream_proxy_race_interleave(ngx_resolver_addr_t *addrs, ngx_uint_t naddrs,
+    ngx_pool_t *pool)
 {
-    off_t                        *received, limit;
-    size_t                        size, limit_rate;
-    ssize_t                       n;
-    ngx_buf_t                    *b;
+#if (NGX_HAVE_INET6)
+    int                   family;
+    ngx_uint_t            i, a, b;
+    ngx_resolver_addr_t  *tmp;
+
+    /* alternate address families, so a broken one delays a single step */
+
+    tmp = ngx_palloc(pool, naddrs * sizeof(ngx_resolver_addr_t));
+    if (tmp == NULL) {
+        return;
+    }
+
+    ngx_memcpy(tmp, addrs, naddrs * sizeof(ngx_resolver_addr_t));
+
+    family = tmp[0].sockaddr->sa_family;
+
+    a = 0;
+    b = 0;
+
+    for (i = 0; i < naddrs; i++) {
+
+        while (a < naddrs && tmp[a].sockaddr->sa_family != family) {
+            a++;
+        }
+
+        while (b < naddrs && tmp[b].sockaddr->sa_family == family) {
+            b++;
+        }
+
+        if (a < naddrs && (i % 2 == 0 || b == naddrs)) {
+            addrs[i] = tmp[a++];
+
+        } else {
+            addrs[i] = tmp[b++];
+        }
+    }
+#endif
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_race_start(ngx_stream_session_t *s)
+{
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_ctx_t       *ctx;
+    ngx_stream_proxy_race_t      *race;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    u = s->upstream;
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    if (pscf->connect_race < 2
+        || !pscf->next_upstream
+        || s->connection->type != SOCK_STREAM
+        || u->resolved == NULL
+        || u->resolved->naddrs < 2
+        || u->peer.tries < 2)
+    {
+        return NGX_OK;
+    }
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    race = ctx->race;
+
+    if (race == NULL) {
+        race = ngx_pcalloc(s->connection->pool,
+                           sizeof(ngx_stream_proxy_race_t));
+        if (race == NULL) {
+            return NGX_ERROR;
+        }
+
+        race->npeers = pscf->connect_race - 1;
+
+        race->peers = ngx_pcalloc(s->connection->pool,
+                                  race->npeers * sizeof(ngx_peer_connection_t));
+        if (race->peers == NULL) {
+            return NGX_ERROR;
+        }
+
+        race->current = ngx_pcalloc(s->connection->pool, race->npeers
+                                    * sizeof(ngx_stream_upstream_rr_peer_t *));
+        if (race->current == NULL) {
+            return NGX_ERROR;
+        }
+
+        race->weight = ngx_pcalloc(s->connection->pool, race->npeers
+                                   * sizeof(ngx_stream_upstream_rr_weight_t *));
+        if (race->weight == NULL) {
+            return NGX_ERROR;
+        }
+
+        race->event.handler = ngx_stream_proxy_race_timer_handler;
+        race->event.data = s;
+        race->event.log = s->connection->log;
+
+        ctx->race = race;
+    }
+
+    if (!race->event.timer_set && race->active < race->npeers) {
+        ngx_add_timer(&race->event, pscf->connect_race_delay);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_proxy_race_timer_handler(ngx_event_t *ev)
+{
+    ngx_stream_proxy_race_next(ev->data);
+}
+
+
+static void
+ngx_stream_proxy_race_next(ngx_stream_session_t *s)
+{
+    ngx_int_t                     rc;
+    ngx_uint_t                    i;
+    ngx_connection_t             *c, *pc;
+    ngx_peer_connection_t                *peer;
+    ngx_stream_upstream_t                *u;
+    ngx_stream_proxy_ctx_t               *ctx;
+    ngx_stream_proxy_race_t              *race;
+    ngx_stream_proxy_srv_conf_t          *pscf;
+    ngx_stream_upstream_rr_peer_t        *current;
+    ngx_stream_upstream_rr_weight_t      *weight;
+    ngx_stream_upstream_rr_peer_data_t   *rrp;
+
+    c = s->connection;
+    u = s->upstream;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+    race = ctx->race;
+
+    /*
+     * racers share the round robin data of the primary connect, which
+     * is kept in it between the calls; the primary holds a try of its own
+     */
+
+    rrp = u->peer.data;
+
+    while (race->active < race->npeers && u->peer.tries > 1) {
+
+        for (i = 0; race->peers[i].connection; i++) { /* void */ }
+
+        peer = &race->peers[i];
+
+        *peer = u->peer;
+        peer->connection = NULL;
+        peer->sockaddr = NULL;
+        peer->fastopen = 0;
+
+        current = rrp->current;
+        weight = rrp->weight;
+
+        rc = ngx_event_connect_peer(peer);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "proxy race connect: %i", rc);
+
+        race->current[i] = rrp->current;
+        race->weight[i] = rrp->weight;
+
+        rrp->current = current;
+        rrp->weight = weight;
+
+        if (rc == NGX_BUSY) {
+            return;
+        }
+
+        if (rc == NGX_ERROR) {
+            if (peer->sockaddr) {
+                ngx_stream_proxy_race_free(s, i, 0);
+            }
+
+            return;
+        }
+
+        u->peer.tries--;
+
+        if (rc == NGX_DECLINED) {
+            ngx_stream_proxy_race_free(s, i, NGX_PEER_FAILED);
+            continue;
+        }
+
+        /* rc == NGX_OK || rc == NGX_AGAIN */
+
+        pc = peer->connection;
+
+        pc->data = s;
+        pc->pool = c->pool;
+        pc->log = c->log;
+        pc->read->log = c->log;
+        pc->write->log = c->log;
+
+        race->active++;
+
+        if (rc == NGX_OK) {
+            ngx_stream_proxy_race_win(s, peer);
+            return;
+        }
+
+        pc->read->handler = ngx_stream_proxy_race_handler;
+        pc->write->handler = ngx_stream_proxy_race_handler;
+
+        pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+        ngx_add_timer(pc->write, pscf->connect_timeout);
+
+        if (race->active < race->npeers && u->peer.tries > 1) {
+            ngx_add_timer(&race->event, pscf->connect_race_delay);
+        }
+
+        return;
+    }
+}
+
+
+static void
+ngx_stream_proxy_race_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                i;
+    ngx_connection_t         *c;
+    ngx_peer_connection_t    *peer;
+    ngx_stream_session_t     *s;
+    ngx_stream_proxy_ctx_t   *ctx;
+    ngx_stream_proxy_race_t  *race;
+
+    c = ev->data;
+    s = c->data;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+    race = ctx->race;
+
+    for (i = 0; race->peers[i].connection != c; i++) { /* void */ }
+
+    peer = &race->peers[i];
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream %V timed out", peer->name);
+        goto failed;
+    }
+
+    ngx_del_timer(c->write);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "stream proxy race connect %V", peer->name);
+
+    if (ngx_stream_proxy_test_connect(c) != NGX_OK) {
+        goto failed;
+    }
+
+    ngx_stream_proxy_race_win(s, peer);
+    return;
+
+failed:
+
+    ngx_close_connection(c);
+    peer->connection = NULL;
+    race->active--;
+
+    ngx_stream_proxy_race_free(s, i, NGX_PEER_FAILED);
+
+    ngx_stream_proxy_race_next(s);
+}
+
+
+static void
+ngx_stream_proxy_race_free(ngx_stream_session_t *s, ngx_uint_t i,
+    ngx_uint_t state)
+{
+    ngx_peer_connection_t               *peer;
+    ngx_stream_proxy_ctx_t              *ctx;
+    ngx_stream_upstream_rr_peer_t       *current;
+    ngx_stream_upstream_rr_weight_t     *weight;
+    ngx_stream_upstream_rr_peer_data_t  *rrp;
+
+    /* frees the racer's peer, keeping the primary one in the data */
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    peer = &ctx->race->peers[i];
+    rrp = peer->data;
+
+    current = rrp->current;
+    weight = rrp->weight;
+
+    rrp->current = ctx->race->current[i];
+    rrp->weight = ctx->race->weight[i];
+
+    peer->free(peer, peer->data, state);
+    peer->sockaddr = NULL;
+
+    rrp->current = current;
+    rrp->weight = weight;
+}
+
+
+static void
+ngx_stream_proxy_race_win(ngx_stream_session_t *s, ngx_peer_connection_t *peer)
+{
+    ngx_uint_t                           i;
+    ngx_connection_t                    *pc;
+    ngx_stream_upstream_t               *u;
+    ngx_stream_proxy_ctx_t              *ctx;
+    ngx_stream_upstream_rr_peer_data_t  *rrp;
+
+    u = s->upstream;
+    pc = u->peer.connection;
+
+    if (pc) {
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "close proxy upstream connection: %d", pc->fd);
+
+        ngx_close_connection(pc);
+    }
+
+    if (u->peer.sockaddr) {
+        u->peer.free(&u->peer, u->peer.data, 0);
+    }
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    i = peer - ctx->race->peers;
+
+    rrp = u->peer.data;
+    rrp->current = ctx->race->current[i];
+    rrp->weight = ctx->race->weight[i];
+
+    u->peer.connection = peer->connection;
+    u->peer.sockaddr = peer->sockaddr;
+    u->peer.socklen = peer->socklen;
+    u->peer.name = peer->name;
+    u->state->peer = peer->name;
+
+    /* its try is accounted again when it is freed */
+    u->peer.tries++;
+
+    peer->connection = NULL;
+    peer->sockaddr = NULL;
+    ctx->race->active--;
+
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+    /* preread data went only to the primary connection */
+    ctx->fastopen = 0;
+#endif
+
+    ngx_stream_proxy_init_upstream(s);
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_race_promote(ngx_stream_session_t *s)
+{
+    ngx_uint_t                           i;
+    ngx_connection_t                    *pc;
+    ngx_peer_connection_t               *peer;
+    ngx_stream_upstream_t               *u;
+    ngx_stream_proxy_ctx_t              *ctx;
+    ngx_stream_proxy_race_t             *race;
+    ngx_stream_upstream_rr_peer_data_t  *rrp;
+
+    /* the primary connect failed and was freed, a pending one takes over */
+
+    u = s->upstream;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+    race = ctx->race;
+
+    for (i = 0; i < race->npeers; i++) {
+        if (race->peers[i].connection) {
+            break;
+        }
+    }
+
+    if (i == race->npeers) {
+        return NGX_DECLINED;
+    }
+
+    peer = &race->peers[i];
+    pc = peer->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "proxy race promote %V", peer->name);
+
+    rrp = u->peer.data;
+    rrp->current = race->current[i];
+    rrp->weight = race->weight[i];
+
+    u->peer.connection = pc;
+    u->peer.sockaddr = peer->sockaddr;
+    u->peer.socklen = peer->socklen;
+    u->peer.name = peer->name;
+    u->state->peer = peer->name;
+
+    /* its try is accounted again when it is freed */
+    u->peer.tries++;
+
+    peer->connection = NULL;
+    peer->sockaddr = NULL;
+    race->active--;
+
+    pc->read->handler = ngx_stream_proxy_connect_handler;
+    pc->write->handler = ngx_stream_proxy_connect_handler;
+
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+    ctx->fastopen = 0;
+#endif
+
+    if (race->event.timer_set) {
+        ngx_del_timer(&race->event);
+    }
+
+    ngx_stream_proxy_race_next(s);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_proxy_race_close(ngx_stream_session_t *s)
+{
+    ngx_uint_t                i;
+    ngx_stream_proxy_ctx_t   *ctx;
+    ngx_stream_proxy_race_t  *race;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx == NULL || ctx->race == NULL) {
+        return;
+    }
+
+    race = ctx->race;
+
+    if (race->event.timer_set) {
+        ngx_del_timer(&race->event);
+    }
+
+    for (i = 0; i < race->npeers; i++) {
+        if (race->peers[i].connection) {
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                           "close proxy race connection: %d",
+                           race->peers[i].connection->fd);
+
+            ngx_close_connection(race->peers[i].connection);
+            race->peers[i].connection = NULL;
+
+            ngx_stream_proxy_race_free(s, i, 0);
+        }
+    }
+
+    race->active = 0;
+}
+
+
+static void
+ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
+    ngx_uint_t do_write)
+{
+    off_t                        *received, limit;
+    size_t                        size, limit_rate;
+    ssize_t                       n;
+    ngx_buf_t                    *b;
     ngx_int_t                     rc;
     ngx_uint_t                    flags;
     ngx_msec_t                    delay;
@@ -1462,213 +2393,1614 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
     ngx_connection_t             *c, *pc, *src, *dst;
     ngx_log_handler_pt            handler;
     ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_ctx_t       *ctx;
     ngx_stream_proxy_srv_conf_t  *pscf;
+    ngx_stream_proxy_adaptive_t  *a;
+#if (NGX_HAVE_SPLICE)
+    ngx_stream_proxy_pipe_t      *p;
+#endif
+#if (NGX_HAVE_IOURING_BUF_RING)
+    ngx_buf_t                    *rb;
+#endif
 
     u = s->upstream;
 
     c = s->connection;
-    pc = u->connected ? u->peer.connection : NULL;
-
-    if (c->type == SOCK_DGRAM && (ngx_terminate || ngx_exiting)) {
+    pc = u->connected ? u->peer.connection : NULL;
+
+    if (c->type == SOCK_DGRAM && (ngx_terminate || ngx_exiting)) {
+
+        /* socket is already closed on worker shutdown */
+
+        handler = c->log->handler;
+        c->log->handler = NULL;
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0, "disconnected on shutdown");
+
+        c->log->handler = handler;
+
+        ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+        return;
+    }
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    a = &ctx->adaptive[from_upstream];
+
+    if (from_upstream) {
+        src = pc;
+        dst = c;
+        b = &u->upstream_buf;
+        limit_rate = pscf->download_rate;
+        received = &u->received;
+        out = &u->downstream_out;
+        busy = &u->downstream_busy;
+
+    } else {
+        src = c;
+        dst = pc;
+        b = &u->downstream_buf;
+        limit_rate = pscf->upload_rate;
+        received = &s->received;
+        out = &u->upstream_out;
+        busy = &u->upstream_busy;
+    }
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+    if (ngx_stream_proxy_pinned(ctx, from_upstream)) {
+        if (ngx_stream_proxy_zerocopy_reap(c->fd, c->log, &ctx->zerocopy)
+            != NGX_OK)
+        {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+            return;
+        }
+
+        if (!ngx_stream_proxy_pinned(ctx, from_upstream)) {
+            c->buffered &= ~NGX_LOWLEVEL_BUFFERED;
+
+            if (*out == NULL && *busy == NULL) {
+                b->pos = b->start;
+                b->last = b->start;
+            }
+        }
+    }
+
+#endif
+
+    for ( ;; ) {
+
+        if (do_write && dst) {
+
+            if (*out || *busy || dst->buffered) {
+                rc = ngx_stream_top_filter(s, *out, from_upstream);
+
+                if (rc == NGX_ERROR) {
+                    if (c->type == SOCK_DGRAM && !from_upstream) {
+                        ngx_stream_proxy_next_upstream(s);
+                        return;
+                    }
+
+                    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                    return;
+                }
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+                if (ctx->iouring == NGX_STREAM_PROXY_IOURING_ACTIVE
+                    && ngx_stream_proxy_iouring_free(*busy, 0))
+                {
+                    (void) ngx_stream_proxy_iouring_free(*out, 0);
+                }
+
+#endif
+
+                ngx_chain_update_chains(c->pool, &u->free, busy, out,
+                                      (ngx_buf_tag_t) &ngx_stream_proxy_module);
+
+                if (*busy == NULL
+                    && !ngx_stream_proxy_pinned(ctx, from_upstream))
+                {
+                    b->pos = b->start;
+                    b->last = b->start;
+
+                    if (a->size && b->start
+                        && (size_t) (b->end - b->start) != a->size)
+                    {
+                        /* resized, the next read takes a new buffer */
+                        ngx_stream_proxy_free_buffer(b);
+                    }
+
+                } else if (*busy && !dst->write->ready) {
+                    /* the peer does not keep up, a larger buffer won't help */
+                    a->full = 0;
+                }
+            }
+        }
+
+#if (NGX_HAVE_SPLICE)
+
+        if (ctx->pipe[0] && dst) {
+            p = ctx->pipe[from_upstream];
+
+            /* data already read into buffers is sent first */
+
+            if (p->active || (*out == NULL && *busy == NULL && !dst->buffered))
+            {
+                p->active = 1;
+
+                if (ngx_stream_proxy_splice(s, p, from_upstream, do_write)
+                    != NGX_OK)
+                {
+                    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                    return;
+                }
+
+                break;
+            }
+        }
+
+#endif
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+        if (ctx->iouring == NGX_STREAM_PROXY_IOURING_ACTIVE) {
+
+            if (!src->read->ready || src->read->error) {
+                break;
+            }
+
+            /* the ring buffer is passed on as is */
+
+            n = ngx_iouring_recv_buf(src, &rb);
+
+            if (n == NGX_AGAIN) {
+                break;
+            }
+
+            if (n == NGX_ERROR) {
+                src->read->eof = 1;
+                n = 0;
+            }
+
+            if (from_upstream) {
+                if (u->state->first_byte_time == (ngx_msec_t) -1) {
+                    u->state->first_byte_time = ngx_current_msec
+                                                - u->state->response_time;
+                }
+            }
+
+            for (ll = out; *ll; ll = &(*ll)->next) { /* void */ }
+
+            if (n) {
+                cl = ngx_alloc_chain_link(c->pool);
+                if (cl == NULL) {
+                    ngx_iouring_free_buf(rb);
+                    ngx_stream_proxy_finalize(s,
+                                              NGX_STREAM_INTERNAL_SERVER_ERROR);
+                    return;
+                }
+
+                cl->buf = rb;
+                cl->next = NULL;
+
+            } else {
+                cl = ngx_chain_get_free_buf(c->pool, &u->free);
+                if (cl == NULL) {
+                    ngx_stream_proxy_finalize(s,
+                                              NGX_STREAM_INTERNAL_SERVER_ERROR);
+                    return;
+                }
+
+                cl->buf->tag = (ngx_buf_tag_t) &ngx_stream_proxy_module;
+                cl->buf->temporary = 0;
+                cl->buf->last_buf = 1;
+            }
+
+            *ll = cl;
+
+            cl->buf->flush = 1;
+
+            *received += n;
+            do_write = 1;
+
+            continue;
+        }
+
+#endif
+
+        if (b->start == NULL
+            && (from_upstream || c->type == SOCK_STREAM)
+            && src->read->ready && !src->read->delayed
+            && !src->read->error)
+        {
+            if (ngx_stream_proxy_alloc_buffer(b,
+                                    a->size ? a->size : pscf->buffer_size,
+                                    c->log)
+                != NGX_OK)
+            {
+                ngx_stream_proxy_finalize(s,
+                                          NGX_STREAM_INTERNAL_SERVER_ERROR);
+                return;
+            }
+        }
+
+        size = b->end - b->last;
+
+        if (size && src->read->ready && !src->read->delayed
+            && !src->read->error)
+        {
+            if (limit_rate) {
+                limit = (off_t) limit_rate * (ngx_time() - u->start_sec + 1)
+                        - *received;
+
+                if (limit <= 0) {
+                    src->read->delayed = 1;
+                    delay = (ngx_msec_t) (- limit * 1000 / limit_rate + 1);
+                    ngx_add_timer(src->read, delay);
+                    break;
+                }
+
+                if ((off_t) size > limit) {
+                    size = (size_t) limit;
+                }
+            }
+
+            n = src->recv(src, b->last, size);
+
+            if (n == NGX_AGAIN) {
+                break;
+            }
+
+            if (a->size && n > 0) {
+                ngx_stream_proxy_adapt_buffer(pscf, a, b, n);
+            }
+
+            if (n == NGX_ERROR) {
+                if (c->type == SOCK_DGRAM && u->received == 0) {
+                    ngx_stream_proxy_next_upstream(s);
+                    return;
+                }
+
+                src->read->eof = 1;
+                n = 0;
+            }
+
+            if (n >= 0) {
+                if (limit_rate) {
+                    delay = (ngx_msec_t) (n * 1000 / limit_rate);
+
+                    if (delay > 0) {
+                        src->read->delayed = 1;
+                        ngx_add_timer(src->read, delay);
+                    }
+                }
+
+                if (from_upstream) {
+                    if (u->state->first_byte_time == (ngx_msec_t) -1) {
+                        u->state->first_byte_time = ngx_current_msec
+                                                    - u->state->response_time;
+                    }
+                }
+
+                if (pscf->keepalive_framing) {
+                    ngx_stream_proxy_parse_framing(&ctx->framing[from_upstream],
+                                                   pscf->keepalive_framing,
+                                                   b->last, b->last + n);
+                }
+
+                if (c->type == SOCK_DGRAM && ++u->responses == pscf->responses)
+                {
+                    src->read->ready = 0;
+                    src->read->eof = 1;
+                }
+
+                for (ll = out; *ll; ll = &(*ll)->next) { /* void */ }
+
+                cl = ngx_chain_get_free_buf(c->pool, &u->free);
+                if (cl == NULL) {
+                    ngx_stream_proxy_finalize(s,
+                                              NGX_STREAM_INTERNAL_SERVER_ERROR);
+                    return;
+                }
+
+                *ll = cl;
+
+                cl->buf->pos = b->last;
+                cl->buf->last = b->last + n;
+                cl->buf->tag = (ngx_buf_tag_t) &ngx_stream_proxy_module;
+
+                cl->buf->temporary = (n ? 1 : 0);
+                cl->buf->last_buf = src->read->eof;
+                cl->buf->flush = 1;
+
+                *received += n;
+                b->last += n;
+                do_write = 1;
+
+                continue;
+            }
+        }
+
+        break;
+    }
+
+    if (b->start && *out == NULL && *busy == NULL
+        && !ngx_stream_proxy_pinned(ctx, from_upstream))
+    {
+        ngx_stream_proxy_free_buffer(b);
+    }
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+    if (ctx->iouring == NGX_STREAM_PROXY_IOURING_PENDING && pc
+        && ngx_stream_proxy_iouring_start(s) != NGX_OK)
+    {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+#endif
+
+    if (src->read->eof && dst && (dst->read->eof || !dst->buffered)) {
+        handler = c->log->handler;
+        c->log->handler = NULL;
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "%s%s disconnected"
+                      ", bytes from/to client:%O/%O"
+                      ", bytes from/to upstream:%O/%O",
+                      src->type == SOCK_DGRAM ? "udp " : "",
+                      from_upstream ? "upstream" : "client",
+                      s->received, c->sent, u->received, pc ? pc->sent : 0);
+
+        c->log->handler = handler;
+
+        if (!from_upstream && pscf->keepalive_framing) {
+            u->keepalive = ngx_stream_proxy_keepalive_boundary(s);
+        }
+
+        ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+        return;
+    }
+
+    flags = src->read->eof ? NGX_CLOSE_EVENT : 0;
+
+    if (!src->shared && ngx_handle_read_event(src->read, flags) != NGX_OK) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (dst) {
+        if (!dst->shared && ngx_handle_write_event(dst->write, 0) != NGX_OK) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+        /* completions are reported with EPOLLERR to the write handler */
+
+        if (ngx_stream_proxy_pinned(ctx, from_upstream) && !dst->write->active
+            && ngx_add_event(dst->write, NGX_WRITE_EVENT, NGX_CLEAR_EVENT)
+               != NGX_OK)
+        {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+#endif
+
+        if (!c->read->delayed && !pc->read->delayed) {
+            ngx_add_timer(c->write, pscf->timeout);
+
+        } else if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
+    }
+}
+
+
+static void
+ngx_stream_proxy_parse_framing(ngx_stream_proxy_framing_t *f,
+    ngx_uint_t header, u_char *p, u_char *last)
+{
+    size_t  n;
+
+    while (p < last) {
+
+        if (f->left) {
+            n = ngx_min((size_t) (last - p), f->left);
+
+            p += n;
+            f->left -= n;
+
+            if (f->left == 0) {
+                f->messages++;
+            }
+
+            continue;
+        }
+
+        f->length = (f->length << 8) | *p++;
+
+        if (++f->header < header) {
+            continue;
+        }
+
+        f->left = f->length;
+        f->length = 0;
+        f->header = 0;
+
+        if (f->left == 0) {
+            f->messages++;
+        }
+    }
+}
+
+
+/*
+ * the client has closed the connection, and the upstream has answered
+ * each of its messages in full: the upstream connection may be used again
+ */
+
+static ngx_uint_t
+ngx_stream_proxy_keepalive_boundary(ngx_stream_session_t *s)
+{
+    ngx_connection_t             *c, *pc;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_ctx_t       *ctx;
+    ngx_stream_proxy_framing_t   *req, *resp;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    c = s->connection;
+    u = s->upstream;
+    pc = u->peer.connection;
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    req = &ctx->framing[0];
+    resp = &ctx->framing[1];
+
+    /* a reused connection must not get another PROXY protocol header */
+
+    if (c->type != SOCK_STREAM
+        || pscf->proxy_protocol
+        || pc == NULL
+        || c->read->error
+        || pc->read->eof
+        || pc->read->error
+        || pc->buffered
+        || u->upstream_out
+        || u->upstream_busy)
+    {
+        return 0;
+    }
+
+#if (NGX_HAVE_SPLICE)
+
+    /* spliced data are not seen by the parser */
+
+    if (ctx->pipe[0]) {
+        return 0;
+    }
+
+#endif
+
+    if (req->messages == 0
+        || req->messages != resp->messages
+        || req->header || req->left
+        || resp->header || resp->left)
+    {
+        return 0;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "stream proxy keepalive boundary after %ui messages",
+                   req->messages);
+
+    return 1;
+}
+
+
+static ngx_stream_proxy_buffers_t
+                    ngx_stream_proxy_buffers[NGX_STREAM_PROXY_BUFFER_CLASSES];
+
+
+static ngx_int_t
+ngx_stream_proxy_alloc_buffer(ngx_buf_t *b, size_t size, ngx_log_t *log)
+{
+    u_char                      *p;
+    ngx_uint_t                   i;
+    ngx_stream_proxy_buffer_t   *buf;
+    ngx_stream_proxy_buffers_t  *buffers;
+
+    /* buffers are allocated in power of two size classes */
+
+    for (i = 0; i < NGX_STREAM_PROXY_BUFFER_CLASSES; i++) {
+        if (size <= (size_t) 1 << (NGX_STREAM_PROXY_BUFFER_SHIFT + i)) {
+            break;
+        }
+    }
+
+    if (i < NGX_STREAM_PROXY_BUFFER_CLASSES) {
+        buffers = &ngx_stream_proxy_buffers[i];
+        buf = buffers->free;
+
+        if (buf) {
+            buffers->free = buf->next;
+            buffers->nfree -= (size_t) 1 << (NGX_STREAM_PROXY_BUFFER_SHIFT + i);
+            p = (u_char *) buf;
+            goto done;
+        }
+
+        p = ngx_alloc((size_t) 1 << (NGX_STREAM_PROXY_BUFFER_SHIFT + i), log);
+
+    } else {
+        p = ngx_alloc(size, log);
+    }
+
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+done:
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, log, 0,
+                   "stream proxy alloc buffer: %p:%uz", p, size);
+
+    b->start = p;
+    b->end = p + size;
+    b->pos = p;
+    b->last = p;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_proxy_free_buffer(ngx_buf_t *b)
+{
+    size_t                       size;
+    ngx_uint_t                   i;
+    ngx_stream_proxy_buffer_t   *buf;
+    ngx_stream_proxy_buffers_t  *buffers;
+
+    size = b->end - b->start;
+    buf = (ngx_stream_proxy_buffer_t *) b->start;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                   "stream proxy free buffer: %p:%uz", b->start, size);
+
+    b->start = NULL;
+    b->end = NULL;
+    b->pos = NULL;
+    b->last = NULL;
+
+    for (i = 0; i < NGX_STREAM_PROXY_BUFFER_CLASSES; i++) {
+        if (size <= (size_t) 1 << (NGX_STREAM_PROXY_BUFFER_SHIFT + i)) {
+            break;
+        }
+    }
+
+    if (i == NGX_STREAM_PROXY_BUFFER_CLASSES) {
+        ngx_free(buf);
+        return;
+    }
+
+    size = (size_t) 1 << (NGX_STREAM_PROXY_BUFFER_SHIFT + i);
+    buffers = &ngx_stream_proxy_buffers[i];
+
+    if (buffers->nfree + size > NGX_STREAM_PROXY_FREE_BUFFERS) {
+        ngx_free(buf);
+        return;
+    }
+
+    buf->next = buffers->free;
+    buffers->free = buf;
+    buffers->nfree += size;
+}
+
+
+static void
+ngx_stream_proxy_adapt_buffer(ngx_stream_proxy_srv_conf_t *pscf,
+    ngx_stream_proxy_adaptive_t *a, ngx_buf_t *b, ssize_t n)
+{
+    size_t  size;
+
+    size = b->end - b->start;
+
+    if ((size_t) n == size) {
+
+        /* a read filled the whole buffer, there is more data behind */
+
+        a->partial = 0;
+
+        if (++a->full < NGX_STREAM_PROXY_BUFFER_GROW
+            || a->size >= pscf->max_buffer_size)
+        {
+            return;
+        }
+
+        a->size = ngx_min(a->size * 2, pscf->max_buffer_size);
+        a->full = 0;
+
+    } else if ((size_t) n <= size / 4) {
+
+        /* interactive traffic, most of the buffer is never used */
+
+        a->full = 0;
+
+        if (++a->partial < NGX_STREAM_PROXY_BUFFER_SHRINK
+            || a->size <= pscf->min_buffer_size)
+        {
+            return;
+        }
+
+        a->size = ngx_max(a->size / 2, pscf->min_buffer_size);
+        a->partial = 0;
+
+    } else {
+        a->full = 0;
+        a->partial = 0;
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                   "stream proxy buffer size: %uz -> %uz", size, a->size);
+}
+
+
+static void
+ngx_stream_proxy_cleanup_buffers(void *data)
+{
+    ngx_stream_upstream_t  *u = data;
+
+    if (u->downstream_buf.start) {
+        ngx_stream_proxy_free_buffer(&u->downstream_buf);
+    }
+
+    if (u->upstream_buf.start) {
+        ngx_stream_proxy_free_buffer(&u->upstream_buf);
+    }
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+    (void) ngx_stream_proxy_iouring_free(u->upstream_busy, 1);
+    (void) ngx_stream_proxy_iouring_free(u->upstream_out, 1);
+    (void) ngx_stream_proxy_iouring_free(u->downstream_busy, 1);
+    (void) ngx_stream_proxy_iouring_free(u->downstream_out, 1);
+#endif
+}
+
+
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_stream_proxy_init_splice(ngx_stream_session_t *s)
+{
+    ngx_connection_t        *c;
+    ngx_pool_cleanup_t      *cln;
+    ngx_stream_proxy_ctx_t  *ctx;
+
+    c = s->connection;
+
+    if (c->type != SOCK_STREAM || s->filter_need_in_memory) {
+        return NGX_OK;
+    }
+
+#if (NGX_SSL)
+    if (c->ssl || s->upstream->peer.connection->ssl) {
+        return NGX_OK;
+    }
+#endif
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx->pipe[0]) {
+        return NGX_OK;
+    }
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_stream_proxy_cleanup_pipes;
+    cln->data = ctx;
+
+    ctx->pipe[0] = ngx_stream_proxy_get_pipe(c->log);
+    ctx->pipe[1] = ngx_stream_proxy_get_pipe(c->log);
+
+    if (ctx->pipe[0] == NULL || ctx->pipe[1] == NULL) {
+
+        /* fall back to buffered proxying */
+
+        ngx_stream_proxy_cleanup_pipes(ctx);
+
+        ctx->pipe[0] = NULL;
+        ctx->pipe[1] = NULL;
+
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "stream proxy splice, pipes: %d, %d",
+                   ctx->pipe[0]->fd[0], ctx->pipe[1]->fd[0]);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_splice(ngx_stream_session_t *s, ngx_stream_proxy_pipe_t *p,
+    ngx_uint_t from_upstream, ngx_uint_t do_write)
+{
+    off_t                        *received, limit;
+    size_t                        size, limit_rate;
+    ssize_t                       n;
+    ngx_err_t                     err;
+    ngx_msec_t                    delay;
+    ngx_connection_t             *src, *dst;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    u = s->upstream;
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    if (from_upstream) {
+        src = u->peer.connection;
+        dst = s->connection;
+        limit_rate = pscf->download_rate;
+        received = &u->received;
+
+    } else {
+        src = s->connection;
+        dst = u->peer.connection;
+        limit_rate = pscf->upload_rate;
+        received = &s->received;
+    }
+
+    for ( ;; ) {
+
+        if (do_write && p->size) {
+
+            n = splice(p->fd[0], NULL, dst->fd, NULL, p->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug3(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                           "splice to %d: %z of %uz", dst->fd, n, p->size);
+
+            if (n == -1) {
+                err = ngx_socket_errno;
+
+                if (err != NGX_EAGAIN) {
+                    dst->write->error = 1;
+                    ngx_connection_error(dst, err, "splice() failed");
+                    return NGX_ERROR;
+                }
+
+                dst->write->ready = 0;
+
+            } else {
+                p->size -= n;
+                dst->sent += n;
+            }
+        }
+
+        size = p->capacity - p->size;
+
+        if (size && src->read->ready && !src->read->delayed
+            && !src->read->error)
+        {
+            if (limit_rate) {
+                limit = (off_t) limit_rate * (ngx_time() - u->start_sec + 1)
+                        - *received;
+
+                if (limit <= 0) {
+                    src->read->delayed = 1;
+                    delay = (ngx_msec_t) (- limit * 1000 / limit_rate + 1);
+                    ngx_add_timer(src->read, delay);
+                    break;
+                }
+
+                if ((off_t) size > limit) {
+                    size = (size_t) limit;
+                }
+            }
+
+            n = splice(src->fd, NULL, p->fd[1], NULL, size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug3(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                           "splice from %d: %z of %uz", src->fd, n, size);
+
+            if (n == -1) {
+                err = ngx_socket_errno;
+
+                if (err == NGX_EAGAIN) {
+
+                    /*
+                     * EAGAIN is also returned when the pipe is full,
+                     * so the socket is known to be drained only if
+                     * the pipe is empty; otherwise retry after writing
+                     */
+
+                    if (p->size == 0) {
+                        src->read->ready = 0;
+                        break;
+                    }
+
+                    if (dst->write->ready) {
+                        do_write = 1;
+                        continue;
+                    }
+
+                    break;
+                }
+
+                src->read->error = 1;
+                ngx_connection_error(src, err, "splice() failed");
+
+                n = 0;
+            }
+
+            if (n == 0) {
+                src->read->ready = 0;
+                src->read->eof = 1;
+                do_write = 1;
+                continue;
+            }
+
+            if (limit_rate) {
+                delay = (ngx_msec_t) (n * 1000 / limit_rate);
+
+                if (delay > 0) {
+                    src->read->delayed = 1;
+                    ngx_add_timer(src->read, delay);
+                }
+            }
+
+            if (from_upstream) {
+                if (u->state->first_byte_time == (ngx_msec_t) -1) {
+                    u->state->first_byte_time = ngx_current_msec
+                                                - u->state->response_time;
+                }
+            }
+
+            *received += n;
+            p->size += n;
+            do_write = 1;
+
+            continue;
+        }
+
+        break;
+    }
+
+    /* data left in the pipe keeps the session open on eof */
+
+    if (p->size) {
+        dst->buffered |= NGX_LOWLEVEL_BUFFERED;
+
+    } else {
+        dst->buffered &= ~NGX_LOWLEVEL_BUFFERED;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_stream_proxy_pipe_t *ngx_stream_proxy_free_pipes;
+static ngx_uint_t                ngx_stream_proxy_nfree_pipes;
+
+
+static ngx_stream_proxy_pipe_t *
+ngx_stream_proxy_get_pipe(ngx_log_t *log)
+{
+    int                       size;
+    ngx_stream_proxy_pipe_t  *p;
+
+    p = ngx_stream_proxy_free_pipes;
+
+    if (p) {
+        ngx_stream_proxy_free_pipes = p->next;
+        ngx_stream_proxy_nfree_pipes--;
+
+        p->active = 0;
+
+        return p;
+    }
+
+    p = ngx_alloc(sizeof(ngx_stream_proxy_pipe_t), log);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    if (pipe2(p->fd, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "pipe2() failed");
+        ngx_free(p);
+        return NULL;
+    }
+
+#ifdef F_GETPIPE_SZ
+    size = fcntl(p->fd[0], F_GETPIPE_SZ);
+#else
+    size = -1;
+#endif
+
+    p->capacity = (size > 0) ? (size_t) size : 16 * ngx_pagesize;
+    p->size = 0;
+    p->active = 0;
+    p->next = NULL;
+
+    return p;
+}
+
+
+static void
+ngx_stream_proxy_free_pipe(ngx_stream_proxy_pipe_t *p)
+{
+    /* a pipe with unsent data cannot be reused */
+
+    if (p->size == 0
+        && ngx_stream_proxy_nfree_pipes < NGX_STREAM_PROXY_FREE_PIPES)
+    {
+        p->next = ngx_stream_proxy_free_pipes;
+        ngx_stream_proxy_free_pipes = p;
+        ngx_stream_proxy_nfree_pipes++;
+        return;
+    }
+
+    if (close(p->fd[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe failed");
+    }
+
+    if (close(p->fd[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe failed");
+    }
+
+    ngx_free(p);
+}
+
+
+static void
+ngx_stream_proxy_cleanup_pipes(void *data)
+{
+    ngx_stream_proxy_ctx_t  *ctx = data;
+
+    if (ctx->pipe[0]) {
+        ngx_stream_proxy_free_pipe(ctx->pipe[0]);
+    }
+
+    if (ctx->pipe[1]) {
+        ngx_stream_proxy_free_pipe(ctx->pipe[1]);
+    }
+}
+
+#endif
+
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+static ngx_int_t
+ngx_stream_proxy_init_zerocopy(ngx_stream_session_t *s)
+{
+    int                      one;
+    ngx_connection_t        *c;
+    ngx_stream_proxy_ctx_t  *ctx;
+
+    c = s->connection;
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (c->type != SOCK_STREAM
+        || ctx->zerocopy.enabled
+        || !(ngx_event_flags & NGX_USE_EPOLL_EVENT))
+    {
+        return NGX_OK;
+    }
+
+#if (NGX_HAVE_SPLICE)
+    if (ctx->pipe[0]) {
+        return NGX_OK;
+    }
+#endif
+
+#if (NGX_SSL)
+    if (c->ssl) {
+        return NGX_OK;
+    }
+#endif
+
+    one = 1;
+
+    if (setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY,
+                   (const void *) &one, sizeof(int))
+        == -1)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, ngx_socket_errno,
+                       "setsockopt(SO_ZEROCOPY) failed on %d", c->fd);
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "stream proxy zerocopy on %d", c->fd);
+
+    ctx->zerocopy.enabled = 1;
+    c->send_chain = ngx_stream_proxy_zerocopy_send_chain;
+
+    return NGX_OK;
+}
+
+
+/*
+ * upstream buffers of at least proxy_zerocopy_threshold are sent with
+ * MSG_ZEROCOPY, anything else (e.g. headers added by filters) is copied
+ * by the usual send_chain; the upstream buffer is not reused until
+ * the kernel reports the completion of all zerocopy sends
+ */
+
+static ngx_chain_t *
+ngx_stream_proxy_zerocopy_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    off_t                         sent;
+    size_t                        size;
+    ssize_t                       n;
+    ngx_err_t                     err;
+    ngx_buf_t                    *b, *buf;
+    ngx_chain_t                  *cl, *ln, *chain;
+    ngx_stream_session_t         *s;
+    ngx_stream_proxy_ctx_t       *ctx;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    s = c->data;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    b = &s->upstream->upstream_buf;
+
+    if (limit == 0 || limit > (off_t) (NGX_MAX_OFF_T_VALUE - ngx_pagesize)) {
+        limit = NGX_MAX_OFF_T_VALUE - ngx_pagesize;
+    }
+
+    sent = c->sent;
+
+    while (in) {
+
+        ln = NULL;
+
+        for (cl = in; cl; cl = cl->next) {
+            buf = cl->buf;
+
+            if (ctx->zerocopy.enabled
+                && buf->pos >= b->start && buf->last <= b->end
+                && (size_t) (buf->last - buf->pos) >= pscf->zerocopy_threshold)
+            {
+                break;
+            }
+
+            ln = cl;
+        }
+
+        if (ln) {
+            ln->next = NULL;
+
+            chain = ngx_send_chain(c, in, limit - (c->sent - sent));
+
+            ln->next = cl;
+
+            if (chain != NULL) {
+                return chain;
+            }
+
+            if (cl == NULL || c->sent - sent >= limit) {
+                return cl;
+            }
+
+            in = cl;
+        }
+
+        buf = in->buf;
+
+        size = buf->last - buf->pos;
+
+        if ((off_t) size > limit - (c->sent - sent)) {
+            size = (size_t) (limit - (c->sent - sent));
+        }
+
+        n = send(c->fd, buf->pos, size, MSG_ZEROCOPY);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "zerocopy send: fd:%d %z of %uz", c->fd, n, size);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            switch (err) {
+
+            case NGX_EAGAIN:
+                c->write->ready = 0;
+                return in;
+
+            case NGX_EINTR:
+                continue;
+
+            case ENOBUFS:
+
+                /* out of the socket option memory, copy the data */
+
+                n = c->send(c, buf->pos, size);
+
+                if (n == NGX_ERROR) {
+                    return NGX_CHAIN_ERROR;
+                }
+
+                if (n == NGX_AGAIN) {
+                    return in;
+                }
+
+                buf->pos += n;
+
+                if ((size_t) n < size) {
+                    return in;
+                }
+
+                in = in->next;
+                continue;
+
+            default:
+                c->write->error = 1;
+                ngx_connection_error(c, err, "send(MSG_ZEROCOPY) failed");
+                return NGX_CHAIN_ERROR;
+            }
+        }
+
+        ctx->zerocopy.sent++;
+        c->buffered |= NGX_LOWLEVEL_BUFFERED;
+
+        c->sent += n;
+        buf->pos += n;
+
+        if ((size_t) n < size) {
+            c->write->ready = 0;
+            return in;
+        }
+
+        in = in->next;
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_zerocopy_reap(ngx_socket_t fd, ngx_log_t *log,
+    ngx_stream_proxy_zerocopy_t *zc)
+{
+    ssize_t                    n;
+    ngx_err_t                  err;
+    struct msghdr              msg;
+    struct cmsghdr            *cmsg;
+    struct sock_extended_err  *ee;
+
+    union {
+        struct cmsghdr         cm;
+        u_char                 space[CMSG_SPACE(
+                                   sizeof(struct sock_extended_err)
+                                   + sizeof(struct sockaddr_in6))];
+    } control;
+
+    while (zc->completed != zc->sent) {
+
+        ngx_memzero(&msg, sizeof(struct msghdr));
+
+        msg.msg_control = &control;
+        msg.msg_controllen = sizeof(control);
+
+        n = recvmsg(fd, &msg, MSG_ERRQUEUE);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EAGAIN) {
+                break;
+            }
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_ERR, log, err,
+                          "recvmsg(MSG_ERRQUEUE) failed");
+            return NGX_ERROR;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg);
+             cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                && !(cmsg->cmsg_level == SOL_IPV6
+                     && cmsg->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+
+            ee = (struct sock_extended_err *) CMSG_DATA(cmsg);
+
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            ngx_log_debug3(NGX_LOG_DEBUG_STREAM, log, 0,
+                           "zerocopy completed: %uD-%uD, code:%d",
+                           ee->ee_info, ee->ee_data, (int) ee->ee_code);
+
+            zc->completed += ee->ee_data - ee->ee_info + 1;
+
+            if (zc->enabled && (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)) {
+
+                /*
+                 * the kernel copied the data anyway, e.g. on loopback
+                 * or without scatter-gather support, which is slower
+                 * than a plain send
+                 */
+
+                ngx_log_debug0(NGX_LOG_DEBUG_STREAM, log, 0,
+                               "zerocopy deferred copy, disabled");
+
+                zc->enabled = 0;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_stream_proxy_zerocopy_held_t  *ngx_stream_proxy_zerocopy_held;
+static ngx_event_t                        ngx_stream_proxy_zerocopy_event;
+
+
+static void
+ngx_stream_proxy_zerocopy_close(ngx_stream_session_t *s)
+{
+    struct linger                      linger;
+    struct sockaddr                    sa;
+    ngx_event_t                       *ev;
+    ngx_connection_t                  *c;
+    ngx_stream_upstream_t             *u;
+    ngx_stream_proxy_ctx_t            *ctx;
+    ngx_stream_proxy_zerocopy_held_t  *held;
+
+    c = s->connection;
+    u = s->upstream;
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx == NULL || !ngx_stream_proxy_pinned(ctx, 1)) {
+        return;
+    }
+
+    if (ngx_stream_proxy_zerocopy_reap(c->fd, c->log, &ctx->zerocopy)
+        == NGX_OK
+        && !ngx_stream_proxy_pinned(ctx, 1))
+    {
+        return;
+    }
+
+    /*
+     * the session is terminated while the kernel still sends from
+     * the upstream buffer; packets already queued to the device keep
+     * referencing it even after a reset, so the buffer is not reused
+     * until the completions are reported on a duplicate of the socket
+     */
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "zerocopy hold, %uD sends pending",
+                   ctx->zerocopy.sent - ctx->zerocopy.completed);
+
+    held = ngx_alloc(sizeof(ngx_stream_proxy_zerocopy_held_t), c->log);
+    if (held == NULL) {
+        goto failed;
+    }
+
+    held->fd = dup(c->fd);
+
+    if (held->fd == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                      "dup() failed");
+        ngx_free(held);
+        goto failed;
+    }
+
+    /*
+     * disconnecting resets the connection and drops the data queued
+     * in the socket, while the duplicate keeps its error queue
+     */
+
+    ngx_memzero(&sa, sizeof(struct sockaddr));
+    sa.sa_family = AF_UNSPEC;
+
+    if (connect(held->fd, &sa, sizeof(struct sockaddr)) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                      "connect(AF_UNSPEC) failed");
+    }
+
+    held->zerocopy = ctx->zerocopy;
+    held->buf = u->upstream_buf;
+    held->start = ngx_time();
+
+    held->next = ngx_stream_proxy_zerocopy_held;
+    ngx_stream_proxy_zerocopy_held = held;
+
+    ngx_memzero(&u->upstream_buf, sizeof(ngx_buf_t));
+
+    ev = &ngx_stream_proxy_zerocopy_event;
+
+    if (!ev->timer_set) {
+        ev->handler = ngx_stream_proxy_zerocopy_held_handler;
+        ev->log = ngx_cycle->log;
+        ev->cancelable = 1;
+
+        ngx_stream_proxy_zerocopy_held_handler(ev);
+    }
+
+    return;
+
+failed:
+
+    /* reset the connection and never reuse the buffer */
+
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+
+    if (setsockopt(c->fd, SOL_SOCKET, SO_LINGER,
+                   (const void *) &linger, sizeof(struct linger))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                      "setsockopt(SO_LINGER) failed");
+    }
+
+    ngx_memzero(&u->upstream_buf, sizeof(ngx_buf_t));
+}
+
+
+static void
+ngx_stream_proxy_zerocopy_held_handler(ngx_event_t *ev)
+{
+    ngx_stream_proxy_zerocopy_t        *zc;
+    ngx_stream_proxy_zerocopy_held_t   *held, **prev;
+
+    prev = &ngx_stream_proxy_zerocopy_held;
+
+    for (held = *prev; held; held = *prev) {
+        zc = &held->zerocopy;
+
+        if (ngx_stream_proxy_zerocopy_reap(held->fd, ev->log, zc) == NGX_OK
+            && zc->sent != zc->completed
+            && ngx_time() - held->start < NGX_STREAM_PROXY_ZEROCOPY_HOLD)
+        {
+            prev = &held->next;
+            continue;
+        }
+
+        *prev = held->next;
+
+        if (zc->sent == zc->completed) {
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                           "zerocopy release %d", held->fd);
+
+            ngx_stream_proxy_free_buffer(&held->buf);
+
+        } else {
+            ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                          "zerocopy sends not completed, %uD pending, "
+                          "buffer is not reused",
+                          zc->sent - zc->completed);
+        }
+
+        if (ngx_close_socket(held->fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_socket_errno,
+                          ngx_close_socket_n " failed");
+        }
+
+        ngx_free(held);
+    }
+
+    if (ngx_stream_proxy_zerocopy_held) {
+        ngx_add_timer(ev, NGX_STREAM_PROXY_ZEROCOPY_REAP);
+    }
+}
+
+#endif
+
+
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+
+/*
+ * the socket has TCP_FASTOPEN_CONNECT set and connect() returned at once:
+ * the first send() emits the SYN with as much preread data as the cached
+ * cookie allows; the data are kept in c->buffer until the connection is
+ * established, so the next upstream still gets them if this one fails
+ */
+
+static ngx_int_t
+ngx_stream_proxy_fastopen(ngx_stream_session_t *s)
+{
+    size_t                   size;
+    ssize_t                  n;
+    ngx_err_t                err;
+    ngx_connection_t        *c, *pc;
+    ngx_stream_proxy_ctx_t  *ctx;
+
+    c = s->connection;
+    pc = s->upstream->peer.connection;
 
-        /* socket is already closed on worker shutdown */
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
 
-        handler = c->log->handler;
-        c->log->handler = NULL;
+    size = c->buffer->last - c->buffer->pos;
 
-        ngx_log_error(NGX_LOG_INFO, c->log, 0, "disconnected on shutdown");
+    n = send(pc->fd, c->buffer->pos, size, 0);
 
-        c->log->handler = handler;
+    ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "stream proxy fastopen send: fd:%d %z of %uz",
+                   pc->fd, n, size);
 
-        ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
-        return;
-    }
+    if (n == -1) {
+        err = ngx_socket_errno;
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+        if (err != NGX_EAGAIN && err != NGX_EINPROGRESS) {
+            ngx_connection_error(pc, err, "send() failed");
+            return NGX_DECLINED;
+        }
 
-    if (from_upstream) {
-        src = pc;
-        dst = c;
-        b = &u->upstream_buf;
-        limit_rate = pscf->download_rate;
-        received = &u->received;
-        out = &u->downstream_out;
-        busy = &u->downstream_busy;
+        /* no cookie yet, the data are sent after the handshake */
 
-    } else {
-        src = c;
-        dst = pc;
-        b = &u->downstream_buf;
-        limit_rate = pscf->upload_rate;
-        received = &s->received;
-        out = &u->upstream_out;
-        busy = &u->upstream_busy;
+        n = 0;
     }
 
-    for ( ;; ) {
-
-        if (do_write && dst) {
-
-            if (*out || *busy || dst->buffered) {
-                rc = ngx_stream_top_filter(s, *out, from_upstream);
+    ctx->fastopen = n;
+    pc->sent += n;
 
-                if (rc == NGX_ERROR) {
-                    if (c->type == SOCK_DGRAM && !from_upstream) {
-                        ngx_stream_proxy_next_upstream(s);
-                        return;
-                    }
+    pc->write->ready = 0;
 
-                    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
-                    return;
-                }
+    if (ngx_handle_write_event(pc->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-                ngx_chain_update_chains(c->pool, &u->free, busy, out,
-                                      (ngx_buf_tag_t) &ngx_stream_proxy_module);
+    return NGX_AGAIN;
+}
 
-                if (*busy == NULL) {
-                    b->pos = b->start;
-                    b->last = b->start;
-                }
-            }
-        }
+#endif
 
-        size = b->end - b->last;
 
-        if (size && src->read->ready && !src->read->delayed
-            && !src->read->error)
-        {
-            if (limit_rate) {
-                limit = (off_t) limit_rate * (ngx_time() - u->start_sec + 1)
-                        - *received;
+#if (NGX_HAVE_IOURING_BUF_RING)
 
-                if (limit <= 0) {
-                    src->read->delayed = 1;
-                    delay = (ngx_msec_t) (- limit * 1000 / limit_rate + 1);
-                    ngx_add_timer(src->read, delay);
-                    break;
-                }
+static void
+ngx_stream_proxy_init_iouring(ngx_stream_session_t *s)
+{
+    ngx_connection_t             *c, *pc;
+    ngx_stream_proxy_ctx_t       *ctx;
+    ngx_stream_proxy_srv_conf_t  *pscf;
 
-                if ((off_t) size > limit) {
-                    size = (size_t) limit;
-                }
-            }
+    c = s->connection;
+    pc = s->upstream->peer.connection;
 
-            n = src->recv(src, b->last, size);
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
 
-            if (n == NGX_AGAIN) {
-                break;
-            }
+    /* the ring buffers are passed on as is, without rate limiting */
 
-            if (n == NGX_ERROR) {
-                if (c->type == SOCK_DGRAM && u->received == 0) {
-                    ngx_stream_proxy_next_upstream(s);
-                    return;
-                }
+    if (!ngx_use_iouring_buffers
+        || c->type != SOCK_STREAM
+        || s->filter_need_in_memory
+        || pscf->upload_rate
+        || pscf->download_rate
+        || pscf->keepalive_framing)
+    {
+        return;
+    }
 
-                src->read->eof = 1;
-                n = 0;
-            }
+#if (NGX_SSL)
+    if (c->ssl || pc->ssl) {
+        return;
+    }
+#endif
 
-            if (n >= 0) {
-                if (limit_rate) {
-                    delay = (ngx_msec_t) (n * 1000 / limit_rate);
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
 
-                    if (delay > 0) {
-                        src->read->delayed = 1;
-                        ngx_add_timer(src->read, delay);
-                    }
-                }
+#if (NGX_HAVE_SPLICE)
+    if (ctx->pipe[0]) {
+        return;
+    }
+#endif
 
-                if (from_upstream) {
-                    if (u->state->first_byte_time == (ngx_msec_t) -1) {
-                        u->state->first_byte_time = ngx_current_msec
-                                                    - u->state->response_time;
-                    }
-                }
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    if (ctx->zerocopy.enabled) {
+        return;
+    }
+#endif
 
-                if (c->type == SOCK_DGRAM && ++u->responses == pscf->responses)
-                {
-                    src->read->ready = 0;
-                    src->read->eof = 1;
-                }
+    ctx->iouring = NGX_STREAM_PROXY_IOURING_PENDING;
+}
 
-                for (ll = out; *ll; ll = &(*ll)->next) { /* void */ }
 
-                cl = ngx_chain_get_free_buf(c->pool, &u->free);
-                if (cl == NULL) {
-                    ngx_stream_proxy_finalize(s,
-                                              NGX_STREAM_INTERNAL_SERVER_ERROR);
-                    return;
-                }
+static ngx_int_t
+ngx_stream_proxy_iouring_start(ngx_stream_session_t *s)
+{
+    ngx_connection_t        *c, *pc;
+    ngx_stream_upstream_t   *u;
+    ngx_stream_proxy_ctx_t  *ctx;
 
-                *ll = cl;
+    u = s->upstream;
 
-                cl->buf->pos = b->last;
-                cl->buf->last = b->last + n;
-                cl->buf->tag = (ngx_buf_tag_t) &ngx_stream_proxy_module;
+    c = s->connection;
+    pc = u->peer.connection;
 
-                cl->buf->temporary = (n ? 1 : 0);
-                cl->buf->last_buf = src->read->eof;
-                cl->buf->flush = 1;
+    /* preread data and the PROXY protocol header are sent first */
 
-                *received += n;
-                b->last += n;
-                do_write = 1;
+    if (u->upstream_buf.start || u->downstream_buf.start
+        || u->upstream_out || u->upstream_busy
+        || u->downstream_out || u->downstream_busy
+        || c->buffered || pc->buffered
+        || c->read->eof || pc->read->eof)
+    {
+        return NGX_OK;
+    }
 
-                continue;
-            }
-        }
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "stream proxy io_uring: %d, %d", c->fd, pc->fd);
 
-        break;
+    if (ngx_iouring_start(c) != NGX_OK || ngx_iouring_start(pc) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    if (src->read->eof && dst && (dst->read->eof || !dst->buffered)) {
-        handler = c->log->handler;
-        c->log->handler = NULL;
-
-        ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                      "%s%s disconnected"
-                      ", bytes from/to client:%O/%O"
-                      ", bytes from/to upstream:%O/%O",
-                      src->type == SOCK_DGRAM ? "udp " : "",
-                      from_upstream ? "upstream" : "client",
-                      s->received, c->sent, u->received, pc ? pc->sent : 0);
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+    ctx->iouring = NGX_STREAM_PROXY_IOURING_ACTIVE;
 
-        c->log->handler = handler;
+    return NGX_OK;
+}
 
-        ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
-        return;
-    }
 
-    flags = src->read->eof ? NGX_CLOSE_EVENT : 0;
+/*
+ * returns the ring buffers of the chain, all of them or the leading ones
+ * which are sent, and whether the whole chain is sent
+ */
 
-    if (!src->shared && ngx_handle_read_event(src->read, flags) != NGX_OK) {
-        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-        return;
-    }
+static ngx_uint_t
+ngx_stream_proxy_iouring_free(ngx_chain_t *cl, ngx_uint_t all)
+{
+    for ( /* void */ ; cl; cl = cl->next) {
 
-    if (dst) {
-        if (!dst->shared && ngx_handle_write_event(dst->write, 0) != NGX_OK) {
-            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-            return;
+        if (!all && ngx_buf_size(cl->buf) != 0) {
+            return 0;
         }
 
-        if (!c->read->delayed && !pc->read->delayed) {
-            ngx_add_timer(c->write, pscf->timeout);
-
-        } else if (c->write->timer_set) {
-            ngx_del_timer(c->write);
+        if (cl->buf->tag == (ngx_buf_tag_t) &ngx_iouring_module) {
+            ngx_iouring_free_buf(cl->buf);
         }
     }
+
+    return 1;
 }
 
+#endif
+
 
 static void
 ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
 {
+    ngx_uint_t                    racing;
     ngx_msec_t                    timeout;
     ngx_connection_t             *pc;
     ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_ctx_t       *ctx;
     ngx_stream_proxy_srv_conf_t  *pscf;
 
     ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
@@ -1690,10 +4022,13 @@ ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
     }
 
     pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    racing = (ctx->race && ctx->race->active);
 
     timeout = pscf->next_upstream_timeout;
 
-    if (u->peer.tries == 0
+    if ((u->peer.tries == 0 && !racing)
         || !pscf->next_upstream
         || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
     {
@@ -1717,10 +4052,18 @@ ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
         u->state->bytes_received = u->received;
         u->state->bytes_sent = pc->sent;
 
+        if (pc->pool != s->connection->pool) {
+            ngx_destroy_pool(pc->pool);
+        }
+
         ngx_close_connection(pc);
         u->peer.connection = NULL;
     }
 
+    if (racing && ngx_stream_proxy_race_promote(s) == NGX_OK) {
+        return;
+    }
+
     ngx_stream_proxy_connect(s);
 }
 
@@ -1745,6 +4088,8 @@ ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
         u->resolved->ctx = NULL;
     }
 
+    ngx_stream_proxy_race_close(s);
+
     pc = u->peer.connection;
 
     if (u->state) {
@@ -1761,6 +4106,10 @@ ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
         u->peer.sockaddr = NULL;
     }
 
+    /* the connection may be kept in the keepalive cache */
+
+    pc = u->peer.connection;
+
     if (pc) {
         ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
                        "close stream proxy upstream connection: %d", pc->fd);
@@ -1772,12 +4121,20 @@ ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
         }
 #endif
 
+        if (pc->pool != s->connection->pool) {
+            ngx_destroy_pool(pc->pool);
+        }
+
         ngx_close_connection(pc);
         u->peer.connection = NULL;
     }
 
 noupstream:
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    ngx_stream_proxy_zerocopy_close(s);
+#endif
+
     ngx_stream_finalize_session(s, rc);
 }
 
@@ -1843,14 +4200,35 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->timeout = NGX_CONF_UNSET_MSEC;
     conf->next_upstream_timeout = NGX_CONF_UNSET_MSEC;
     conf->buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->min_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->max_buffer_size = NGX_CONF_UNSET_SIZE;
     conf->upload_rate = NGX_CONF_UNSET_SIZE;
     conf->download_rate = NGX_CONF_UNSET_SIZE;
     conf->responses = NGX_CONF_UNSET_UINT;
     conf->next_upstream_tries = NGX_CONF_UNSET_UINT;
+    conf->connect_race = NGX_CONF_UNSET_UINT;
+    conf->connect_race_delay = NGX_CONF_UNSET_MSEC;
     conf->next_upstream = NGX_CONF_UNSET;
     conf->proxy_protocol = NGX_CONF_UNSET;
+    conf->keepalive_framing = NGX_CONF_UNSET_UINT;
     conf->local = NGX_CONF_UNSET_PTR;
 
+#if (NGX_HAVE_SPLICE)
+    conf->splice = NGX_CONF_UNSET;
+#endif
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    conf->zerocopy_threshold = NGX_CONF_UNSET_SIZE;
+#endif
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+    conf->iouring = NGX_CONF_UNSET;
+#endif
+
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+    conf->fastopen = NGX_CONF_UNSET;
+#endif
+
 #if (NGX_STREAM_SSL)
     conf->ssl_enable = NGX_CONF_UNSET;
     conf->ssl_session_reuse = NGX_CONF_UNSET;
@@ -1882,6 +4260,21 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->buffer_size,
                               prev->buffer_size, 16384);
 
+    if (conf->max_buffer_size == NGX_CONF_UNSET_SIZE) {
+        conf->min_buffer_size = prev->min_buffer_size;
+        conf->max_buffer_size = prev->max_buffer_size;
+
+        /*
+         * off by default: a filter such as an AEAD decoder needs a whole
+         * record in the buffer, and the proxy cannot know the record size
+         */
+
+        if (conf->max_buffer_size == NGX_CONF_UNSET_SIZE) {
+            conf->min_buffer_size = 0;
+            conf->max_buffer_size = 0;
+        }
+    }
+
     ngx_conf_merge_size_value(conf->upload_rate,
                               prev->upload_rate, 0);
 
@@ -1894,12 +4287,38 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_uint_value(conf->next_upstream_tries,
                               prev->next_upstream_tries, 0);
 
+    ngx_conf_merge_uint_value(conf->connect_race, prev->connect_race, 1);
+
+    ngx_conf_merge_msec_value(conf->connect_race_delay,
+                              prev->connect_race_delay, 250);
+
     ngx_conf_merge_value(conf->next_upstream, prev->next_upstream, 1);
 
     ngx_conf_merge_value(conf->proxy_protocol, prev->proxy_protocol, 0);
 
+    ngx_conf_merge_uint_value(conf->keepalive_framing,
+                              prev->keepalive_framing,
+                              NGX_STREAM_PROXY_FRAMING_OFF);
+
     ngx_conf_merge_ptr_value(conf->local, prev->local, NULL);
 
+#if (NGX_HAVE_SPLICE)
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+#endif
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    ngx_conf_merge_size_value(conf->zerocopy_threshold,
+                              prev->zerocopy_threshold, 0);
+#endif
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+    ngx_conf_merge_value(conf->iouring, prev->iouring, 0);
+#endif
+
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+    ngx_conf_merge_value(conf->fastopen, prev->fastopen, 0);
+#endif
+
 #if (NGX_STREAM_SSL)
 
     ngx_conf_merge_value(conf->ssl_enable, prev->ssl_enable, 0);
@@ -2168,3 +4587,49 @@ ngx_stream_proxy_bind(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_stream_proxy_adaptive_buffer_size(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_proxy_srv_conf_t *pscf = conf;
+
+    ssize_t     min, max;
+    ngx_str_t  *value;
+
+    if (pscf->max_buffer_size != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2) {
+        if (ngx_strcmp(value[1].data, "off") == 0) {
+            pscf->min_buffer_size = 0;
+            pscf->max_buffer_size = 0;
+            return NGX_CONF_OK;
+        }
+
+        return "takes either \"off\" or minimum and maximum sizes";
+    }
+
+    min = ngx_parse_size(&value[1]);
+    if (min == NGX_ERROR || min == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid minimum size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    max = ngx_parse_size(&value[2]);
+    if (max == NGX_ERROR || max < min) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid maximum size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    pscf->min_buffer_size = min;
+    pscf->max_buffer_size = max;
+
+    return NGX_CONF_OK;
+}
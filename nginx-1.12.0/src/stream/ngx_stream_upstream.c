@@ -513,13 +513,51 @@ ngx_stream_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            us->resolve = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "service=", 8) == 0) {
+
+            us->service.len = value[i].len - 8;
+            us->service.data = &value[i].data[8];
+
+            if (us->service.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+#endif
+
         goto invalid;
     }
 
+    if (us->service.len && !us->resolve) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "service upstream \"%V\" requires "
+                           "\"resolve\" parameter", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (us->resolve && us->backup) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "backup server \"%V\" cannot be resolved "
+                           "at run time", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
     ngx_memzero(&u, sizeof(ngx_url_t));
 
     u.url = value[1];
 
+    /* names of resolvable servers are resolved at run time */
+    u.no_resolve = us->resolve;
+
     if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
         if (u.err) {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
@@ -529,12 +567,24 @@ ngx_stream_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    if (u.no_port) {
+    /* a service provides ports itself */
+
+    if (u.no_port && us->service.len == 0) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "no port in upstream \"%V\"", &u.url);
         return NGX_CONF_ERROR;
     }
 
+    if (u.naddrs) {
+        /* an address literal needs no resolving */
+        us->resolve = 0;
+        us->service.len = 0;
+
+    } else if (us->resolve) {
+        us->host = u.host;
+        us->port = u.port;
+    }
+
     us->name = u.url;
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
@@ -40,11 +40,17 @@ typedef ngx_int_t (*ngx_stream_upstream_init_pt)(ngx_conf_t *cf,
     ngx_stream_upstream_srv_conf_t *us);
 typedef ngx_int_t (*ngx_stream_upstream_init_peer_pt)(ngx_stream_session_t *s,
     ngx_stream_upstream_srv_conf_t *us);
+typedef void (*ngx_stream_upstream_update_pt)(
+    ngx_stream_upstream_srv_conf_t *us);
 
 
 typedef struct {
     ngx_stream_upstream_init_pt        init_upstream;
     ngx_stream_upstream_init_peer_pt   init;
+    ngx_stream_upstream_update_pt      update;   /* called with the peers
+                                                    locked after servers were
+                                                    resolved to other
+                                                    addresses */
     void                              *data;
 } ngx_stream_upstream_peer_t;
 
@@ -59,8 +65,13 @@ typedef struct {
     time_t                             fail_timeout;
     ngx_msec_t                         slow_start;
 
+    ngx_str_t                          host;
+    ngx_str_t                          service;
+    in_port_t                          port;
+
     unsigned                           down:1;
     unsigned                           backup:1;
+    unsigned                           resolve:1;
 
     NGX_COMPAT_BEGIN(4)
     NGX_COMPAT_END
@@ -137,6 +148,7 @@ typedef struct {
     ngx_stream_upstream_state_t       *state;
     unsigned                           connected:1;
     unsigned                           proxy_protocol:1;
+    unsigned                           keepalive:1;
 } ngx_stream_upstream_t;
 
 
@@ -0,0 +1,556 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+typedef struct {
+    ngx_msec_t                            decay;
+
+    /* per-process index of the (possibly shared) peers */
+    ngx_stream_upstream_rr_peers_t       *peers;
+    ngx_stream_upstream_rr_peer_t       **primary;
+    ngx_stream_upstream_rr_peer_t       **backup;
+    ngx_uint_t                            config;
+    ngx_pool_t                           *pool;
+} ngx_stream_upstream_ewma_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_stream_upstream_rr_peer_data_t    rrp;
+    ngx_stream_upstream_ewma_srv_conf_t  *conf;
+    ngx_stream_session_t                 *session;
+} ngx_stream_upstream_ewma_peer_data_t;
+
+
+static ngx_int_t ngx_stream_upstream_init_ewma_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_ewma_index(
+    ngx_stream_upstream_ewma_srv_conf_t *conf,
+    ngx_stream_upstream_rr_peers_t *peers,
+    ngx_stream_upstream_rr_peer_data_t *rrp);
+static ngx_int_t ngx_stream_upstream_get_ewma_peer(ngx_peer_connection_t *pc,
+    void *data);
+static ngx_stream_upstream_rr_peer_t *ngx_stream_upstream_ewma_pick(
+    ngx_stream_upstream_rr_peer_data_t *rrp,
+    ngx_stream_upstream_rr_peer_t **index, ngx_uint_t skip, ngx_uint_t *p);
+static void ngx_stream_upstream_free_ewma_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+static void *ngx_stream_upstream_ewma_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_stream_upstream_ewma_commands[] = {
+
+    { ngx_string("ewma"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_stream_upstream_ewma,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_ewma_module_ctx = {
+    NULL,                                    /* preconfiguration */
+    NULL,                                    /* postconfiguration */
+
+    NULL,                                    /* create main configuration */
+    NULL,                                    /* init main configuration */
+
+    ngx_stream_upstream_ewma_create_conf,    /* create server configuration */
+    NULL                                     /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_ewma_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_ewma_module_ctx,    /* module context */
+    ngx_stream_upstream_ewma_commands,       /* module directives */
+    NGX_STREAM_MODULE,                       /* module type */
+    NULL,                                    /* init master */
+    NULL,                                    /* init module */
+    NULL,                                    /* init process */
+    NULL,                                    /* init thread */
+    NULL,                                    /* exit thread */
+    NULL,                                    /* exit process */
+    NULL,                                    /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_upstream_init_ewma(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, cf->log, 0,
+                   "init ewma");
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_upstream_init_ewma_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_ewma_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_ewma_srv_conf_t   *conf;
+    ngx_stream_upstream_ewma_peer_data_t  *ep;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "init ewma peer");
+
+    conf = ngx_stream_conf_upstream_srv_conf(us,
+                                             ngx_stream_upstream_ewma_module);
+
+    ep = ngx_palloc(s->connection->pool,
+                    sizeof(ngx_stream_upstream_ewma_peer_data_t));
+    if (ep == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.data = &ep->rrp;
+
+    if (ngx_stream_upstream_init_round_robin_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * the zone module replaces peers after configuration is read,
+     * so the index is built on first use in each process, and again
+     * each time servers are resolved to other addresses
+     */
+
+    if ((conf->peers != us->peer.data || conf->config != ep->rrp.config)
+        && ngx_stream_upstream_ewma_index(conf, us->peer.data, &ep->rrp)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ep->conf = conf;
+    ep->session = s;
+
+    s->upstream->peer.get = ngx_stream_upstream_get_ewma_peer;
+    s->upstream->peer.free = ngx_stream_upstream_free_ewma_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_ewma_index(ngx_stream_upstream_ewma_srv_conf_t *conf,
+    ngx_stream_upstream_rr_peers_t *peers,
+    ngx_stream_upstream_rr_peer_data_t *rrp)
+{
+    ngx_uint_t                       i;
+    ngx_pool_t                      *pool;
+    ngx_stream_upstream_rr_peer_t   *peer, **index;
+    ngx_stream_upstream_rr_peers_t  *backup;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_stream_upstream_rr_peers_rlock_config(peers);
+
+    if (ngx_stream_upstream_rr_peers_changed(peers, rrp)) {
+        ngx_stream_upstream_rr_peers_unlock_config(peers);
+        ngx_destroy_pool(pool);
+
+        /* the session will fail over to backup servers, if any */
+
+        return NGX_OK;
+    }
+
+    index = ngx_palloc(pool, sizeof(ngx_stream_upstream_rr_peer_t *)
+                             * (peers->number
+                                + (peers->next ? peers->next->number : 0)));
+    if (index == NULL) {
+        ngx_stream_upstream_rr_peers_unlock_config(peers);
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    if (conf->pool) {
+        ngx_destroy_pool(conf->pool);
+    }
+
+    conf->pool = pool;
+    conf->primary = index;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        index[i] = peer;
+    }
+
+    backup = peers->next;
+
+    if (backup) {
+        conf->backup = &index[i];
+
+        for (peer = backup->peer, i = 0; peer; peer = peer->next, i++) {
+            conf->backup[i] = peer;
+        }
+
+    } else {
+        conf->backup = NULL;
+    }
+
+    conf->peers = peers;
+    conf->config = rrp->config;
+
+    ngx_stream_upstream_rr_peers_unlock_config(peers);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_get_ewma_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_upstream_ewma_peer_data_t  *ep = data;
+
+    time_t                           now;
+    uint64_t                         a, b;
+    uintptr_t                        m;
+    ngx_int_t                        rc;
+    ngx_uint_t                       i, n, p, q;
+    ngx_stream_upstream_rr_peer_t   *best, *peer, **index;
+    ngx_stream_upstream_rr_peers_t  *peers;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get ewma peer, try: %ui", pc->tries);
+
+    if (ep->rrp.peers->single) {
+        return ngx_stream_upstream_get_round_robin_peer(pc, &ep->rrp);
+    }
+
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    peers = ep->rrp.peers;
+
+    ngx_stream_upstream_rr_peers_rlock_config(peers);
+
+    if (peers->number == 0
+        || ngx_stream_upstream_rr_peers_changed(peers, &ep->rrp))
+    {
+        goto failed;
+    }
+
+    index = (peers == ep->conf->peers) ? ep->conf->primary : ep->conf->backup;
+
+    /*
+     * power of two choices: pick two random usable peers and
+     * select the one with the lower latency and load; peers are
+     * read without the write lock, only the connection counter
+     * is atomic
+     */
+
+    for ( ;; ) {
+        best = ngx_stream_upstream_ewma_pick(&ep->rrp, index, peers->number,
+                                             &p);
+
+        if (best == NULL) {
+            ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                           "get ewma peer, no peer found");
+
+            goto failed;
+        }
+
+        peer = ngx_stream_upstream_ewma_pick(&ep->rrp, index, p, &q);
+
+        if (peer) {
+            a = (uint64_t) (best->ewma + 1) * (best->conns + 1) * peer->weight;
+            b = (uint64_t) (peer->ewma + 1) * (peer->conns + 1) * best->weight;
+
+            ngx_log_debug4(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                           "get ewma peer, %V: %M, %V: %M",
+                           &best->name, best->ewma, &peer->name, peer->ewma);
+
+            if (b < a) {
+                best = peer;
+                p = q;
+            }
+        }
+
+        n = p / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+        ep->rrp.tried[n] |= m;
+
+        if (ngx_stream_upstream_rr_peer_acquire(best) == NGX_OK) {
+            break;
+        }
+
+        /* max_conns was reached by another worker meanwhile */
+    }
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    ngx_stream_upstream_rr_peers_unlock_config(peers);
+
+    ep->rrp.current = best;
+
+    return NGX_OK;
+
+failed:
+
+    ngx_stream_upstream_rr_peers_unlock_config(peers);
+
+    if (peers->next) {
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "get ewma peer, backup servers");
+
+        ep->rrp.peers = peers->next;
+
+        n = (ep->rrp.peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        for (i = 0; i < n; i++) {
+            ep->rrp.tried[i] = 0;
+        }
+
+        rc = ngx_stream_upstream_get_ewma_peer(pc, ep);
+
+        if (rc != NGX_BUSY) {
+            return rc;
+        }
+    }
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+
+/*
+ * starts at a random peer and returns the first usable one, excluding
+ * the peer at position "skip"; usually this takes just one step
+ */
+
+static ngx_stream_upstream_rr_peer_t *
+ngx_stream_upstream_ewma_pick(ngx_stream_upstream_rr_peer_data_t *rrp,
+    ngx_stream_upstream_rr_peer_t **index, ngx_uint_t skip, ngx_uint_t *p)
+{
+    time_t                          now;
+    uintptr_t                       m;
+    ngx_uint_t                      i, k, n, number;
+    ngx_stream_upstream_rr_peer_t  *peer;
+
+    now = ngx_time();
+
+    number = rrp->peers->number;
+
+    i = ngx_random() % number;
+
+    for (k = 0; k < number; k++, i = (i + 1) % number) {
+
+        if (i == skip) {
+            continue;
+        }
+
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n] & m) {
+            continue;
+        }
+
+        peer = index[i];
+
+        if (peer->down || peer->unhealthy) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        *p = i;
+
+        return peer;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_stream_upstream_free_ewma_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_stream_upstream_ewma_peer_data_t  *ep = data;
+
+    ngx_msec_t                      sample, decay, elapsed, ewma;
+    ngx_stream_upstream_t          *u;
+    ngx_stream_upstream_rr_peer_t  *peer;
+
+    u = ep->session->upstream;
+    peer = ep->rrp.current;
+
+    if (u->state == NULL) {
+        goto done;
+    }
+
+    if (state & NGX_PEER_FAILED) {
+        /* a failed attempt counts with the time it took */
+        sample = ngx_current_msec - u->state->response_time;
+
+    } else if (u->state->first_byte_time != (ngx_msec_t) -1) {
+        sample = u->state->first_byte_time;
+
+    } else if (u->state->connect_time != (ngx_msec_t) -1) {
+        sample = u->state->connect_time;
+
+    } else {
+        goto done;
+    }
+
+    /* the average is kept in microseconds to decay smoothly */
+
+    sample *= 1000;
+    decay = ep->conf->decay;
+
+    /*
+     * updated without locks: concurrent updates from other workers
+     * may lose a sample, which does not matter for an average
+     */
+
+    ewma = peer->ewma;
+    elapsed = ngx_current_msec - peer->ewma_stamp;
+
+    if (sample >= ewma || elapsed >= decay) {
+        /* peaks are taken immediately */
+        ewma = sample;
+
+    } else {
+        ewma = (ngx_msec_t) (((uint64_t) ewma * (decay - elapsed)
+                              + (uint64_t) sample * elapsed) / decay);
+    }
+
+    peer->ewma = ewma;
+    peer->ewma_stamp = ngx_current_msec;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "free ewma peer %V, sample: %M, ewma: %M",
+                   &peer->name, sample, ewma);
+
+done:
+
+    ngx_stream_upstream_free_round_robin_peer(pc, &ep->rrp, state);
+}
+
+
+static void *
+ngx_stream_upstream_ewma_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_ewma_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_ewma_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->peers = NULL;
+     *     conf->primary = NULL;
+     *     conf->backup = NULL;
+     *     conf->config = 0;
+     *     conf->pool = NULL;
+     */
+
+    conf->decay = 10000;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_upstream_ewma_srv_conf_t  *ecf = conf;
+
+    ngx_str_t                       *value, s;
+    ngx_msec_t                       decay;
+    ngx_stream_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2) {
+
+        if (ngx_strncmp(value[1].data, "decay=", 6) != 0) {
+            goto invalid;
+        }
+
+        s.len = value[1].len - 6;
+        s.data = &value[1].data[6];
+
+        decay = ngx_parse_time(&s, 0);
+
+        if (decay == (ngx_msec_t) NGX_ERROR || decay == 0) {
+            goto invalid;
+        }
+
+        ecf->decay = decay;
+    }
+
+    uscf->peer.init_upstream = ngx_stream_upstream_init_ewma;
+
+    uscf->flags = NGX_STREAM_UPSTREAM_CREATE
+                  |NGX_STREAM_UPSTREAM_WEIGHT
+                  |NGX_STREAM_UPSTREAM_MAX_CONNS
+                  |NGX_STREAM_UPSTREAM_MAX_FAILS
+                  |NGX_STREAM_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_STREAM_UPSTREAM_DOWN
+                  |NGX_STREAM_UPSTREAM_BACKUP;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[1]);
+
+    return NGX_CONF_ERROR;
+}
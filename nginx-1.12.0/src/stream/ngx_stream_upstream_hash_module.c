@@ -16,15 +16,50 @@ typedef struct {
 } ngx_stream_upstream_chash_point_t;
 
 
+/*
+ * peers of a server are placed on the ring together by the server name,
+ * peers of a server resolved at run time each by its own address, so
+ * that keys stay with an address as others come and go
+ */
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+#define ngx_stream_upstream_chash_server(peer)                                \
+    ((peer)->host ? &(peer)->name : &(peer)->server)
+#else
+#define ngx_stream_upstream_chash_server(peer)  (&(peer)->server)
+#endif
+
+
 typedef struct {
     ngx_uint_t                            number;
     ngx_stream_upstream_chash_point_t     point[1];
 } ngx_stream_upstream_chash_points_t;
 
 
+typedef struct {
+    ngx_uint_t                            number;
+    ngx_uint_t                            jump;   /* unsigned  jump:1; */
+    ngx_uint_t                            config; /* of the peers it is
+                                                     built for */
+
+    /* names of the peers the slots refer to, by position */
+    ngx_uint_t                            npeers;
+    ngx_str_t                            *names;
+
+    uint32_t                              slot[1];
+} ngx_stream_upstream_hash_table_t;
+
+
 typedef struct {
     ngx_stream_complex_value_t            key;
     ngx_stream_upstream_chash_points_t   *points;
+    ngx_stream_upstream_hash_table_t     *table;
+
+    /* per-process index of the (possibly shared) peers */
+    ngx_stream_upstream_rr_peers_t       *peers;
+    ngx_stream_upstream_rr_peer_t       **index;
+    ngx_uint_t                            config;
+    ngx_pool_t                           *pool;
 } ngx_stream_upstream_hash_srv_conf_t;
 
 
@@ -49,6 +84,9 @@ static ngx_int_t ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc,
 
 static ngx_int_t ngx_stream_upstream_init_chash(ngx_conf_t *cf,
     ngx_stream_upstream_srv_conf_t *us);
+static ngx_stream_upstream_chash_points_t *
+    ngx_stream_upstream_create_chash_points(
+    ngx_stream_upstream_rr_peers_t *peers, ngx_pool_t *pool);
 static int ngx_libc_cdecl
     ngx_stream_upstream_chash_cmp_points(const void *one, const void *two);
 static ngx_uint_t ngx_stream_upstream_find_chash_point(
@@ -58,6 +96,29 @@ static ngx_int_t ngx_stream_upstream_init_chash_peer(ngx_stream_session_t *s,
 static ngx_int_t ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc,
     void *data);
 
+static ngx_int_t ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_init_jump(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_stream_upstream_hash_table_t *ngx_stream_upstream_create_table(
+    ngx_stream_upstream_rr_peers_t *peers, ngx_uint_t jump,
+    ngx_stream_upstream_hash_table_t *prev, ngx_pool_t *pool);
+#if (NGX_STREAM_UPSTREAM_ZONE)
+static void ngx_stream_upstream_update_table(
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_stream_upstream_hash_table_t *ngx_stream_upstream_copy_table(
+    ngx_stream_upstream_hash_table_t *table, ngx_slab_pool_t *shpool);
+#endif
+static ngx_uint_t *ngx_stream_upstream_map_table(
+    ngx_stream_upstream_hash_table_t *prev, ngx_str_t *names,
+    ngx_uint_t number);
+static ngx_uint_t ngx_stream_upstream_maglev_prime(ngx_uint_t n);
+static ngx_uint_t ngx_stream_upstream_jump_hash(uint64_t key, ngx_uint_t n);
+static ngx_int_t ngx_stream_upstream_init_table_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_get_table_peer(ngx_peer_connection_t *pc,
+    void *data);
+
 static void *ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf);
 static char *ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -176,10 +237,16 @@ ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
                    "get hash peer, try: %ui", pc->tries);
 
-    ngx_stream_upstream_rr_peers_wlock(hp->rrp.peers);
-
     if (hp->tries > 20 || hp->rrp.peers->single) {
-        ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    ngx_stream_upstream_rr_peers_rlock_config(hp->rrp.peers);
+
+    if (hp->rrp.peers->number == 0
+        || ngx_stream_upstream_rr_peers_changed(hp->rrp.peers, &hp->rrp))
+    {
+        ngx_stream_upstream_rr_peers_unlock_config(hp->rrp.peers);
         return hp->get_rr_peer(pc, &hp->rrp);
     }
 
@@ -230,7 +297,7 @@ ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
         ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
                        "get hash peer, value:%uD, peer:%ui", hp->hash, p);
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             goto next;
         }
 
@@ -241,7 +308,7 @@ ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
             goto next;
         }
 
-        if (peer->max_conns && peer->conns >= peer->max_conns) {
+        if (ngx_stream_upstream_rr_peer_acquire(peer) != NGX_OK) {
             goto next;
         }
 
@@ -250,7 +317,7 @@ ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
     next:
 
         if (++hp->tries > 20) {
-            ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+            ngx_stream_upstream_rr_peers_unlock_config(hp->rrp.peers);
             return hp->get_rr_peer(pc, &hp->rrp);
         }
     }
@@ -261,13 +328,11 @@ ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
     pc->socklen = peer->socklen;
     pc->name = &peer->name;
 
-    peer->conns++;
-
     if (now - peer->checked > peer->fail_timeout) {
         peer->checked = now;
     }
 
-    ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+    ngx_stream_upstream_rr_peers_unlock_config(hp->rrp.peers);
 
     hp->rrp.tried[n] |= m;
 
@@ -278,42 +343,92 @@ ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
 static ngx_int_t
 ngx_stream_upstream_init_chash(ngx_conf_t *cf,
     ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_hash_srv_conf_t  *hcf;
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_upstream_init_chash_peer;
+
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+
+    hcf->points = ngx_stream_upstream_create_chash_points(us->peer.data,
+                                                          cf->pool);
+    if (hcf->points == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_stream_upstream_chash_points_t *
+ngx_stream_upstream_create_chash_points(ngx_stream_upstream_rr_peers_t *peers,
+    ngx_pool_t *pool)
 {
     u_char                               *host, *port, c;
     size_t                                host_len, port_len, size;
     uint32_t                              hash, base_hash;
     ngx_str_t                            *server;
     ngx_uint_t                            npoints, i, j;
-    ngx_stream_upstream_rr_peer_t        *peer;
-    ngx_stream_upstream_rr_peers_t       *peers;
+    ngx_stream_upstream_rr_peer_t        *peer, *prev;
     ngx_stream_upstream_chash_points_t   *points;
-    ngx_stream_upstream_hash_srv_conf_t  *hcf;
     union {
         uint32_t                          value;
         u_char                            byte[4];
     } prev_hash;
 
-    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
-        return NGX_ERROR;
-    }
-
-    us->peer.init = ngx_stream_upstream_init_chash_peer;
+    npoints = 0;
 
-    peers = us->peer.data;
-    npoints = peers->total_weight * 160;
+    for (peer = peers->peer; peer; peer = peer->next) {
+        npoints += peer->weight * 160;
+    }
 
     size = sizeof(ngx_stream_upstream_chash_points_t)
-           + sizeof(ngx_stream_upstream_chash_point_t) * (npoints - 1);
+           + sizeof(ngx_stream_upstream_chash_point_t)
+             * (npoints ? npoints - 1 : 0);
 
-    points = ngx_palloc(cf->pool, size);
+    points = ngx_palloc(pool, size);
     if (points == NULL) {
-        return NGX_ERROR;
+        return NULL;
     }
 
     points->number = 0;
 
     for (peer = peers->peer; peer; peer = peer->next) {
-        server = &peer->server;
+        server = ngx_stream_upstream_chash_server(peer);
+
+        for (prev = peers->peer; prev != peer; prev = prev->next) {
+            if (ngx_stream_upstream_chash_server(prev)->len == server->len
+                && ngx_strncmp(ngx_stream_upstream_chash_server(prev)->data,
+                               server->data, server->len)
+                   == 0)
+            {
+                break;
+            }
+        }
+
+        if (prev != peer) {
+            /* points of the server are already placed */
+            continue;
+        }
+
+        /* peers may change after the points are built */
+
+        server = ngx_palloc(pool, sizeof(ngx_str_t));
+        if (server == NULL) {
+            return NULL;
+        }
+
+        *server = *ngx_stream_upstream_chash_server(peer);
+
+        server->data = ngx_pstrdup(pool, server);
+        if (server->data == NULL) {
+            return NULL;
+        }
 
         /*
          * Hash expression is compatible with Cache::Memcached::Fast:
@@ -382,6 +497,10 @@ ngx_stream_upstream_init_chash(ngx_conf_t *cf,
         }
     }
 
+    if (points->number == 0) {
+        return points;
+    }
+
     ngx_qsort(points->point,
               points->number,
               sizeof(ngx_stream_upstream_chash_point_t),
@@ -395,11 +514,7 @@ ngx_stream_upstream_init_chash(ngx_conf_t *cf,
 
     points->number = i + 1;
 
-    hcf = ngx_stream_conf_upstream_srv_conf(us,
-                                            ngx_stream_upstream_hash_module);
-    hcf->points = points;
-
-    return NGX_OK;
+    return points;
 }
 
 
@@ -460,6 +575,9 @@ ngx_stream_upstream_init_chash_peer(ngx_stream_session_t *s,
     ngx_stream_upstream_srv_conf_t *us)
 {
     uint32_t                               hash;
+    ngx_pool_t                            *pool;
+    ngx_stream_upstream_rr_peers_t        *peers;
+    ngx_stream_upstream_chash_points_t    *points;
     ngx_stream_upstream_hash_srv_conf_t   *hcf;
     ngx_stream_upstream_hash_peer_data_t  *hp;
 
@@ -475,11 +593,52 @@ ngx_stream_upstream_init_chash_peer(ngx_stream_session_t *s,
 
     hash = ngx_crc32_long(hp->key.data, hp->key.len);
 
-    ngx_stream_upstream_rr_peers_rlock(hp->rrp.peers);
+    peers = us->peer.data;
+
+    if (hp->rrp.config == 0 || hcf->config == hp->rrp.config) {
+        hp->hash = ngx_stream_upstream_find_chash_point(hcf->points, hash);
+        return NGX_OK;
+    }
+
+    /*
+     * the points are built again in each process each time servers
+     * are resolved to other addresses
+     */
 
-    hp->hash = ngx_stream_upstream_find_chash_point(hcf->points, hash);
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+    ngx_stream_upstream_rr_peers_rlock_config(peers);
+
+    if (ngx_stream_upstream_rr_peers_changed(peers, &hp->rrp)) {
+        ngx_stream_upstream_rr_peers_unlock_config(peers);
+        ngx_destroy_pool(pool);
+
+        /* the session will fail over to the next upstream, if any */
+
+        return NGX_OK;
+    }
+
+    points = ngx_stream_upstream_create_chash_points(peers, pool);
+
+    ngx_stream_upstream_rr_peers_unlock_config(peers);
+
+    if (points == NULL) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    if (hcf->pool) {
+        ngx_destroy_pool(hcf->pool);
+    }
+
+    hcf->pool = pool;
+    hcf->points = points;
+    hcf->config = hp->rrp.config;
+
+    hp->hash = ngx_stream_upstream_find_chash_point(points, hash);
 
     return NGX_OK;
 }
@@ -496,6 +655,7 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     ngx_int_t                             total;
     ngx_uint_t                            i, n, best_i;
     ngx_stream_upstream_rr_peer_t        *peer, *best;
+    ngx_stream_upstream_rr_weight_t      *weight;
     ngx_stream_upstream_chash_point_t    *point;
     ngx_stream_upstream_chash_points_t   *points;
     ngx_stream_upstream_hash_srv_conf_t  *hcf;
@@ -503,7 +663,20 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
                    "get consistent hash peer, try: %ui", pc->tries);
 
-    ngx_stream_upstream_rr_peers_wlock(hp->rrp.peers);
+    ngx_stream_upstream_rr_peers_rlock_config(hp->rrp.peers);
+
+    if (ngx_stream_upstream_rr_peers_changed(hp->rrp.peers, &hp->rrp)) {
+        pc->name = hp->rrp.peers->name;
+        ngx_stream_upstream_rr_peers_unlock_config(hp->rrp.peers);
+        return NGX_BUSY;
+    }
+
+    weight = ngx_stream_upstream_rr_peers_weights(&hp->rrp);
+    if (weight == NULL) {
+        pc->name = hp->rrp.peers->name;
+        ngx_stream_upstream_rr_peers_unlock_config(hp->rrp.peers);
+        return NGX_BUSY;
+    }
 
     pc->connection = NULL;
 
@@ -513,6 +686,12 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     points = hcf->points;
     point = &points->point[0];
 
+    if (points->number == 0) {
+        pc->name = hp->rrp.peers->name;
+        ngx_stream_upstream_rr_peers_unlock_config(hp->rrp.peers);
+        return NGX_BUSY;
+    }
+
     for ( ;; ) {
         server = point[hp->hash % points->number].server;
 
@@ -535,12 +714,13 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
-            if (peer->down) {
+            if (peer->down || peer->unhealthy) {
                 continue;
             }
 
-            if (peer->server.len != server->len
-                || ngx_strncmp(peer->server.data, server->data, server->len)
+            if (ngx_stream_upstream_chash_server(peer)->len != server->len
+                || ngx_strncmp(ngx_stream_upstream_chash_server(peer)->data,
+                               server->data, server->len)
                    != 0)
             {
                 continue;
@@ -557,22 +737,36 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
-            peer->current_weight += peer->effective_weight;
-            total += peer->effective_weight;
+            weight[i].current_weight += weight[i].effective_weight;
+            total += weight[i].effective_weight;
 
-            if (peer->effective_weight < peer->weight) {
-                peer->effective_weight++;
+            if (weight[i].effective_weight < peer->weight) {
+                weight[i].effective_weight++;
             }
 
-            if (best == NULL || peer->current_weight > best->current_weight) {
+            if (best == NULL
+                || weight[i].current_weight > weight[best_i].current_weight)
+            {
                 best = peer;
                 best_i = i;
             }
         }
 
         if (best) {
-            best->current_weight -= total;
-            break;
+            weight[best_i].current_weight -= total;
+
+            n = best_i / (8 * sizeof(uintptr_t));
+            m = (uintptr_t) 1 << best_i % (8 * sizeof(uintptr_t));
+
+            hp->rrp.tried[n] |= m;
+
+            /* other processes may have taken the peer meanwhile */
+
+            if (ngx_stream_upstream_rr_peer_acquire(best) == NGX_OK) {
+                break;
+            }
+
+            continue;
         }
 
         hp->hash++;
@@ -580,27 +774,704 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
 
         if (hp->tries >= points->number) {
             pc->name = hp->rrp.peers->name;
-            ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+            ngx_stream_upstream_rr_peers_unlock_config(hp->rrp.peers);
             return NGX_BUSY;
         }
     }
 
     hp->rrp.current = best;
+    hp->rrp.weight = &weight[best_i];
 
     pc->sockaddr = best->sockaddr;
     pc->socklen = best->socklen;
     pc->name = &best->name;
 
-    best->conns++;
-
     if (now - best->checked > best->fail_timeout) {
         best->checked = now;
     }
 
-    ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+    ngx_stream_upstream_rr_peers_unlock_config(hp->rrp.peers);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_hash_srv_conf_t  *hcf;
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_upstream_init_table_peer;
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    us->peer.update = ngx_stream_upstream_update_table;
+#endif
+
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+
+    hcf->table = ngx_stream_upstream_create_table(us->peer.data, 0, NULL,
+                                                  cf->pool);
+    if (hcf->table == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_jump(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_hash_srv_conf_t  *hcf;
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_upstream_init_table_peer;
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    us->peer.update = ngx_stream_upstream_update_table;
+#endif
+
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+
+    hcf->table = ngx_stream_upstream_create_table(us->peer.data, 1, NULL,
+                                                  cf->pool);
+    if (hcf->table == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_stream_upstream_hash_table_t *
+ngx_stream_upstream_create_table(ngx_stream_upstream_rr_peers_t *peers,
+    ngx_uint_t jump, ngx_stream_upstream_hash_table_t *prev, ngx_pool_t *pool)
+{
+    size_t                              size;
+    uint32_t                           *offset, *skip, *next, *slot, c;
+    ngx_str_t                          *names;
+    ngx_uint_t                          i, w, n, len, total, filled;
+    ngx_uint_t                         *map, *weight, *have, *quota;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_hash_table_t   *table;
+
+    total = peers->total_weight;
+
+    if (peers->number == 0) {
+        n = 0;
+
+    } else if (jump) {
+
+        /* jump consistent hash over "total_weight" buckets */
+
+        n = total;
+
+    } else if (prev && !prev->jump && prev->number > total
+               && prev->number >= ngx_min(total * 100, 65536) / 4)
+    {
+        /* slots can only be carried over to a table of the same size */
+
+        n = prev->number;
+
+    } else {
+
+        /* about 100 slots per weight unit keep the imbalance within 1% */
+
+        n = ngx_stream_upstream_maglev_prime(ngx_max(ngx_min(total * 100,
+                                                             65536),
+                                                     total + 1));
+    }
+
+    size = sizeof(ngx_stream_upstream_hash_table_t)
+           + sizeof(uint32_t) * (n ? n - 1 : 0);
+
+    table = ngx_palloc(pool, size);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    names = ngx_palloc(pool, sizeof(ngx_str_t) * (peers->number + 1));
+    if (names == NULL) {
+        return NULL;
+    }
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        names[i].data = ngx_pstrdup(pool, &peer->name);
+        if (names[i].data == NULL) {
+            return NULL;
+        }
+
+        names[i].len = peer->name.len;
+    }
+
+    table->number = n;
+    table->jump = jump;
+    table->config = 0;
+    table->npeers = peers->number;
+    table->names = names;
+
+    if (n == 0) {
+        return table;
+    }
+
+    if (prev && prev->jump == jump && (jump || prev->number == n)) {
+        map = ngx_stream_upstream_map_table(prev, names, peers->number);
+        if (map == NULL) {
+            return NULL;
+        }
+
+    } else {
+        map = NULL;
+    }
+
+    len = jump && map ? ngx_max(prev->number, n) : n;
+
+    slot = ngx_alloc(sizeof(uint32_t) * len
+                     + sizeof(ngx_uint_t) * 3 * peers->number,
+                     ngx_cycle->log);
+    if (slot == NULL) {
+        if (map) {
+            ngx_free(map);
+        }
+
+        return NULL;
+    }
+
+    weight = (ngx_uint_t *) (slot + len);
+    have = weight + peers->number;
+    quota = have + peers->number;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        weight[i] = peer->weight;
+        have[i] = 0;
+
+        /*
+         * when slots are carried over, each peer keeps at most its share
+         * of the table and claims free slots only up to it
+         */
+
+        quota[i] = map ? n * weight[i] / total : n;
+    }
+
+    if (map) {
+        filled = 0;
+
+        for (i = 0; i < peers->number; i++) {
+            filled += quota[i];
+        }
+
+        for (i = 0; filled < n; i++, filled++) {
+            quota[i]++;
+        }
+
+        /* the slots of the peers which are still there stay with them */
+
+        len = jump ? prev->number : n;
 
-    n = best_i / (8 * sizeof(uintptr_t));
-    m = (uintptr_t) 1 << best_i % (8 * sizeof(uintptr_t));
+        for (c = 0; c < len; c++) {
+            i = map[prev->slot[c]];
+
+            if (i != (ngx_uint_t) -1 && have[i] < quota[i]) {
+                slot[c] = (uint32_t) i;
+                have[i]++;
+
+            } else {
+                slot[c] = (uint32_t) -1;
+            }
+        }
+
+        ngx_free(map);
+
+    } else {
+        len = jump ? 0 : n;
+
+        for (c = 0; c < len; c++) {
+            slot[c] = (uint32_t) -1;
+        }
+    }
+
+    if (jump) {
+
+        /*
+         * a jump hash only moves keys of the buckets at the end when
+         * the number of buckets changes, so a freed bucket is taken over
+         * by the last one, and new buckets are appended
+         */
+
+        for (c = 0; c < len; /* void */) {
+            if (slot[c] != (uint32_t) -1) {
+                c++;
+                continue;
+            }
+
+            slot[c] = slot[--len];
+        }
+
+        for (i = 0; i < peers->number; i++) {
+            while (have[i] < weight[i]) {
+                slot[len++] = (uint32_t) i;
+                have[i]++;
+            }
+        }
+
+        ngx_memcpy(table->slot, slot, sizeof(uint32_t) * n);
+
+        ngx_free(slot);
+
+        return table;
+    }
+
+    /*
+     * Maglev hashing: every peer walks its own permutation of a prime-sized
+     * table and claims free slots in turns, "weight" slots per turn, until
+     * the table is full; a lookup is then a single table access
+     */
+
+    offset = ngx_alloc(3 * sizeof(uint32_t) * peers->number, ngx_cycle->log);
+    if (offset == NULL) {
+        ngx_free(slot);
+        return NULL;
+    }
+
+    skip = offset + peers->number;
+    next = skip + peers->number;
+
+    filled = 0;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        offset[i] = ngx_crc32_long(peer->name.data, peer->name.len) % n;
+        skip[i] = ngx_murmur_hash2(peer->name.data, peer->name.len) % (n - 1)
+                  + 1;
+        next[i] = 0;
+
+        filled += have[i];
+    }
+
+    while (filled < n) {
+        for (i = 0; i < peers->number; i++) {
+
+            for (w = 0; w < weight[i] && have[i] < quota[i]; w++) {
+
+                do {
+                    c = (uint32_t) ((offset[i] + (uint64_t) next[i] * skip[i])
+                                    % n);
+                    next[i]++;
+                } while (slot[c] != (uint32_t) -1);
+
+                slot[c] = (uint32_t) i;
+                have[i]++;
+
+                if (++filled == n) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+
+    ngx_memcpy(table->slot, slot, sizeof(uint32_t) * n);
+
+    ngx_free(offset);
+    ngx_free(slot);
+
+    return table;
+}
+
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+
+/*
+ * the table is rebuilt in the zone by the worker which resolves servers,
+ * with the peers locked; a table built by each worker from the one it
+ * had before would depend on which of the changes the worker has seen,
+ * and workers would send the same key to different peers
+ */
+
+static void
+ngx_stream_upstream_update_table(ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_pool_t                           *pool;
+    ngx_stream_upstream_rr_peers_t       *peers;
+    ngx_stream_upstream_hash_table_t     *prev, *table;
+    ngx_stream_upstream_hash_srv_conf_t  *hcf;
+
+    peers = us->peer.data;
+
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+
+    prev = peers->table ? peers->table : hcf->table;
+
+    table = NULL;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+
+    if (pool) {
+        table = ngx_stream_upstream_create_table(peers, prev->jump, prev,
+                                                 pool);
+        if (table) {
+            table = ngx_stream_upstream_copy_table(table, peers->shpool);
+        }
+
+        ngx_destroy_pool(pool);
+    }
+
+    if (peers->table) {
+        ngx_slab_free(peers->shpool, peers->table);
+    }
+
+    /* without a table keys are balanced by round robin */
+
+    peers->table = table;
+
+    if (table == NULL) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "could not build hash table in upstream \"%V\"",
+                      &us->host);
+        return;
+    }
+
+    table->config = *peers->config;
+}
+
+
+static ngx_stream_upstream_hash_table_t *
+ngx_stream_upstream_copy_table(ngx_stream_upstream_hash_table_t *table,
+    ngx_slab_pool_t *shpool)
+{
+    u_char                            *p;
+    size_t                             size;
+    ngx_uint_t                         i;
+    ngx_stream_upstream_hash_table_t  *copy;
+
+    size = sizeof(ngx_stream_upstream_hash_table_t)
+           + sizeof(uint32_t) * (table->number ? table->number - 1 : 0);
+
+    size = ngx_align(size, sizeof(ngx_str_t));
+
+    for (i = 0; i < table->npeers; i++) {
+        size += sizeof(ngx_str_t) + table->names[i].len;
+    }
+
+    copy = ngx_slab_alloc(shpool, size);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    p = (u_char *) copy;
+
+    size = sizeof(ngx_stream_upstream_hash_table_t)
+           + sizeof(uint32_t) * (table->number ? table->number - 1 : 0);
+
+    ngx_memcpy(p, table, size);
+
+    copy->names = (ngx_str_t *) (p + ngx_align(size, sizeof(ngx_str_t)));
+
+    p = (u_char *) (copy->names + table->npeers);
+
+    for (i = 0; i < table->npeers; i++) {
+        copy->names[i].len = table->names[i].len;
+        copy->names[i].data = p;
+
+        p = ngx_cpymem(p, table->names[i].data, table->names[i].len);
+    }
+
+    return copy;
+}
+
+#endif
+
+
+/*
+ * maps positions of peers in the previous table to positions of peers
+ * with the same names, or to -1; peers are matched by name rather than
+ * by pointer as peers of the previous table may be gone
+ */
+
+static ngx_uint_t *
+ngx_stream_upstream_map_table(ngx_stream_upstream_hash_table_t *prev,
+    ngx_str_t *names, ngx_uint_t number)
+{
+    u_char      *used;
+    ngx_uint_t   i, j, *map;
+
+    map = ngx_alloc(sizeof(ngx_uint_t) * (prev->npeers + 1) + number + 1,
+                    ngx_cycle->log);
+    if (map == NULL) {
+        return NULL;
+    }
+
+    used = (u_char *) (map + prev->npeers + 1);
+
+    ngx_memzero(used, number);
+
+    for (i = 0; i < prev->npeers; i++) {
+        map[i] = (ngx_uint_t) -1;
+
+        for (j = 0; j < number; j++) {
+            if (!used[j]
+                && names[j].len == prev->names[i].len
+                && ngx_strncmp(names[j].data, prev->names[i].data,
+                               names[j].len) == 0)
+            {
+                map[i] = j;
+                used[j] = 1;
+                break;
+            }
+        }
+    }
+
+    return map;
+}
+
+
+static ngx_uint_t
+ngx_stream_upstream_maglev_prime(ngx_uint_t n)
+{
+    ngx_uint_t  i;
+
+    for (n |= 1; /* void */ ; n += 2) {
+        for (i = 3; i * i <= n; i += 2) {
+            if (n % i == 0) {
+                break;
+            }
+        }
+
+        if (i * i > n) {
+            return n;
+        }
+    }
+}
+
+
+static ngx_uint_t
+ngx_stream_upstream_jump_hash(uint64_t key, ngx_uint_t n)
+{
+    int64_t  b, j;
+
+    /* J. Lamping, E. Veach, "A Fast, Minimal Memory, Consistent Hash" */
+
+    b = -1;
+    j = 0;
+
+    while (j < (int64_t) n) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t) ((b + 1) * ((double) (1LL << 31)
+                                  / (double) ((key >> 33) + 1)));
+    }
+
+    return (ngx_uint_t) b;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_table_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                             i;
+    ngx_pool_t                            *pool;
+    ngx_stream_upstream_rr_peer_t         *peer, **index;
+    ngx_stream_upstream_rr_peers_t        *peers;
+    ngx_stream_upstream_hash_srv_conf_t   *hcf;
+    ngx_stream_upstream_hash_peer_data_t  *hp;
+
+    if (ngx_stream_upstream_init_hash_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.get = ngx_stream_upstream_get_table_peer;
+
+    hp = s->upstream->peer.data;
+
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+
+    /*
+     * the table refers to peers by their position; the zone module
+     * replaces peers after configuration is read, so the positions
+     * are resolved to peers on first use in each process, and again
+     * each time servers are resolved to other addresses and the table
+     * is rebuilt in the zone
+     */
+
+    peers = us->peer.data;
+
+    if (hcf->peers == peers && hcf->config == hp->rrp.config) {
+        return NGX_OK;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_stream_upstream_rr_peers_rlock_config(peers);
+
+    if (ngx_stream_upstream_rr_peers_changed(peers, &hp->rrp)) {
+        ngx_stream_upstream_rr_peers_unlock_config(peers);
+        ngx_destroy_pool(pool);
+
+        /* the session will fail over to the next upstream, if any */
+
+        return NGX_OK;
+    }
+
+    index = ngx_palloc(pool, sizeof(ngx_stream_upstream_rr_peer_t *)
+                             * (peers->number ? peers->number : 1));
+    if (index == NULL) {
+        ngx_stream_upstream_rr_peers_unlock_config(peers);
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        index[i] = peer;
+    }
+
+    ngx_stream_upstream_rr_peers_unlock_config(peers);
+
+    if (hcf->pool) {
+        ngx_destroy_pool(hcf->pool);
+    }
+
+    hcf->pool = pool;
+    hcf->index = index;
+    hcf->peers = peers;
+    hcf->config = hp->rrp.config;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_get_table_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_upstream_hash_peer_data_t *hp = data;
+
+    time_t                             now;
+    u_char                             buf[NGX_INT_T_LEN];
+    size_t                             size;
+    uint32_t                           hash;
+    uintptr_t                          m;
+    ngx_uint_t                         n, p;
+    ngx_stream_upstream_rr_peer_t     *peer;
+    ngx_stream_upstream_hash_table_t  *table;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get table hash peer, try: %ui", pc->tries);
+
+    if (hp->tries > 20 || hp->rrp.peers->single) {
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    ngx_stream_upstream_rr_peers_rlock_config(hp->rrp.peers);
+
+    table = hp->conf->table;
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    if (hp->rrp.peers->table) {
+        table = hp->rrp.peers->table;
+    }
+#endif
+
+    if (table->number == 0
+        || table->config != hp->rrp.config
+        || ngx_stream_upstream_rr_peers_changed(hp->rrp.peers, &hp->rrp))
+    {
+        ngx_stream_upstream_rr_peers_unlock_config(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    now = ngx_time();
+
+    pc->connection = NULL;
+
+    for ( ;; ) {
+
+        /*
+         * unusable peers are skipped by rehashing the key, so only
+         * the keys of such peers move, and always to the same peers
+         */
+
+        ngx_crc32_init(hash);
+
+        if (hp->rehash > 0) {
+            size = ngx_sprintf(buf, "%ui", hp->rehash) - buf;
+            ngx_crc32_update(&hash, buf, size);
+        }
+
+        ngx_crc32_update(&hash, hp->key.data, hp->key.len);
+        ngx_crc32_final(hash);
+
+        hp->rehash++;
+
+        if (table->jump) {
+            p = table->slot[ngx_stream_upstream_jump_hash(hash,
+                                                          table->number)];
+
+        } else {
+            p = table->slot[hash % table->number];
+        }
+
+        peer = hp->conf->index[p];
+
+        n = p / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+        if (hp->rrp.tried[n] & m) {
+            goto next;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "get table hash peer, value:%uD, peer:%ui", hash, p);
+
+        if (peer->down || peer->unhealthy) {
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            goto next;
+        }
+
+        if (ngx_stream_upstream_rr_peer_acquire(peer) != NGX_OK) {
+            goto next;
+        }
+
+        break;
+
+    next:
+
+        if (++hp->tries > 20) {
+            ngx_stream_upstream_rr_peers_unlock_config(hp->rrp.peers);
+            return hp->get_rr_peer(pc, &hp->rrp);
+        }
+    }
+
+    hp->rrp.current = peer;
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    ngx_stream_upstream_rr_peers_unlock_config(hp->rrp.peers);
 
     hp->rrp.tried[n] |= m;
 
@@ -619,6 +1490,11 @@ ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->table = NULL;
+    conf->peers = NULL;
+    conf->index = NULL;
+    conf->config = 0;
+    conf->pool = NULL;
 
     return conf;
 }
@@ -665,6 +1541,12 @@ ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
         uscf->peer.init_upstream = ngx_stream_upstream_init_chash;
 
+    } else if (ngx_strcmp(value[2].data, "maglev") == 0) {
+        uscf->peer.init_upstream = ngx_stream_upstream_init_maglev;
+
+    } else if (ngx_strcmp(value[2].data, "jump") == 0) {
+        uscf->peer.init_upstream = ngx_stream_upstream_init_jump;
+
     } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[2]);
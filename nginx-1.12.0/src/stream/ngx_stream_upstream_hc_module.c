@@ -0,0 +1,756 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+typedef struct {
+    ngx_flag_t                         health_check;
+    ngx_msec_t                         interval;
+    ngx_uint_t                         fails;
+    ngx_uint_t                         passes;
+    ngx_str_t                          send;
+    ngx_str_t                          expect;
+} ngx_stream_upstream_hc_srv_conf_t;
+
+
+typedef struct ngx_stream_upstream_hc_peer_s  ngx_stream_upstream_hc_peer_t;
+
+
+typedef struct {
+    ngx_stream_upstream_hc_srv_conf_t  *conf;
+    ngx_stream_upstream_srv_conf_t     *upstream;
+
+    ngx_stream_upstream_hc_peer_t      *peers;
+    ngx_uint_t                          npeers;
+    ngx_uint_t                          config;
+    ngx_pool_t                         *pool;
+
+    ngx_event_t                         event;
+} ngx_stream_upstream_hc_t;
+
+
+struct ngx_stream_upstream_hc_peer_s {
+    ngx_stream_upstream_hc_t           *hc;
+
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_rr_peer_t      *peer;
+
+    /* a copy, as a peer may be freed once it is no longer resolved to */
+    ngx_str_t                           name;
+
+    ngx_peer_connection_t               pc;
+    ngx_log_t                           log;
+
+    ngx_buf_t                          *buffer;
+    size_t                              sent;
+
+    ngx_uint_t                          fails;
+    ngx_uint_t                          passes;
+};
+
+
+static ngx_int_t ngx_stream_upstream_hc_init_peers(
+    ngx_stream_upstream_hc_t *hc, ngx_log_t *log);
+static void ngx_stream_upstream_hc_handler(ngx_event_t *ev);
+static void ngx_stream_upstream_hc_connect(ngx_stream_upstream_hc_peer_t *hp);
+static void ngx_stream_upstream_hc_write_handler(ngx_event_t *wev);
+static void ngx_stream_upstream_hc_read_handler(ngx_event_t *rev);
+static void ngx_stream_upstream_hc_dummy_handler(ngx_event_t *ev);
+static ngx_int_t ngx_stream_upstream_hc_test_connect(ngx_connection_t *c);
+static void ngx_stream_upstream_hc_done(ngx_stream_upstream_hc_peer_t *hp,
+    ngx_uint_t ok);
+static u_char *ngx_stream_upstream_hc_log_error(ngx_log_t *log, u_char *buf,
+    size_t len);
+
+static void *ngx_stream_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_health_check(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_stream_upstream_hc_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_stream_upstream_hc_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_stream_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_ANY,
+      ngx_stream_upstream_health_check,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_hc_module_ctx = {
+    NULL,                                    /* preconfiguration */
+    ngx_stream_upstream_hc_postconfiguration, /* postconfiguration */
+
+    NULL,                                    /* create main configuration */
+    NULL,                                    /* init main configuration */
+
+    ngx_stream_upstream_hc_create_conf,      /* create server configuration */
+    NULL                                     /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_hc_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_hc_module_ctx,      /* module context */
+    ngx_stream_upstream_hc_commands,         /* module directives */
+    NGX_STREAM_MODULE,                       /* module type */
+    NULL,                                    /* init master */
+    NULL,                                    /* init module */
+    ngx_stream_upstream_hc_init_process,     /* init process */
+    NULL,                                    /* init thread */
+    NULL,                                    /* exit thread */
+    NULL,                                    /* exit process */
+    NULL,                                    /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_stream_upstream_hc_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                       i;
+    ngx_stream_upstream_hc_t        *hc;
+    ngx_stream_upstream_hc_peer_t   *hp;
+    ngx_stream_upstream_rr_peers_t  *peers;
+
+    hc = ev->data;
+
+    if (ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "health check upstream \"%V\"", &hc->upstream->host);
+
+    peers = hc->upstream->peer.data;
+
+    if (hc->config != ngx_stream_upstream_rr_peers_config(peers)
+        && ngx_stream_upstream_hc_init_peers(hc, ev->log) != NGX_OK)
+    {
+        goto next;
+    }
+
+    for (i = 0; i < hc->npeers; i++) {
+        hp = &hc->peers[i];
+
+        if (hp->pc.connection) {
+            /* the previous check did not complete within the interval */
+
+            ngx_log_error(NGX_LOG_INFO, &hp->log, NGX_ETIMEDOUT,
+                          "health check timed out");
+
+            ngx_stream_upstream_hc_done(hp, 0);
+        }
+
+        ngx_stream_upstream_hc_connect(hp);
+    }
+
+next:
+
+    ngx_add_timer(ev, hc->conf->interval);
+}
+
+
+/*
+ * the peers to check are taken from the upstream anew each time
+ * servers are resolved to other addresses
+ */
+
+static ngx_int_t
+ngx_stream_upstream_hc_init_peers(ngx_stream_upstream_hc_t *hc,
+    ngx_log_t *log)
+{
+    ngx_uint_t                          i, n;
+    ngx_pool_t                         *pool;
+    ngx_stream_upstream_hc_peer_t      *hp;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_rr_peers_t     *peers, *primary;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    hcf = hc->conf;
+    primary = hc->upstream->peer.data;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_stream_upstream_rr_peers_rlock(primary);
+
+    n = primary->number + (primary->next ? primary->next->number : 0);
+
+    hp = ngx_pcalloc(pool, sizeof(ngx_stream_upstream_hc_peer_t) * (n ? n : 1));
+    if (hp == NULL) {
+        goto failed;
+    }
+
+    n = 0;
+
+    for (peers = primary; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next, n++) {
+            hp[n].hc = hc;
+            hp[n].peers = peers;
+            hp[n].peer = peer;
+
+            hp[n].name.data = ngx_pstrdup(pool, &peer->name);
+            if (hp[n].name.data == NULL) {
+                goto failed;
+            }
+
+            hp[n].name.len = peer->name.len;
+
+            hp[n].log = *log;
+            hp[n].log.handler = ngx_stream_upstream_hc_log_error;
+            hp[n].log.data = &hp[n];
+
+            if (hcf->expect.len) {
+                hp[n].buffer = ngx_create_temp_buf(pool, hcf->expect.len);
+                if (hp[n].buffer == NULL) {
+                    goto failed;
+                }
+            }
+        }
+    }
+
+    hc->config = ngx_stream_upstream_rr_peers_config(primary);
+
+    ngx_stream_upstream_rr_peers_unlock(primary);
+
+    /* checks still in progress are of peers which may be gone */
+
+    for (i = 0; i < hc->npeers; i++) {
+        if (hc->peers[i].pc.connection) {
+            ngx_close_connection(hc->peers[i].pc.connection);
+        }
+    }
+
+    if (hc->pool) {
+        ngx_destroy_pool(hc->pool);
+    }
+
+    hc->pool = pool;
+    hc->peers = hp;
+    hc->npeers = n;
+
+    return NGX_OK;
+
+failed:
+
+    ngx_stream_upstream_rr_peers_unlock(primary);
+
+    ngx_destroy_pool(pool);
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_stream_upstream_hc_connect(ngx_stream_upstream_hc_peer_t *hp)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    hp->pc.sockaddr = hp->peer->sockaddr;
+    hp->pc.socklen = hp->peer->socklen;
+    hp->pc.name = &hp->name;
+    hp->pc.get = ngx_event_get_peer;
+    hp->pc.log = &hp->log;
+    hp->pc.log_error = NGX_ERROR_INFO;
+    hp->pc.tries = 1;
+
+    hp->sent = 0;
+
+    if (hp->buffer) {
+        hp->buffer->pos = hp->buffer->start;
+        hp->buffer->last = hp->buffer->start;
+    }
+
+    rc = ngx_event_connect_peer(&hp->pc);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, &hp->log, 0,
+                   "health check connect: %i %V", rc, hp->pc.name);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_stream_upstream_hc_done(hp, 0);
+        return;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN */
+
+    c = hp->pc.connection;
+
+    c->data = hp;
+
+    c->write->handler = ngx_stream_upstream_hc_write_handler;
+    c->read->handler = ngx_stream_upstream_hc_read_handler;
+
+    if (rc == NGX_OK) {
+        ngx_stream_upstream_hc_write_handler(c->write);
+    }
+}
+
+
+static void
+ngx_stream_upstream_hc_write_handler(ngx_event_t *wev)
+{
+    ssize_t                             n;
+    ngx_connection_t                   *c;
+    ngx_stream_upstream_hc_peer_t      *hp;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    c = wev->data;
+    hp = c->data;
+    hcf = hp->hc->conf;
+
+    if (ngx_stream_upstream_hc_test_connect(c) != NGX_OK) {
+        ngx_stream_upstream_hc_done(hp, 0);
+        return;
+    }
+
+    while (hp->sent < hcf->send.len) {
+        n = c->send(c, hcf->send.data + hp->sent, hcf->send.len - hp->sent);
+
+        if (n == NGX_ERROR) {
+            ngx_stream_upstream_hc_done(hp, 0);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_stream_upstream_hc_done(hp, 0);
+            }
+
+            return;
+        }
+
+        hp->sent += n;
+    }
+
+    if (hcf->expect.len == 0) {
+        ngx_stream_upstream_hc_done(hp, 1);
+        return;
+    }
+
+    wev->handler = ngx_stream_upstream_hc_dummy_handler;
+
+    ngx_stream_upstream_hc_read_handler(c->read);
+}
+
+
+static void
+ngx_stream_upstream_hc_read_handler(ngx_event_t *rev)
+{
+    ssize_t                             n;
+    ngx_buf_t                          *b;
+    ngx_connection_t                   *c;
+    ngx_stream_upstream_hc_peer_t      *hp;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    c = rev->data;
+    hp = c->data;
+    hcf = hp->hc->conf;
+    b = hp->buffer;
+
+    if (b == NULL || c->write->handler != ngx_stream_upstream_hc_dummy_handler)
+    {
+        /* nothing is expected yet, the peer is not supposed to talk */
+
+        if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+            ngx_stream_upstream_hc_done(hp, 0);
+        }
+
+        return;
+    }
+
+    while (b->last < b->end) {
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_stream_upstream_hc_done(hp, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_stream_upstream_hc_done(hp, 0);
+            return;
+        }
+
+        if (ngx_memcmp(b->last, hcf->expect.data + (b->last - b->start), n)
+            != 0)
+        {
+            ngx_log_error(NGX_LOG_INFO, &hp->log, 0,
+                          "health check got unexpected response");
+
+            ngx_stream_upstream_hc_done(hp, 0);
+            return;
+        }
+
+        b->last += n;
+    }
+
+    ngx_stream_upstream_hc_done(hp, 1);
+}
+
+
+static void
+ngx_stream_upstream_hc_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "health check dummy handler");
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        err = c->write->kq_errno ? c->write->kq_errno : c->read->kq_errno;
+
+        if (err) {
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_upstream_hc_done(ngx_stream_upstream_hc_peer_t *hp, ngx_uint_t ok)
+{
+    ngx_uint_t                          unhealthy;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_rr_peers_t     *primary;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    if (hp->pc.connection) {
+        ngx_close_connection(hp->pc.connection);
+        hp->pc.connection = NULL;
+    }
+
+    peer = hp->peer;
+    hcf = hp->hc->conf;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, &hp->log, 0,
+                   "health check done: %ui %V", ok, &hp->name);
+
+    primary = hp->hc->upstream->peer.data;
+
+    if (hp->hc->config != ngx_stream_upstream_rr_peers_config(primary)) {
+        /* the peer may be gone, it is checked again after an update */
+        return;
+    }
+
+    if (ok) {
+        hp->fails = 0;
+
+        if (++hp->passes < hcf->passes || !peer->unhealthy) {
+            return;
+        }
+
+        unhealthy = 0;
+
+    } else {
+        hp->passes = 0;
+
+        if (++hp->fails < hcf->fails || peer->unhealthy) {
+            return;
+        }
+
+        unhealthy = 1;
+    }
+
+    /* the state is published to all workers through the upstream zone */
+
+    ngx_stream_upstream_rr_peers_rlock(hp->peers);
+    ngx_stream_upstream_rr_peer_lock(hp->peers, peer);
+
+    peer->unhealthy = unhealthy;
+
+    ngx_stream_upstream_rr_peer_unlock(hp->peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(hp->peers);
+
+    if (unhealthy) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "upstream server %V in upstream \"%V\" is unhealthy",
+                      &hp->name, &hp->hc->upstream->host);
+
+    } else {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "upstream server %V in upstream \"%V\" is healthy",
+                      &hp->name, &hp->hc->upstream->host);
+    }
+}
+
+
+static u_char *
+ngx_stream_upstream_hc_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    ngx_stream_upstream_hc_peer_t  *hp;
+
+    hp = log->data;
+
+    return ngx_snprintf(buf, len,
+                        " while checking upstream server %V in upstream \"%V\"",
+                        &hp->name, &hp->hc->upstream->host);
+}
+
+
+static void *
+ngx_stream_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->health_check = 0;
+     *     conf->send = { 0, NULL };
+     *     conf->expect = { 0, NULL };
+     */
+
+    conf->interval = 5000;
+    conf->fails = 1;
+    conf->passes = 1;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_health_check(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_upstream_hc_srv_conf_t  *hcf = conf;
+
+    ngx_str_t   *value, s;
+    ngx_int_t    n;
+    ngx_msec_t   interval;
+    ngx_uint_t   i;
+
+    if (hcf->health_check) {
+        return "is duplicate";
+    }
+
+    hcf->health_check = 1;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            interval = ngx_parse_time(&s, 0);
+
+            if (interval == (ngx_msec_t) NGX_ERROR || interval == 0) {
+                goto invalid;
+            }
+
+            hcf->interval = interval;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "send=", 5) == 0) {
+
+            hcf->send.len = value[i].len - 5;
+            hcf->send.data = &value[i].data[5];
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "expect=", 7) == 0) {
+
+            hcf->expect.len = value[i].len - 7;
+            hcf->expect.data = &value[i].data[7];
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                          i;
+    ngx_stream_upstream_srv_conf_t     *uscf, **uscfp;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+    ngx_stream_upstream_main_conf_t    *umcf;
+
+    umcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_stream_conf_upstream_srv_conf(uscf,
+                                                ngx_stream_upstream_hc_module);
+
+        if (hcf->health_check && uscf->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires \"zone\" in upstream \"%V\" "
+                          "in %s:%ui", &uscf->host, uscf->file_name,
+                          uscf->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * peers are checked by the first worker only, the results are
+ * published in the upstream zone and thus seen by all workers
+ */
+
+static ngx_int_t
+ngx_stream_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                          i;
+    ngx_stream_upstream_hc_t           *hc;
+    ngx_stream_upstream_srv_conf_t     *uscf, **uscfp;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+    ngx_stream_upstream_main_conf_t    *umcf;
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_upstream_module);
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_stream_conf_upstream_srv_conf(uscf,
+                                                ngx_stream_upstream_hc_module);
+
+        if (!hcf->health_check) {
+            continue;
+        }
+
+        hc = ngx_pcalloc(cycle->pool, sizeof(ngx_stream_upstream_hc_t));
+        if (hc == NULL) {
+            return NGX_ERROR;
+        }
+
+        hc->conf = hcf;
+        hc->upstream = uscf;
+
+        if (ngx_stream_upstream_hc_init_peers(hc, cycle->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        hc->event.handler = ngx_stream_upstream_hc_handler;
+        hc->event.data = hc;
+        hc->event.log = cycle->log;
+        hc->event.cancelable = 1;
+
+        ngx_add_timer(&hc->event, 0);
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,641 @@
+
+/*
+ * Copyright (C) Maxim Dounin
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+typedef struct {
+    ngx_uint_t                         max_cached;
+    ngx_msec_t                         timeout;
+
+    ngx_queue_t                        cache;
+    ngx_queue_t                        free;
+
+    ngx_stream_upstream_init_pt        original_init_upstream;
+    ngx_stream_upstream_init_peer_pt   original_init_peer;
+
+} ngx_stream_upstream_keepalive_srv_conf_t;
+
+
+typedef struct {
+    ngx_stream_upstream_keepalive_srv_conf_t  *conf;
+
+    ngx_queue_t                        queue;
+    ngx_connection_t                  *connection;
+
+    void                             **srv_conf;
+
+    socklen_t                          socklen;
+    ngx_sockaddr_t                     sockaddr;
+
+} ngx_stream_upstream_keepalive_cache_t;
+
+
+typedef struct {
+    ngx_stream_upstream_keepalive_srv_conf_t  *conf;
+
+    ngx_stream_session_t              *session;
+
+    void                              *data;
+
+    ngx_event_get_peer_pt              original_get_peer;
+    ngx_event_free_peer_pt             original_free_peer;
+    ngx_event_notify_peer_pt           original_notify;
+
+#if (NGX_STREAM_SSL)
+    ngx_event_set_peer_session_pt      original_set_session;
+    ngx_event_save_peer_session_pt     original_save_session;
+#endif
+
+} ngx_stream_upstream_keepalive_peer_data_t;
+
+
+static ngx_int_t ngx_stream_upstream_init_keepalive_peer(
+    ngx_stream_session_t *s, ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_get_keepalive_peer(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_stream_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static void ngx_stream_upstream_notify_keepalive_peer(
+    ngx_peer_connection_t *pc, void *data, ngx_uint_t type);
+
+static ngx_int_t ngx_stream_upstream_keepalive_test(ngx_connection_t *c);
+static void ngx_stream_upstream_keepalive_dummy_handler(ngx_event_t *ev);
+static void ngx_stream_upstream_keepalive_close_handler(ngx_event_t *ev);
+static void ngx_stream_upstream_keepalive_close(ngx_connection_t *c);
+
+#if (NGX_STREAM_SSL)
+static ngx_int_t ngx_stream_upstream_keepalive_set_session(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_stream_upstream_keepalive_save_session(
+    ngx_peer_connection_t *pc, void *data);
+#endif
+
+static void *ngx_stream_upstream_keepalive_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_stream_upstream_keepalive_commands[] = {
+
+    { ngx_string("keepalive"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_stream_upstream_keepalive,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("keepalive_timeout"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_upstream_keepalive_srv_conf_t, timeout),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_keepalive_module_ctx = {
+    NULL,                                    /* preconfiguration */
+    NULL,                                    /* postconfiguration */
+
+    NULL,                                    /* create main configuration */
+    NULL,                                    /* init main configuration */
+
+    ngx_stream_upstream_keepalive_create_conf, /* create server configuration */
+    NULL                                     /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_keepalive_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_keepalive_module_ctx, /* module context */
+    ngx_stream_upstream_keepalive_commands,  /* module directives */
+    NGX_STREAM_MODULE,                       /* module type */
+    NULL,                                    /* init master */
+    NULL,                                    /* init module */
+    NULL,                                    /* init process */
+    NULL,                                    /* init thread */
+    NULL,                                    /* exit thread */
+    NULL,                                    /* exit process */
+    NULL,                                    /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_upstream_init_keepalive(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                                 i;
+    ngx_stream_upstream_keepalive_srv_conf_t  *kcf;
+    ngx_stream_upstream_keepalive_cache_t     *cached;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, cf->log, 0,
+                   "init keepalive");
+
+    kcf = ngx_stream_conf_upstream_srv_conf(us,
+                                        ngx_stream_upstream_keepalive_module);
+
+    ngx_conf_init_msec_value(kcf->timeout, 60000);
+
+    if (kcf->original_init_upstream(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    kcf->original_init_peer = us->peer.init;
+
+    us->peer.init = ngx_stream_upstream_init_keepalive_peer;
+
+    /* allocate cache items and add to free queue */
+
+    cached = ngx_pcalloc(cf->pool,
+               sizeof(ngx_stream_upstream_keepalive_cache_t) * kcf->max_cached);
+    if (cached == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_queue_init(&kcf->cache);
+    ngx_queue_init(&kcf->free);
+
+    for (i = 0; i < kcf->max_cached; i++) {
+        ngx_queue_insert_head(&kcf->free, &cached[i].queue);
+        cached[i].conf = kcf;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_keepalive_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_keepalive_peer_data_t  *kp;
+    ngx_stream_upstream_keepalive_srv_conf_t   *kcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "init keepalive peer");
+
+    kcf = ngx_stream_conf_upstream_srv_conf(us,
+                                        ngx_stream_upstream_keepalive_module);
+
+    kp = ngx_palloc(s->connection->pool,
+                    sizeof(ngx_stream_upstream_keepalive_peer_data_t));
+    if (kp == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (kcf->original_init_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    kp->conf = kcf;
+    kp->session = s;
+    kp->data = s->upstream->peer.data;
+    kp->original_get_peer = s->upstream->peer.get;
+    kp->original_free_peer = s->upstream->peer.free;
+    kp->original_notify = s->upstream->peer.notify;
+
+    s->upstream->peer.data = kp;
+    s->upstream->peer.get = ngx_stream_upstream_get_keepalive_peer;
+    s->upstream->peer.free = ngx_stream_upstream_free_keepalive_peer;
+
+    if (kp->original_notify) {
+        s->upstream->peer.notify = ngx_stream_upstream_notify_keepalive_peer;
+    }
+
+#if (NGX_STREAM_SSL)
+    kp->original_set_session = s->upstream->peer.set_session;
+    kp->original_save_session = s->upstream->peer.save_session;
+    s->upstream->peer.set_session = ngx_stream_upstream_keepalive_set_session;
+    s->upstream->peer.save_session =
+                                   ngx_stream_upstream_keepalive_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_upstream_keepalive_peer_data_t  *kp = data;
+    ngx_stream_upstream_keepalive_cache_t      *item;
+
+    ngx_int_t          rc;
+    ngx_queue_t       *q, *next, *cache;
+    ngx_connection_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get keepalive peer");
+
+    /* ask balancer */
+
+    rc = kp->original_get_peer(pc, kp->data);
+
+    if (rc != NGX_OK || pc->type != SOCK_STREAM) {
+        return rc;
+    }
+
+    /* search cache for suitable connection */
+
+    cache = &kp->conf->cache;
+
+    for (q = ngx_queue_head(cache);
+         q != ngx_queue_sentinel(cache);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        item = ngx_queue_data(q, ngx_stream_upstream_keepalive_cache_t, queue);
+        c = item->connection;
+
+        /*
+         * connections are only reused by the same server, as proxy_ssl
+         * and other settings of the connection may differ between servers
+         */
+
+        if (item->srv_conf != kp->session->srv_conf
+            || ngx_memn2cmp((u_char *) &item->sockaddr,
+                            (u_char *) pc->sockaddr,
+                            item->socklen, pc->socklen)
+               != 0)
+        {
+            continue;
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&kp->conf->free, q);
+
+        if (ngx_stream_upstream_keepalive_test(c) == NGX_OK) {
+            goto found;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "get keepalive peer: stale connection %p", c);
+
+        ngx_stream_upstream_keepalive_close(c);
+    }
+
+    return NGX_OK;
+
+found:
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get keepalive peer: using connection %p", c);
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    c->idle = 0;
+    c->sent = 0;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+
+    if (c->pool) {
+        c->pool->log = pc->log;
+    }
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_stream_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_stream_upstream_keepalive_peer_data_t  *kp = data;
+    ngx_stream_upstream_keepalive_cache_t      *item;
+
+    ngx_queue_t            *q;
+    ngx_connection_t       *c;
+    ngx_stream_session_t   *s;
+    ngx_stream_upstream_t  *u;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "free keepalive peer");
+
+    /* cache valid connections */
+
+    s = kp->session;
+    u = s->upstream;
+    c = pc->connection;
+
+    if (state & NGX_PEER_FAILED
+        || c == NULL
+        || c->read->eof
+        || c->read->error
+        || c->read->timedout
+        || c->write->error
+        || c->write->timedout)
+    {
+        goto invalid;
+    }
+
+    /*
+     * a client closing its side does not mean the upstream has nothing
+     * more to send; a connection is only cached at the end of an exchange,
+     * as seen by the proxy with "proxy_keepalive_framing" or marked with
+     * u->keepalive by another module aware of the protocol
+     */
+
+    if (!u->keepalive) {
+        goto invalid;
+    }
+
+    if (ngx_terminate || ngx_exiting) {
+        goto invalid;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        goto invalid;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "free keepalive peer: saving connection %p", c);
+
+    if (ngx_queue_empty(&kp->conf->free)) {
+
+        q = ngx_queue_last(&kp->conf->cache);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_stream_upstream_keepalive_cache_t, queue);
+
+        ngx_stream_upstream_keepalive_close(item->connection);
+
+    } else {
+        q = ngx_queue_head(&kp->conf->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_stream_upstream_keepalive_cache_t, queue);
+    }
+
+    ngx_queue_insert_head(&kp->conf->cache, q);
+
+    item->connection = c;
+
+    pc->connection = NULL;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->read->delayed = 0;
+
+    ngx_add_timer(c->read, kp->conf->timeout);
+
+    c->write->handler = ngx_stream_upstream_keepalive_dummy_handler;
+    c->read->handler = ngx_stream_upstream_keepalive_close_handler;
+
+    /*
+     * plain connections use the session pool which goes away
+     * with the session; SSL connections have a pool of their own
+     */
+
+    if (c->pool == s->connection->pool) {
+        c->pool = NULL;
+    }
+
+    c->data = item;
+    c->idle = 1;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+
+    if (c->pool) {
+        c->pool->log = ngx_cycle->log;
+    }
+
+    item->srv_conf = s->srv_conf;
+    item->socklen = pc->socklen;
+    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+
+    /* data or EOF after the last exchange mean it was not a boundary */
+
+    ngx_stream_upstream_keepalive_close_handler(c->read);
+
+invalid:
+
+    kp->original_free_peer(pc, kp->data, state);
+}
+
+
+static void
+ngx_stream_upstream_notify_keepalive_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t type)
+{
+    ngx_stream_upstream_keepalive_peer_data_t  *kp = data;
+
+    kp->original_notify(pc, kp->data, type);
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_keepalive_test(ngx_connection_t *c)
+{
+    int        n, err;
+    char       buf[1];
+    socklen_t  len;
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        return NGX_ERROR;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        return NGX_OK;
+    }
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_stream_upstream_keepalive_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "keepalive dummy handler");
+}
+
+
+static void
+ngx_stream_upstream_keepalive_close_handler(ngx_event_t *ev)
+{
+    ngx_stream_upstream_keepalive_srv_conf_t  *conf;
+    ngx_stream_upstream_keepalive_cache_t     *item;
+
+    int                n;
+    char               buf[1];
+    ngx_connection_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "keepalive close handler");
+
+    c = ev->data;
+
+    if (c->close || c->read->timedout) {
+        goto close;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    item = c->data;
+    conf = item->conf;
+
+    ngx_stream_upstream_keepalive_close(c);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&conf->free, &item->queue);
+}
+
+
+static void
+ngx_stream_upstream_keepalive_close(ngx_connection_t *c)
+{
+
+#if (NGX_STREAM_SSL)
+
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+
+        if (ngx_ssl_shutdown(c) == NGX_AGAIN) {
+            c->ssl->handler = ngx_stream_upstream_keepalive_close;
+            return;
+        }
+    }
+
+#endif
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+    }
+
+    ngx_close_connection(c);
+}
+
+
+#if (NGX_STREAM_SSL)
+
+static ngx_int_t
+ngx_stream_upstream_keepalive_set_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_stream_upstream_keepalive_peer_data_t  *kp = data;
+
+    return kp->original_set_session(pc, kp->data);
+}
+
+
+static void
+ngx_stream_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_stream_upstream_keepalive_peer_data_t  *kp = data;
+
+    kp->original_save_session(pc, kp->data);
+    return;
+}
+
+#endif
+
+
+static void *
+ngx_stream_upstream_keepalive_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_keepalive_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_stream_upstream_keepalive_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->original_init_upstream = NULL;
+     *     conf->original_init_peer = NULL;
+     *     conf->max_cached = 0;
+     */
+
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_upstream_srv_conf_t            *uscf;
+    ngx_stream_upstream_keepalive_srv_conf_t  *kcf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value;
+
+    if (kcf->max_cached) {
+        return "is duplicate";
+    }
+
+    /* read options */
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    kcf->max_cached = n;
+
+    uscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_upstream_module);
+
+    kcf->original_init_upstream = uscf->peer.init_upstream
+                                  ? uscf->peer.init_upstream
+                                  : ngx_stream_upstream_init_round_robin;
+
+    uscf->peer.init_upstream = ngx_stream_upstream_init_keepalive;
+
+    return NGX_CONF_OK;
+}
@@ -98,12 +98,13 @@ ngx_stream_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
 {
     ngx_stream_upstream_rr_peer_data_t *rrp = data;
 
-    time_t                           now;
-    uintptr_t                        m;
-    ngx_int_t                        rc, total;
-    ngx_uint_t                       i, n, p, many;
-    ngx_stream_upstream_rr_peer_t   *peer, *best;
-    ngx_stream_upstream_rr_peers_t  *peers;
+    time_t                            now;
+    uintptr_t                         m;
+    ngx_int_t                         rc, total;
+    ngx_uint_t                        i, n, p, many;
+    ngx_stream_upstream_rr_peer_t    *peer, *best;
+    ngx_stream_upstream_rr_peers_t   *peers;
+    ngx_stream_upstream_rr_weight_t  *weight;
 
     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
                    "get least conn peer, try: %ui", pc->tries);
@@ -118,7 +119,18 @@ ngx_stream_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
 
     peers = rrp->peers;
 
-    ngx_stream_upstream_rr_peers_wlock(peers);
+    ngx_stream_upstream_rr_peers_rlock_config(peers);
+
+    if (ngx_stream_upstream_rr_peers_changed(peers, rrp)) {
+        goto failed;
+    }
+
+    weight = ngx_stream_upstream_rr_peers_weights(rrp);
+    if (weight == NULL) {
+        goto failed;
+    }
+
+again:
 
     best = NULL;
     total = 0;
@@ -139,7 +151,7 @@ ngx_stream_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
             continue;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             continue;
         }
 
@@ -194,7 +206,7 @@ ngx_stream_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
-            if (peer->down) {
+            if (peer->down || peer->unhealthy) {
                 continue;
             }
 
@@ -213,21 +225,32 @@ ngx_stream_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
-            peer->current_weight += peer->effective_weight;
-            total += peer->effective_weight;
+            weight[i].current_weight += weight[i].effective_weight;
+            total += weight[i].effective_weight;
 
-            if (peer->effective_weight < peer->weight) {
-                peer->effective_weight++;
+            if (weight[i].effective_weight < peer->weight) {
+                weight[i].effective_weight++;
             }
 
-            if (peer->current_weight > best->current_weight) {
+            if (weight[i].current_weight > weight[p].current_weight) {
                 best = peer;
                 p = i;
             }
         }
+
+        weight[p].current_weight -= total;
     }
 
-    best->current_weight -= total;
+    n = p / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+    rrp->tried[n] |= m;
+
+    /* other processes may have taken the peer meanwhile */
+
+    if (ngx_stream_upstream_rr_peer_acquire(best) != NGX_OK) {
+        goto again;
+    }
 
     if (now - best->checked > best->fail_timeout) {
         best->checked = now;
@@ -237,16 +260,10 @@ ngx_stream_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
     pc->socklen = best->socklen;
     pc->name = &best->name;
 
-    best->conns++;
-
     rrp->current = best;
+    rrp->weight = &weight[p];
 
-    n = p / (8 * sizeof(uintptr_t));
-    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
-
-    rrp->tried[n] |= m;
-
-    ngx_stream_upstream_rr_peers_unlock(peers);
+    ngx_stream_upstream_rr_peers_unlock_config(peers);
 
     return NGX_OK;
 
@@ -265,7 +282,7 @@ failed:
             rrp->tried[i] = 0;
         }
 
-        ngx_stream_upstream_rr_peers_unlock(peers);
+        ngx_stream_upstream_rr_peers_unlock_config(peers);
 
         rc = ngx_stream_upstream_get_least_conn_peer(pc, rrp);
 
@@ -273,10 +290,10 @@ failed:
             return rc;
         }
 
-        ngx_stream_upstream_rr_peers_wlock(peers);
+        ngx_stream_upstream_rr_peers_rlock_config(peers);
     }
 
-    ngx_stream_upstream_rr_peers_unlock(peers);
+    ngx_stream_upstream_rr_peers_unlock_config(peers);
 
     pc->name = peers->name;
 
@@ -38,7 +38,7 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
     ngx_stream_upstream_srv_conf_t *us)
 {
     ngx_url_t                        u;
-    ngx_uint_t                       i, j, n, w;
+    ngx_uint_t                       i, j, n, w, r;
     ngx_stream_upstream_server_t    *server;
     ngx_stream_upstream_rr_peer_t   *peer, **peerp;
     ngx_stream_upstream_rr_peers_t  *peers, *backup;
@@ -50,6 +50,7 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
 
         n = 0;
         w = 0;
+        r = 0;
 
         for (i = 0; i < us->servers->nelts; i++) {
             if (server[i].backup) {
@@ -58,9 +59,23 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
 
             n += server[i].naddrs;
             w += server[i].naddrs * server[i].weight;
+
+            if (server[i].resolve) {
+                r++;
+            }
         }
 
-        if (n == 0) {
+#if (NGX_STREAM_UPSTREAM_ZONE)
+        if (r && us->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "resolving names at run time requires "
+                          "upstream \"%V\" in %s:%ui to be in shared memory",
+                          &us->host, us->file_name, us->line);
+            return NGX_ERROR;
+        }
+#endif
+
+        if (n == 0 && r == 0) {
             ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
                           "no servers in upstream \"%V\" in %s:%ui",
                           &us->host, us->file_name, us->line);
@@ -77,7 +92,13 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
             return NGX_ERROR;
         }
 
-        peers->single = (n == 1);
+        peers->weights = ngx_pcalloc(cf->pool,
+                                     sizeof(ngx_stream_upstream_rr_weights_t));
+        if (peers->weights == NULL) {
+            return NGX_ERROR;
+        }
+
+        peers->single = (n == 1 && r == 0);
         peers->number = n;
         peers->weighted = (w != n);
         peers->total_weight = w;
@@ -96,8 +117,6 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].socklen = server[i].addrs[j].socklen;
                 peer[n].name = server[i].addrs[j].name;
                 peer[n].weight = server[i].weight;
-                peer[n].effective_weight = server[i].weight;
-                peer[n].current_weight = 0;
                 peer[n].max_conns = server[i].max_conns;
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
@@ -140,6 +159,12 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
             return NGX_ERROR;
         }
 
+        backup->weights = ngx_pcalloc(cf->pool,
+                                      sizeof(ngx_stream_upstream_rr_weights_t));
+        if (backup->weights == NULL) {
+            return NGX_ERROR;
+        }
+
         peers->single = 0;
         backup->single = 0;
         backup->number = n;
@@ -160,8 +185,6 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].socklen = server[i].addrs[j].socklen;
                 peer[n].name = server[i].addrs[j].name;
                 peer[n].weight = server[i].weight;
-                peer[n].effective_weight = server[i].weight;
-                peer[n].current_weight = 0;
                 peer[n].max_conns = server[i].max_conns;
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
@@ -216,6 +239,12 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
         return NGX_ERROR;
     }
 
+    peers->weights = ngx_pcalloc(cf->pool,
+                                 sizeof(ngx_stream_upstream_rr_weights_t));
+    if (peers->weights == NULL) {
+        return NGX_ERROR;
+    }
+
     peers->single = (n == 1);
     peers->number = n;
     peers->weighted = 0;
@@ -229,8 +258,6 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
         peer[i].socklen = u.addrs[i].socklen;
         peer[i].name = u.addrs[i].name;
         peer[i].weight = 1;
-        peer[i].effective_weight = 1;
-        peer[i].current_weight = 0;
         peer[i].max_conns = 0;
         peer[i].max_fails = 1;
         peer[i].fail_timeout = 10;
@@ -267,7 +294,11 @@ ngx_stream_upstream_init_round_robin_peer(ngx_stream_session_t *s,
 
     rrp->peers = us->peer.data;
     rrp->current = NULL;
-    rrp->config = 0;
+    rrp->weight = NULL;
+
+    ngx_stream_upstream_rr_peers_rlock_config(rrp->peers);
+
+    rrp->config = ngx_stream_upstream_rr_peers_config(rrp->peers);
 
     n = rrp->peers->number;
 
@@ -275,6 +306,10 @@ ngx_stream_upstream_init_round_robin_peer(ngx_stream_session_t *s,
         n = rrp->peers->next->number;
     }
 
+    s->upstream->peer.tries = ngx_stream_upstream_tries(rrp->peers);
+
+    ngx_stream_upstream_rr_peers_unlock_config(rrp->peers);
+
     if (n <= 8 * sizeof(uintptr_t)) {
         rrp->tried = &rrp->data;
         rrp->data = 0;
@@ -291,7 +326,6 @@ ngx_stream_upstream_init_round_robin_peer(ngx_stream_session_t *s,
     s->upstream->peer.get = ngx_stream_upstream_get_round_robin_peer;
     s->upstream->peer.free = ngx_stream_upstream_free_round_robin_peer;
     s->upstream->peer.notify = ngx_stream_upstream_notify_round_robin_peer;
-    s->upstream->peer.tries = ngx_stream_upstream_tries(rrp->peers);
 #if (NGX_STREAM_SSL)
     s->upstream->peer.set_session =
                              ngx_stream_upstream_set_round_robin_peer_session;
@@ -314,6 +348,7 @@ ngx_stream_upstream_create_round_robin_peer(ngx_stream_session_t *s,
     struct sockaddr                     *sockaddr;
     ngx_stream_upstream_rr_peer_t       *peer, **peerp;
     ngx_stream_upstream_rr_peers_t      *peers;
+    ngx_stream_upstream_rr_weight_t     *weight;
     ngx_stream_upstream_rr_peer_data_t  *rrp;
 
     rrp = s->upstream->peer.data;
@@ -340,6 +375,25 @@ ngx_stream_upstream_create_round_robin_peer(ngx_stream_session_t *s,
         return NGX_ERROR;
     }
 
+    peers->weights = ngx_pcalloc(s->connection->pool,
+                                 sizeof(ngx_stream_upstream_rr_weights_t));
+    if (peers->weights == NULL) {
+        return NGX_ERROR;
+    }
+
+    weight = ngx_palloc(s->connection->pool,
+                        sizeof(ngx_stream_upstream_rr_weight_t) * ur->naddrs);
+    if (weight == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < ur->naddrs; i++) {
+        weight[i].current_weight = 0;
+        weight[i].effective_weight = 1;
+    }
+
+    peers->weights->weight = weight;
+
     peers->single = (ur->naddrs == 1);
     peers->number = ur->naddrs;
     peers->name = &ur->host;
@@ -349,8 +403,6 @@ ngx_stream_upstream_create_round_robin_peer(ngx_stream_session_t *s,
         peer[0].socklen = ur->socklen;
         peer[0].name = ur->name;
         peer[0].weight = 1;
-        peer[0].effective_weight = 1;
-        peer[0].current_weight = 0;
         peer[0].max_conns = 0;
         peer[0].max_fails = 1;
         peer[0].fail_timeout = 10;
@@ -383,8 +435,6 @@ ngx_stream_upstream_create_round_robin_peer(ngx_stream_session_t *s,
             peer[i].name.len = len;
             peer[i].name.data = p;
             peer[i].weight = 1;
-            peer[i].effective_weight = 1;
-            peer[i].current_weight = 0;
             peer[i].max_conns = 0;
             peer[i].max_fails = 1;
             peer[i].fail_timeout = 10;
@@ -395,6 +445,7 @@ ngx_stream_upstream_create_round_robin_peer(ngx_stream_session_t *s,
 
     rrp->peers = peers;
     rrp->current = NULL;
+    rrp->weight = NULL;
     rrp->config = 0;
 
     if (rrp->peers->number <= 8 * sizeof(uintptr_t)) {
@@ -439,44 +490,60 @@ ngx_stream_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     pc->connection = NULL;
 
     peers = rrp->peers;
-    ngx_stream_upstream_rr_peers_wlock(peers);
 
     if (peers->single) {
-        peer = peers->peer;
 
-        if (peer->down) {
-            goto failed;
-        }
+        /* a single peer has no selection state, so no lock is needed */
 
-        if (peer->max_conns && peer->conns >= peer->max_conns) {
-            goto failed;
+        peer = peers->peer;
+
+        if (peer->down
+            || peer->unhealthy
+            || ngx_stream_upstream_rr_peer_acquire(peer) != NGX_OK)
+        {
+            pc->name = peers->name;
+            return NGX_BUSY;
         }
 
         rrp->current = peer;
 
-    } else {
+        goto found;
+    }
 
-        /* there are several peers */
+    /* there are several peers */
 
+    ngx_stream_upstream_rr_peers_rlock_config(peers);
+
+    if (ngx_stream_upstream_rr_peers_changed(peers, rrp)) {
+        goto failed;
+    }
+
+    for ( ;; ) {
         peer = ngx_stream_upstream_get_peer(rrp);
 
         if (peer == NULL) {
             goto failed;
         }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
-                       "get rr peer, current: %p %i",
-                       peer, peer->current_weight);
+        /* lock-free balancers falling back to us may have taken the peer */
+
+        if (ngx_stream_upstream_rr_peer_acquire(peer) == NGX_OK) {
+            break;
+        }
     }
 
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get rr peer, current: %p %i",
+                   peer, rrp->weight->current_weight);
+
+    ngx_stream_upstream_rr_peers_unlock_config(peers);
+
+found:
+
     pc->sockaddr = peer->sockaddr;
     pc->socklen = peer->socklen;
     pc->name = &peer->name;
 
-    peer->conns++;
-
-    ngx_stream_upstream_rr_peers_unlock(peers);
-
     return NGX_OK;
 
 failed:
@@ -494,7 +561,7 @@ failed:
             rrp->tried[i] = 0;
         }
 
-        ngx_stream_upstream_rr_peers_unlock(peers);
+        ngx_stream_upstream_rr_peers_unlock_config(peers);
 
         rc = ngx_stream_upstream_get_round_robin_peer(pc, rrp);
 
@@ -502,10 +569,10 @@ failed:
             return rc;
         }
 
-        ngx_stream_upstream_rr_peers_wlock(peers);
+        ngx_stream_upstream_rr_peers_rlock_config(peers);
     }
 
-    ngx_stream_upstream_rr_peers_unlock(peers);
+    ngx_stream_upstream_rr_peers_unlock_config(peers);
 
     pc->name = peers->name;
 
@@ -516,11 +583,17 @@ failed:
 static ngx_stream_upstream_rr_peer_t *
 ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
 {
-    time_t                          now;
-    uintptr_t                       m;
-    ngx_int_t                       total;
-    ngx_uint_t                      i, n, p;
-    ngx_stream_upstream_rr_peer_t  *peer, *best;
+    time_t                            now;
+    uintptr_t                         m;
+    ngx_int_t                         total;
+    ngx_uint_t                        i, n, p;
+    ngx_stream_upstream_rr_peer_t    *peer, *best;
+    ngx_stream_upstream_rr_weight_t  *weight;
+
+    weight = ngx_stream_upstream_rr_peers_weights(rrp);
+    if (weight == NULL) {
+        return NULL;
+    }
 
     now = ngx_time();
 
@@ -542,7 +615,7 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             continue;
         }
 
@@ -557,14 +630,16 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        peer->current_weight += peer->effective_weight;
-        total += peer->effective_weight;
+        weight[i].current_weight += weight[i].effective_weight;
+        total += weight[i].effective_weight;
 
-        if (peer->effective_weight < peer->weight) {
-            peer->effective_weight++;
+        if (weight[i].effective_weight < peer->weight) {
+            weight[i].effective_weight++;
         }
 
-        if (best == NULL || peer->current_weight > best->current_weight) {
+        if (best == NULL
+            || weight[i].current_weight > weight[p].current_weight)
+        {
             best = peer;
             p = i;
         }
@@ -575,13 +650,14 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
     }
 
     rrp->current = best;
+    rrp->weight = &weight[p];
 
     n = p / (8 * sizeof(uintptr_t));
     m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
 
     rrp->tried[n] |= m;
 
-    best->current_weight -= total;
+    weight[p].current_weight -= total;
 
     if (now - best->checked > best->fail_timeout) {
         best->checked = now;
@@ -591,28 +667,71 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
 }
 
 
+ngx_stream_upstream_rr_weight_t *
+ngx_stream_upstream_rr_peers_weights(ngx_stream_upstream_rr_peer_data_t *rrp)
+{
+    ngx_uint_t                         i;
+    ngx_stream_upstream_rr_peer_t     *peer;
+    ngx_stream_upstream_rr_peers_t    *peers;
+    ngx_stream_upstream_rr_weight_t   *weight;
+    ngx_stream_upstream_rr_weights_t  *weights;
+
+    peers = rrp->peers;
+    weights = peers->weights;
+
+    if (weights->weight && weights->config == rrp->config) {
+        return weights->weight;
+    }
+
+    /*
+     * the first selection in this process, or the servers were resolved
+     * to other addresses; the peer list is not changed as the caller
+     * holds the read lock if servers are resolved at run time
+     */
+
+    if (peers->number == 0) {
+        return NULL;
+    }
+
+    weight = ngx_alloc(peers->number * sizeof(ngx_stream_upstream_rr_weight_t),
+                       ngx_cycle->log);
+    if (weight == NULL) {
+        return NULL;
+    }
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        weight[i].current_weight = 0;
+        weight[i].effective_weight = peer->weight;
+    }
+
+    if (weights->weight) {
+        ngx_free(weights->weight);
+    }
+
+    weights->weight = weight;
+    weights->config = rrp->config;
+
+    return weight;
+}
+
+
 void
 ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
     ngx_uint_t state)
 {
     ngx_stream_upstream_rr_peer_data_t  *rrp = data;
 
-    time_t                          now;
-    ngx_stream_upstream_rr_peer_t  *peer;
+    time_t                            now;
+    ngx_stream_upstream_rr_peer_t    *peer;
+    ngx_stream_upstream_rr_weight_t  *weight;
 
     ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
                    "free rr peer %ui %ui", pc->tries, state);
 
     peer = rrp->current;
 
-    ngx_stream_upstream_rr_peers_rlock(rrp->peers);
-    ngx_stream_upstream_rr_peer_lock(rrp->peers, peer);
-
     if (rrp->peers->single) {
-        peer->conns--;
-
-        ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
-        ngx_stream_upstream_rr_peers_unlock(rrp->peers);
+        ngx_stream_upstream_rr_peer_dec(peer);
 
         pc->tries = 0;
         return;
@@ -621,40 +740,62 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
     if (state & NGX_PEER_FAILED) {
         now = ngx_time();
 
+        ngx_stream_upstream_rr_peers_rlock(rrp->peers);
+        ngx_stream_upstream_rr_peer_lock(rrp->peers, peer);
+
         peer->fails++;
         peer->accessed = now;
         peer->checked = now;
 
-        if (peer->max_fails) {
-            peer->effective_weight -= peer->weight / peer->max_fails;
+        if (peer->max_fails && peer->fails >= peer->max_fails) {
+            ngx_log_error(NGX_LOG_WARN, pc->log, 0,
+                          "upstream server temporarily disabled");
+        }
+
+        ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
+        ngx_stream_upstream_rr_peers_unlock(rrp->peers);
+
+        /*
+         * the weight is only set if the peer was selected by round robin,
+         * and is gone if the weights were reset since
+         */
 
-            if (peer->fails >= peer->max_fails) {
-                ngx_log_error(NGX_LOG_WARN, pc->log, 0,
-                              "upstream server temporarily disabled");
+        weight = rrp->weight;
+
+        if (weight && peer->max_fails
+            && rrp->peers->weights->config == rrp->config)
+        {
+            weight->effective_weight -= peer->weight / peer->max_fails;
+
+            if (weight->effective_weight < 0) {
+                weight->effective_weight = 0;
             }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                           "free rr peer failed: %p %i",
+                           peer, weight->effective_weight);
         }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
-                       "free rr peer failed: %p %i",
-                       peer, peer->effective_weight);
+    } else if (peer->fails) {
 
-        if (peer->effective_weight < 0) {
-            peer->effective_weight = 0;
-        }
+        /* the common case of a live peer is checked without locks */
 
-    } else {
+        ngx_stream_upstream_rr_peers_rlock(rrp->peers);
+        ngx_stream_upstream_rr_peer_lock(rrp->peers, peer);
 
         /* mark peer live if check passed */
 
         if (peer->accessed < peer->checked) {
             peer->fails = 0;
         }
+
+        ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
+        ngx_stream_upstream_rr_peers_unlock(rrp->peers);
     }
 
-    peer->conns--;
+    rrp->weight = NULL;
 
-    ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
-    ngx_stream_upstream_rr_peers_unlock(rrp->peers);
+    ngx_stream_upstream_rr_peer_dec(peer);
 
     if (pc->tries) {
         pc->tries--;
@@ -662,6 +803,25 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 }
 
 
+ngx_int_t
+ngx_stream_upstream_rr_peer_acquire(ngx_stream_upstream_rr_peer_t *peer)
+{
+    ngx_atomic_uint_t  conns;
+
+    for ( ;; ) {
+        conns = peer->conns;
+
+        if (peer->max_conns && conns >= peer->max_conns) {
+            return NGX_BUSY;
+        }
+
+        if (ngx_atomic_cmp_set(&peer->conns, conns, conns + 1)) {
+            return NGX_OK;
+        }
+    }
+}
+
+
 static void
 ngx_stream_upstream_notify_round_robin_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t type)
@@ -22,13 +22,14 @@ struct ngx_stream_upstream_rr_peer_s {
     ngx_str_t                        name;
     ngx_str_t                        server;
 
-    ngx_int_t                        current_weight;
-    ngx_int_t                        effective_weight;
     ngx_int_t                        weight;
 
-    ngx_uint_t                       conns;
+    ngx_atomic_t                     conns;
     ngx_uint_t                       max_conns;
 
+    ngx_msec_t                       ewma;
+    ngx_msec_t                       ewma_stamp;
+
     ngx_uint_t                       fails;
     time_t                           accessed;
     time_t                           checked;
@@ -39,12 +40,17 @@ struct ngx_stream_upstream_rr_peer_s {
     ngx_msec_t                       start_time;
 
     ngx_uint_t                       down;
+    ngx_uint_t                       unhealthy;
 
     void                            *ssl_session;
     int                              ssl_session_len;
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
     ngx_atomic_t                     lock;
+
+    /* 1 + index of the server the peer was resolved from at run time */
+    ngx_uint_t                       host;
+    ngx_uint_t                       zombie;
 #endif
 
     ngx_stream_upstream_rr_peer_t   *next;
@@ -54,6 +60,25 @@ struct ngx_stream_upstream_rr_peer_s {
 };
 
 
+/*
+ * the state of smooth weighted round robin is kept by each process for
+ * itself, even if peers are in shared memory, so selecting a peer only
+ * needs the peer list not to change; the weights of a peer list are
+ * reset when its servers are resolved to other addresses
+ */
+
+typedef struct {
+    ngx_int_t                        current_weight;
+    ngx_int_t                        effective_weight;
+} ngx_stream_upstream_rr_weight_t;
+
+
+typedef struct {
+    ngx_uint_t                       config;
+    ngx_stream_upstream_rr_weight_t *weight;
+} ngx_stream_upstream_rr_weights_t;
+
+
 typedef struct ngx_stream_upstream_rr_peers_s  ngx_stream_upstream_rr_peers_t;
 
 struct ngx_stream_upstream_rr_peers_s {
@@ -63,6 +88,13 @@ struct ngx_stream_upstream_rr_peers_s {
     ngx_slab_pool_t                 *shpool;
     ngx_atomic_t                     rwlock;
     ngx_stream_upstream_rr_peers_t  *zone_next;
+
+    /* changed each time servers are resolved to other addresses */
+    ngx_uint_t                      *config;
+    ngx_stream_upstream_rr_peer_t   *zombies;
+
+    /* data a balancer rebuilds in the zone on changes, e.g. a hash table */
+    void                            *table;
 #endif
 
     ngx_uint_t                       total_weight;
@@ -72,6 +104,9 @@ struct ngx_stream_upstream_rr_peers_s {
 
     ngx_str_t                       *name;
 
+    /* in process memory, not in the zone */
+    ngx_stream_upstream_rr_weights_t *weights;
+
     ngx_stream_upstream_rr_peers_t  *next;
 
     ngx_stream_upstream_rr_peer_t   *peer;
@@ -111,6 +146,32 @@ struct ngx_stream_upstream_rr_peers_s {
         ngx_rwlock_unlock(&peer->lock);                                       \
     }
 
+
+/*
+ * peers of upstreams with servers resolved at run time may change,
+ * so balancers which otherwise walk peers without locks take the read
+ * lock for them, and check that the peers are still those seen when
+ * the session started
+ */
+
+#define ngx_stream_upstream_rr_peers_config(peers)                            \
+    ((peers)->config ? *(peers)->config : 0)
+
+#define ngx_stream_upstream_rr_peers_changed(peers, rrp)                      \
+    ((peers)->config && *(peers)->config != (rrp)->config)
+
+#define ngx_stream_upstream_rr_peers_rlock_config(peers)                      \
+                                                                              \
+    if (peers->config) {                                                      \
+        ngx_rwlock_rlock(&peers->rwlock);                                     \
+    }
+
+#define ngx_stream_upstream_rr_peers_unlock_config(peers)                     \
+                                                                              \
+    if (peers->config) {                                                      \
+        ngx_rwlock_unlock(&peers->rwlock);                                    \
+    }
+
 #else
 
 #define ngx_stream_upstream_rr_peers_rlock(peers)
@@ -119,13 +180,32 @@ struct ngx_stream_upstream_rr_peers_s {
 #define ngx_stream_upstream_rr_peer_lock(peers, peer)
 #define ngx_stream_upstream_rr_peer_unlock(peers, peer)
 
+#define ngx_stream_upstream_rr_peers_config(peers)  0
+#define ngx_stream_upstream_rr_peers_changed(peers, rrp)  0
+#define ngx_stream_upstream_rr_peers_rlock_config(peers)
+#define ngx_stream_upstream_rr_peers_unlock_config(peers)
+
 #endif
 
 
+/*
+ * unless servers are resolved at run time, the peer list never changes
+ * once the zone is initialized, so it can be walked without locks;
+ * peer->conns is updated atomically and does not need the peer lock
+ */
+
+#define ngx_stream_upstream_rr_peer_inc(peer)                                 \
+    (void) ngx_atomic_fetch_add(&(peer)->conns, 1)
+
+#define ngx_stream_upstream_rr_peer_dec(peer)                                 \
+    (void) ngx_atomic_fetch_add(&(peer)->conns, -1)
+
+
 typedef struct {
     ngx_uint_t                       config;
     ngx_stream_upstream_rr_peers_t  *peers;
     ngx_stream_upstream_rr_peer_t   *current;
+    ngx_stream_upstream_rr_weight_t *weight;
     uintptr_t                       *tried;
     uintptr_t                        data;
 } ngx_stream_upstream_rr_peer_data_t;
@@ -141,6 +221,10 @@ ngx_int_t ngx_stream_upstream_get_round_robin_peer(ngx_peer_connection_t *pc,
     void *data);
 void ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
+ngx_int_t ngx_stream_upstream_rr_peer_acquire(
+    ngx_stream_upstream_rr_peer_t *peer);
+ngx_stream_upstream_rr_weight_t *ngx_stream_upstream_rr_peers_weights(
+    ngx_stream_upstream_rr_peer_data_t *rrp);
 
 
 #endif /* _NGX_STREAM_UPSTREAM_ROUND_ROBIN_H_INCLUDED_ */
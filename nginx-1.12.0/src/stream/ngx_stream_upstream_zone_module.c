@@ -10,12 +10,36 @@
 #include <ngx_stream.h>
 
 
+typedef struct {
+    ngx_stream_upstream_srv_conf_t   *upstream;
+    ngx_stream_upstream_server_t     *server;
+    ngx_uint_t                        host;
+
+    ngx_resolver_t                   *resolver;
+    ngx_msec_t                        resolver_timeout;
+
+    ngx_event_t                       event;
+} ngx_stream_upstream_zone_host_t;
+
+
 static char *ngx_stream_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_stream_upstream_init_zone(ngx_shm_zone_t *shm_zone,
     void *data);
 static ngx_stream_upstream_rr_peers_t *ngx_stream_upstream_zone_copy_peers(
     ngx_slab_pool_t *shpool, ngx_stream_upstream_srv_conf_t *uscf);
+static ngx_uint_t ngx_stream_upstream_zone_resolvable(
+    ngx_stream_upstream_srv_conf_t *uscf);
+static ngx_int_t ngx_stream_upstream_zone_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_stream_upstream_zone_init_process(ngx_cycle_t *cycle);
+static void ngx_stream_upstream_zone_resolve_timer(ngx_event_t *ev);
+static void ngx_stream_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx);
+static void ngx_stream_upstream_zone_update(
+    ngx_stream_upstream_zone_host_t *host, ngx_resolver_addr_t *addrs,
+    ngx_uint_t naddrs);
+static ngx_stream_upstream_rr_peer_t *ngx_stream_upstream_zone_add_peer(
+    ngx_stream_upstream_zone_host_t *host, ngx_slab_pool_t *shpool,
+    ngx_resolver_addr_t *addr);
 
 
 static ngx_command_t  ngx_stream_upstream_zone_commands[] = {
@@ -33,7 +57,7 @@ static ngx_command_t  ngx_stream_upstream_zone_commands[] = {
 
 static ngx_stream_module_t  ngx_stream_upstream_zone_module_ctx = {
     NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_stream_upstream_zone_postconfiguration, /* postconfiguration */
 
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
@@ -50,7 +74,7 @@ ngx_module_t  ngx_stream_upstream_zone_module = {
     NGX_STREAM_MODULE,                     /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_stream_upstream_zone_init_process, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -194,6 +218,13 @@ ngx_stream_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
 
     peers->shpool = shpool;
 
+    if (ngx_stream_upstream_zone_resolvable(uscf)) {
+        peers->config = ngx_slab_calloc_locked(shpool, sizeof(ngx_uint_t));
+        if (peers->config == NULL) {
+            return NULL;
+        }
+    }
+
     for (peerp = &peers->peer; *peerp; peerp = &peer->next) {
         /* pool is unlocked */
         peer = ngx_slab_calloc_locked(shpool,
@@ -241,3 +272,515 @@ done:
 
     return peers;
 }
+
+
+static ngx_uint_t
+ngx_stream_upstream_zone_resolvable(ngx_stream_upstream_srv_conf_t *uscf)
+{
+    ngx_uint_t                     i;
+    ngx_stream_upstream_server_t  *server;
+
+    if (uscf->servers == NULL) {
+        return 0;
+    }
+
+    server = uscf->servers->elts;
+
+    for (i = 0; i < uscf->servers->nelts; i++) {
+        if (server[i].resolve) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_zone_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                        i;
+    ngx_stream_conf_ctx_t            *ctx;
+    ngx_stream_core_srv_conf_t       *cscf;
+    ngx_stream_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_stream_upstream_main_conf_t  *umcf;
+
+    /* names are resolved with the resolver of the stream{} block */
+
+    ctx = (ngx_stream_conf_ctx_t *)
+                                 cf->cycle->conf_ctx[ngx_stream_module.index];
+    cscf = ctx->srv_conf[ngx_stream_core_module.ctx_index];
+
+    umcf = ctx->main_conf[ngx_stream_upstream_module.ctx_index];
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL
+            || !ngx_stream_upstream_zone_resolvable(uscf))
+        {
+            continue;
+        }
+
+        if (cscf->resolver == NULL
+            || cscf->resolver->connections.nelts == 0)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "no resolver defined to resolve servers of "
+                          "upstream \"%V\" in %s:%ui",
+                          &uscf->host, uscf->file_name, uscf->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * names are resolved by the first worker only, the resulting peers
+ * are published in the upstream zone and thus seen by all workers
+ */
+
+static ngx_int_t
+ngx_stream_upstream_zone_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i, j;
+    ngx_stream_conf_ctx_t            *ctx;
+    ngx_stream_core_srv_conf_t       *cscf;
+    ngx_stream_upstream_server_t     *server;
+    ngx_stream_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_stream_upstream_main_conf_t  *umcf;
+    ngx_stream_upstream_zone_host_t  *host;
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    ctx = (ngx_stream_conf_ctx_t *) cycle->conf_ctx[ngx_stream_module.index];
+    if (ctx == NULL) {
+        return NGX_OK;
+    }
+
+    cscf = ctx->srv_conf[ngx_stream_core_module.ctx_index];
+
+    umcf = ctx->main_conf[ngx_stream_upstream_module.ctx_index];
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL
+            || !ngx_stream_upstream_zone_resolvable(uscf))
+        {
+            continue;
+        }
+
+        server = uscf->servers->elts;
+
+        for (j = 0; j < uscf->servers->nelts; j++) {
+
+            if (!server[j].resolve) {
+                continue;
+            }
+
+            host = ngx_pcalloc(cycle->pool,
+                               sizeof(ngx_stream_upstream_zone_host_t));
+            if (host == NULL) {
+                return NGX_ERROR;
+            }
+
+            host->upstream = uscf;
+            host->server = &server[j];
+            host->host = j + 1;
+
+            host->resolver = cscf->resolver;
+            host->resolver_timeout =
+                             (cscf->resolver_timeout != NGX_CONF_UNSET_MSEC)
+                             ? cscf->resolver_timeout : 30000;
+
+            host->event.handler = ngx_stream_upstream_zone_resolve_timer;
+            host->event.data = host;
+            host->event.log = cycle->log;
+            host->event.cancelable = 1;
+
+            ngx_add_timer(&host->event, 0);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_upstream_zone_resolve_timer(ngx_event_t *ev)
+{
+    ngx_resolver_ctx_t               *ctx;
+    ngx_stream_upstream_zone_host_t  *host;
+
+    host = ev->data;
+
+    if (ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    ctx = ngx_resolve_start(host->resolver, NULL);
+    if (ctx == NULL) {
+        goto retry;
+    }
+
+    if (ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "no resolver defined to resolve %V", &host->server->host);
+        return;
+    }
+
+    ctx->name = host->server->host;
+    ctx->service = host->server->service;
+    ctx->handler = ngx_stream_upstream_zone_resolve_handler;
+    ctx->data = host;
+    ctx->timeout = host->resolver_timeout;
+
+    if (ngx_resolve_name(ctx) != NGX_OK) {
+        goto retry;
+    }
+
+    return;
+
+retry:
+
+    ngx_add_timer(ev, 1000);
+}
+
+
+static void
+ngx_stream_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    time_t                            valid;
+    ngx_uint_t                        i, n;
+    u_short                           priority;
+    ngx_resolver_addr_t              *addrs;
+    ngx_stream_upstream_zone_host_t  *host;
+
+    host = ctx->data;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_STREAM, host->event.log, 0,
+                   "upstream \"%V\" resolved \"%V\": %i",
+                   &host->upstream->host, &host->server->name, ctx->state);
+
+    if (ctx->state == NGX_RESOLVE_NXDOMAIN) {
+        ngx_log_error(NGX_LOG_ERR, host->event.log, 0,
+                      "%V could not be resolved (%i: %s) "
+                      "in upstream \"%V\"",
+                      &host->server->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state),
+                      &host->upstream->host);
+
+        ngx_stream_upstream_zone_update(host, NULL, 0);
+
+    } else if (ctx->state) {
+
+        /* keep the peers the name was last resolved to */
+
+        ngx_log_error(NGX_LOG_ERR, host->event.log, 0,
+                      "%V could not be resolved (%i: %s) "
+                      "in upstream \"%V\"",
+                      &host->server->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state),
+                      &host->upstream->host);
+
+    } else {
+        addrs = ctx->addrs;
+        n = ctx->naddrs;
+
+        if (ctx->service.len) {
+
+            /* only servers with the most preferred priority are used */
+
+            priority = (u_short) -1;
+
+            for (i = 0; i < ctx->naddrs; i++) {
+                if (ctx->addrs[i].priority < priority) {
+                    priority = ctx->addrs[i].priority;
+                }
+            }
+
+            for (i = 0, n = 0; i < ctx->naddrs; i++) {
+                if (ctx->addrs[i].priority == priority) {
+                    addrs[n++] = ctx->addrs[i];
+                }
+            }
+
+        } else {
+            for (i = 0; i < n; i++) {
+                ngx_inet_set_port(addrs[i].sockaddr, host->server->port);
+            }
+        }
+
+        ngx_stream_upstream_zone_update(host, addrs, n);
+    }
+
+    valid = ctx->valid - ngx_time();
+
+    ngx_resolve_name_done(ctx);
+
+    if (ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    ngx_add_timer(&host->event, (ngx_msec_t) ngx_max(valid, 1) * 1000);
+}
+
+
+/*
+ * peers of the name are updated in place: peers still resolved to are
+ * kept along with their state, e.g. the number of connections, peers no
+ * longer resolved to are unlinked; as sessions which already selected
+ * a peer may still refer to it, unlinked peers are only freed once they
+ * are seen idle by two subsequent updates
+ */
+
+static void
+ngx_stream_upstream_zone_update(ngx_stream_upstream_zone_host_t *host,
+    ngx_resolver_addr_t *addrs, ngx_uint_t naddrs)
+{
+    ngx_int_t                        w;
+    ngx_uint_t                       i, n, changed;
+    ngx_slab_pool_t                 *shpool;
+    ngx_stream_upstream_rr_peer_t   *peer, **peerp;
+    ngx_stream_upstream_rr_peers_t  *peers;
+
+    peers = host->upstream->peer.data;
+    shpool = peers->shpool;
+
+    changed = 0;
+
+    ngx_stream_upstream_rr_peers_wlock(peers);
+
+    for (peerp = &peers->zombies; *peerp; /* void */ ) {
+        peer = *peerp;
+
+        if (peer->host != host->host) {
+            peerp = &peer->next;
+            continue;
+        }
+
+        if (peer->conns) {
+            peer->zombie = 1;
+
+        } else if (++peer->zombie > 2) {
+            ngx_log_debug2(NGX_LOG_DEBUG_STREAM, host->event.log, 0,
+                           "upstream \"%V\": free peer %V",
+                           &host->upstream->host, &peer->name);
+
+            *peerp = peer->next;
+
+            ngx_slab_free(shpool, peer->sockaddr);
+            ngx_slab_free(shpool, peer->name.data);
+            ngx_slab_free(shpool, peer);
+
+            continue;
+        }
+
+        peerp = &peer->next;
+    }
+
+    for (peerp = &peers->peer; *peerp; /* void */ ) {
+        peer = *peerp;
+
+        if (peer->host != host->host) {
+            peerp = &peer->next;
+            continue;
+        }
+
+        for (i = 0; i < naddrs; i++) {
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 addrs[i].sockaddr, addrs[i].socklen, 1)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (i < naddrs) {
+            if (host->server->service.len) {
+                w = ngx_max(addrs[i].weight, 1);
+
+            } else {
+                w = host->server->weight;
+            }
+
+            if (peer->weight != w) {
+                peer->weight = w;
+                changed = 1;
+            }
+
+            peerp = &peer->next;
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, host->event.log, 0,
+                      "upstream \"%V\": server %V of %V removed",
+                      &host->upstream->host, &peer->name,
+                      &host->server->name);
+
+        *peerp = peer->next;
+
+        peer->zombie = 1;
+        peer->next = peers->zombies;
+        peers->zombies = peer;
+
+        changed = 1;
+    }
+
+    /* peerp now points to the end of the list */
+
+    for (i = 0; i < naddrs; i++) {
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+            if (peer->host == host->host
+                && ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                    addrs[i].sockaddr, addrs[i].socklen, 1)
+                   == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (peer) {
+            continue;
+        }
+
+        peer = ngx_stream_upstream_zone_add_peer(host, shpool, &addrs[i]);
+        if (peer == NULL) {
+            break;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, host->event.log, 0,
+                      "upstream \"%V\": server %V of %V added",
+                      &host->upstream->host, &peer->name,
+                      &host->server->name);
+
+        *peerp = peer;
+        peerp = &peer->next;
+
+        changed = 1;
+    }
+
+    if (changed) {
+        n = 0;
+        w = 0;
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+            n++;
+            w += peer->weight;
+        }
+
+        peers->number = n;
+        peers->total_weight = w;
+        peers->weighted = (w != (ngx_int_t) n);
+
+        (*peers->config)++;
+
+        /* built once here rather than by each worker, so all agree */
+
+        if (host->upstream->peer.update) {
+            host->upstream->peer.update(host->upstream);
+        }
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+}
+
+
+static ngx_stream_upstream_rr_peer_t *
+ngx_stream_upstream_zone_add_peer(ngx_stream_upstream_zone_host_t *host,
+    ngx_slab_pool_t *shpool, ngx_resolver_addr_t *addr)
+{
+    ngx_int_t                       w;
+    ngx_stream_upstream_rr_peer_t  *peer, **peerp;
+    ngx_stream_upstream_rr_peers_t *peers;
+    ngx_stream_upstream_server_t   *server;
+
+    peers = host->upstream->peer.data;
+    server = host->server;
+
+    if (server->service.len) {
+        w = ngx_max(addr->weight, 1);
+
+    } else {
+        w = server->weight;
+    }
+
+    /* a peer resolved to again before it was freed is reused */
+
+    for (peerp = &peers->zombies; *peerp; peerp = &(*peerp)->next) {
+        peer = *peerp;
+
+        if (peer->host == host->host
+            && ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                addr->sockaddr, addr->socklen, 1)
+               == NGX_OK)
+        {
+            *peerp = peer->next;
+
+            peer->weight = w;
+            peer->zombie = 0;
+            peer->next = NULL;
+
+            return peer;
+        }
+    }
+
+    peer = ngx_slab_calloc(shpool, sizeof(ngx_stream_upstream_rr_peer_t));
+    if (peer == NULL) {
+        goto failed;
+    }
+
+    peer->sockaddr = ngx_slab_alloc(shpool, addr->socklen);
+    if (peer->sockaddr == NULL) {
+        goto failed;
+    }
+
+    peer->name.data = ngx_slab_alloc(shpool, NGX_SOCKADDR_STRLEN);
+    if (peer->name.data == NULL) {
+        goto failed;
+    }
+
+    ngx_memcpy(peer->sockaddr, addr->sockaddr, addr->socklen);
+    peer->socklen = addr->socklen;
+
+    peer->name.len = ngx_sock_ntop(peer->sockaddr, peer->socklen,
+                                   peer->name.data, NGX_SOCKADDR_STRLEN, 1);
+
+    peer->server = server->name;
+    peer->weight = w;
+    peer->max_conns = server->max_conns;
+    peer->max_fails = server->max_fails;
+    peer->fail_timeout = server->fail_timeout;
+    peer->slow_start = server->slow_start;
+    peer->down = server->down;
+    peer->host = host->host;
+
+    return peer;
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, host->event.log, 0,
+                  "could not allocate peer for %V in upstream \"%V\"",
+                  &server->name, &host->upstream->host);
+
+    if (peer) {
+        if (peer->sockaddr) {
+            ngx_slab_free(shpool, peer->sockaddr);
+        }
+
+        ngx_slab_free(shpool, peer);
+    }
+
+    return NULL;
+}
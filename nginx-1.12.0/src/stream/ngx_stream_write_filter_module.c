@@ -10,17 +10,42 @@
 #include <ngx_stream.h>
 
 
+typedef struct {
+    ngx_flag_t    coalesce;
+} ngx_stream_write_filter_srv_conf_t;
+
+
 typedef struct {
     ngx_chain_t  *from_upstream;
     ngx_chain_t  *from_downstream;
+    ngx_event_t   flush[2];          /* indexed by from_upstream */
+    ngx_uint_t    coalesce;          /* unsigned  coalesce:1; */
 } ngx_stream_write_filter_ctx_t;
 
 
 static ngx_int_t ngx_stream_write_filter(ngx_stream_session_t *s,
     ngx_chain_t *in, ngx_uint_t from_upstream);
+static void ngx_stream_write_filter_flush_handler(ngx_event_t *ev);
+static void ngx_stream_write_filter_cleanup(void *data);
+static void *ngx_stream_write_filter_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_write_filter_merge_srv_conf(ngx_conf_t *cf,
+    void *parent, void *child);
 static ngx_int_t ngx_stream_write_filter_init(ngx_conf_t *cf);
 
 
+static ngx_command_t  ngx_stream_write_filter_commands[] = {
+
+    { ngx_string("coalesce_output"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_write_filter_srv_conf_t, coalesce),
+      NULL },
+
+      ngx_null_command
+};
+
+
 static ngx_stream_module_t  ngx_stream_write_filter_module_ctx = {
     NULL,                                  /* preconfiguration */
     ngx_stream_write_filter_init,          /* postconfiguration */
@@ -28,15 +53,15 @@ static ngx_stream_module_t  ngx_stream_write_filter_module_ctx = {
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
 
-    NULL,                                  /* create server configuration */
-    NULL                                   /* merge server configuration */
+    ngx_stream_write_filter_create_srv_conf, /* create server configuration */
+    ngx_stream_write_filter_merge_srv_conf   /* merge server configuration */
 };
 
 
 ngx_module_t  ngx_stream_write_filter_module = {
     NGX_MODULE_V1,
     &ngx_stream_write_filter_module_ctx,   /* module context */
-    NULL,                                  /* module directives */
+    ngx_stream_write_filter_commands,      /* module directives */
     NGX_STREAM_MODULE,                     /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
@@ -53,11 +78,14 @@ static ngx_int_t
 ngx_stream_write_filter(ngx_stream_session_t *s, ngx_chain_t *in,
     ngx_uint_t from_upstream)
 {
-    off_t                           size;
-    ngx_uint_t                      last, flush, sync;
-    ngx_chain_t                    *cl, *ln, **ll, **out, *chain;
-    ngx_connection_t               *c;
-    ngx_stream_write_filter_ctx_t  *ctx;
+    off_t                                size;
+    ngx_uint_t                           last, flush, sync;
+    ngx_event_t                         *ev;
+    ngx_chain_t                         *cl, *ln, **ll, **out, *chain;
+    ngx_connection_t                    *c;
+    ngx_pool_cleanup_t                  *cln;
+    ngx_stream_write_filter_ctx_t       *ctx;
+    ngx_stream_write_filter_srv_conf_t  *wscf;
 
     ctx = ngx_stream_get_module_ctx(s, ngx_stream_write_filter_module);
 
@@ -68,6 +96,24 @@ ngx_stream_write_filter(ngx_stream_session_t *s, ngx_chain_t *in,
             return NGX_ERROR;
         }
 
+        wscf = ngx_stream_get_module_srv_conf(s,
+                                              ngx_stream_write_filter_module);
+
+        if (wscf->coalesce && s->connection->type == SOCK_STREAM) {
+            cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+            if (cln == NULL) {
+                return NGX_ERROR;
+            }
+
+            cln->handler = ngx_stream_write_filter_cleanup;
+            cln->data = ctx;
+
+            ctx->flush[0].handler = ngx_stream_write_filter_flush_handler;
+            ctx->flush[1].handler = ngx_stream_write_filter_flush_handler;
+
+            ctx->coalesce = 1;
+        }
+
         ngx_stream_set_ctx(s, ctx, ngx_stream_write_filter_module);
     }
 
@@ -225,6 +271,34 @@ ngx_stream_write_filter(ngx_stream_session_t *s, ngx_chain_t *in,
         return NGX_ERROR;
     }
 
+    if (ctx->coalesce
+        && !last && !sync
+        && c->write->ready
+        && !(c->buffered & NGX_LOWLEVEL_BUFFERED))
+    {
+        ev = &ctx->flush[from_upstream];
+
+        /*
+         * the data of all reads in this event loop iteration are sent
+         * at once from a posted event, instead of a write per read
+         */
+
+        if (in && !ev->posted) {
+            ev->data = c;
+            ev->log = c->log;
+
+            ngx_post_event(ev, &ngx_posted_events);
+        }
+
+        if (ev->posted) {
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "stream write filter coalesce s:%O", size);
+
+            c->buffered |= NGX_STREAM_WRITE_BUFFERED;
+            return NGX_AGAIN;
+        }
+    }
+
     chain = c->send_chain(c, *out, 0);
 
     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
@@ -264,6 +338,66 @@ ngx_stream_write_filter(ngx_stream_session_t *s, ngx_chain_t *in,
 }
 
 
+static void
+ngx_stream_write_filter_flush_handler(ngx_event_t *ev)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "stream write filter flush");
+
+    /* the owner of the connection resumes the output */
+
+    c->write->handler(c->write);
+}
+
+
+static void
+ngx_stream_write_filter_cleanup(void *data)
+{
+    ngx_stream_write_filter_ctx_t  *ctx = data;
+
+    if (ctx->flush[0].posted) {
+        ngx_delete_posted_event(&ctx->flush[0]);
+    }
+
+    if (ctx->flush[1].posted) {
+        ngx_delete_posted_event(&ctx->flush[1]);
+    }
+}
+
+
+static void *
+ngx_stream_write_filter_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_write_filter_srv_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_stream_write_filter_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->coalesce = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_write_filter_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_stream_write_filter_srv_conf_t *prev = parent;
+    ngx_stream_write_filter_srv_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->coalesce, prev->coalesce, 0);
+
+    return NGX_CONF_OK;
+}
+
+
 static ngx_int_t
 ngx_stream_write_filter_init(ngx_conf_t *cf)
 {
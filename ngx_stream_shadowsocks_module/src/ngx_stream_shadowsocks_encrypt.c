@@ -23,6 +23,7 @@
 #include <stdint.h>
 
 #include <openssl/md5.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 
 #define CIPHER_UNSUPPORTED "unsupported"
@@ -32,19 +33,20 @@
 
 
 #include <sodium.h>
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#if (NGX_HAVE_AVX512VBMI)
+#include <immintrin.h>
+#endif
+
 #include "ngx_stream_shadowsocks_encrypt.h"
 
 #define OFFSET_ROL(p, o) ((uint64_t)(*(p + o)) << (8 * o))
 
 #define LOGE(...)
 
-
-static void FATAL(const char *msg)
-{
-    LOGE("%s", msg);
-    exit(-1);
-}
-
 static const char * supported_ciphers[CIPHER_NUM] =
 {
     "table",
@@ -63,17 +65,23 @@ static const char * supported_ciphers[CIPHER_NUM] =
     "rc2-cfb",
     "seed-cfb",
     "salsa20",
-    "chacha20"
+    "chacha20",
+    "aes-128-gcm",
+    "aes-192-gcm",
+    "aes-256-gcm",
+    "chacha20-ietf-poly1305"
 };
 
 static const int supported_ciphers_iv_size[CIPHER_NUM] =
 {
-    0, 0, 16, 16, 16, 16, 8, 16, 16, 16, 8, 8, 8, 8, 16, 8, 8
+    0, 0, 16, 16, 16, 16, 8, 16, 16, 16, 8, 8, 8, 8, 16, 8, 8,
+    16, 24, 32, 32                  /* AEAD: salt的长度 */
 };
 
 static const int supported_ciphers_key_size[CIPHER_NUM] =
 {
-    0, 16, 16, 16, 24, 32, 16, 16, 24, 32, 16, 8, 16, 16, 16, 32, 32
+    0, 16, 16, 16, 24, 32, 16, 16, 24, 32, 16, 8, 16, 16, 16, 32, 32,
+    16, 24, 32, 32
 };
 
 static int crypto_stream_xor_ic(uint8_t *c, const uint8_t *m, uint64_t mlen,
@@ -90,82 +98,45 @@ static int crypto_stream_xor_ic(uint8_t *c, const uint8_t *m, uint64_t mlen,
     return 0;
 }
 
-static int random_compare(const void *_x, const void *_y, uint32_t i,
-        uint64_t a)
+/**
+ * 归并排序(稳定), 按weight[x]从小到大; 只把左半部分拷到tmp中,
+ * 右半部分原地归并, tmp至少要有(length + 1) / 2字节
+ **/
+static void table_merge_sort(uint8_t *array, int length,
+        const uint16_t *weight, uint8_t *tmp)
 {
-    uint8_t x = *((uint8_t *)_x);
-    uint8_t y = *((uint8_t *)_y);
-    return a % (x + i) - a % (y + i);
-}
+    int llength, rlength;
+    uint8_t *l, *lend, *r, *rend, *out;
 
-static void merge(uint8_t *left, int llength, uint8_t *right,
-        int rlength, uint32_t salt, uint64_t key)
-{
-    uint8_t *ltmp = (uint8_t *)malloc(llength * sizeof(uint8_t));
-    uint8_t *rtmp = (uint8_t *)malloc(rlength * sizeof(uint8_t));
+    if (length <= 1) {
+        return;
+    }
 
-    uint8_t *ll = ltmp;
-    uint8_t *rr = rtmp;
+    rlength = length / 2;
+    llength = length - rlength;
 
-    uint8_t *result = left;
+    table_merge_sort(array, llength, weight, tmp);
+    table_merge_sort(array + llength, rlength, weight, tmp);
 
-    memcpy(ltmp, left, llength * sizeof(uint8_t));
-    memcpy(rtmp, right, rlength * sizeof(uint8_t));
+    memcpy(tmp, array, llength);
 
-    while (llength > 0 && rlength > 0) {
-        if (random_compare(ll, rr, salt, key) <= 0) {
-            *result = *ll;
-            ++ll;
-            --llength;
-        } else {
-            *result = *rr;
-            ++rr;
-            --rlength;
-        }
-        ++result;
-    }
+    l = tmp;
+    lend = tmp + llength;
+    r = array + llength;
+    rend = array + length;
+    out = array;
 
-    if (llength > 0) {
-        while (llength > 0) {
-            *result = *ll;
-            ++result;
-            ++ll;
-            --llength;
-        }
-    } else {
-        while (rlength > 0) {
-            *result = *rr;
-            ++result;
-            ++rr;
-            --rlength;
+    while (l < lend && r < rend) {
+        if (weight[*l] <= weight[*r]) {
+            *out++ = *l++;
+        } else {
+            *out++ = *r++;
         }
     }
 
-    free(ltmp);
-    free(rtmp);
-}
-
-static void merge_sort(uint8_t array[], int length,
-        uint32_t salt, uint64_t key)
-{
-    uint8_t middle;
-    uint8_t *left, *right;
-    int llength;
-
-    if (length <= 1) {
-        return;
+    while (l < lend) {
+        *out++ = *l++;
     }
-
-    middle = length / 2;
-
-    llength = length - middle;
-
-    left = array;
-    right = array + llength;
-
-    merge_sort(left, llength, salt, key);
-    merge_sort(right, middle, salt, key);
-    merge(left, llength, right, middle, salt, key);
 }
 
 static unsigned char *enc_md5(const unsigned char *d, size_t n, unsigned char *md)
@@ -175,9 +146,11 @@ static unsigned char *enc_md5(const unsigned char *d, size_t n, unsigned char *m
 
 static void enc_table_init(shadowsocks_t *ss, const char *pass)
 {
-    uint32_t i;
+    uint32_t i, x;
     uint64_t key = 0;
     uint8_t *digest;
+    uint8_t tmp[128];
+    uint16_t weight[256];
 
     digest = enc_md5((const uint8_t *)pass, strlen(pass), NULL);
 
@@ -189,7 +162,12 @@ static void enc_table_init(shadowsocks_t *ss, const char *pass)
         ss->enc_table[i] = i;
     }
     for (i = 1; i < 1024; ++i) {
-        merge_sort(ss->enc_table, 256, i, key);
+        /* 与原来的比较函数(key % (x + i)) - (key % (y + i))等价,
+         * 每轮只算256次取模, 排序中不再分配内存 */
+        for (x = 0; x < 256; x++) {
+            weight[x] = (uint16_t)(key % (x + i));
+        }
+        table_merge_sort(ss->enc_table, 256, weight, tmp);
     }
     for (i = 0; i < 256; ++i) {
         // gen decrypt table from encrypt table
@@ -202,12 +180,36 @@ int cipher_iv_size(const cipher_kt_t *cipher)
     return EVP_CIPHER_iv_length(cipher);
 }
 
-static int bytes_to_key(const cipher_kt_t *cipher, const digest_type_t *md,
-        const uint8_t *pass, uint8_t *key, uint8_t *iv)
+/**
+ * 等价于EVP_BytesToKey(MD5, count = 1), 但只生成key, 不依赖EVP_CIPHER结构
+ * (salsa20/chacha20在OpenSSL中没有对应的cipher)
+ **/
+static int bytes_to_key(const uint8_t *pass, uint8_t *key, int key_len)
 {
+    int i, n;
     size_t datal;
+    uint8_t md_buf[MD5_DIGEST_LENGTH];
+    uint8_t data[MD5_DIGEST_LENGTH + BUFSIZ];
+
     datal = strlen((const char *)pass);
-    return EVP_BytesToKey(cipher, md, NULL, pass, datal, 1, key, iv);
+    if (datal > BUFSIZ) {
+        return 0;
+    }
+
+    for (i = 0; i < key_len; i += n) {
+        if (i == 0) {
+            memcpy(data, pass, datal);
+            MD5(data, datal, md_buf);
+        } else {
+            memcpy(data, md_buf, MD5_DIGEST_LENGTH);
+            memcpy(data + MD5_DIGEST_LENGTH, pass, datal);
+            MD5(data, MD5_DIGEST_LENGTH + datal, md_buf);
+        }
+        n = min(key_len - i, MD5_DIGEST_LENGTH);
+        memcpy(key + i, md_buf, n);
+    }
+
+    return key_len;
 }
 
 static int rand_bytes(uint8_t *output, int len)
@@ -226,75 +228,197 @@ static const cipher_kt_t *get_cipher_type(int method)
         method = RC4;
     }
 
-    if (method >= SALSA20) {
+    if (IS_SODIUM_METHOD(method)) {
         return NULL;
     }
 
+    if (method == CHACHA20_IETF_POLY1305) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA)
+        return EVP_chacha20_poly1305();
+#else
+        return NULL;
+#endif
+    }
+
     const char *ciphername = supported_ciphers[method];
     return EVP_get_cipherbyname(ciphername);
 }
 
-static const digest_type_t *get_digest_type(const char *digest)
+/**
+ * 配置阶段为每个方向创建一个cipher模板, 密钥固定的算法在这里就完成key schedule,
+ * 每个连接只需EVP_CIPHER_CTX_copy一份, 再设置IV
+ **/
+static cipher_evp_t *cipher_template_new(shadowsocks_t *ss, int method, int enc)
 {
-    if (digest == NULL) {
-        LOGE("get_digest_type(): Digest name is null");
+    const cipher_kt_t *cipher = get_cipher_type(method);
+    if (cipher == NULL) {
+        LOGE("Cipher %s not found in OpenSSL library", supported_ciphers[method]);
         return NULL;
     }
+    cipher_evp_t *evp = EVP_CIPHER_CTX_new();
+    if (evp == NULL) {
+        return NULL;
+    }
+    if (!EVP_CipherInit_ex(evp, cipher, NULL, NULL, NULL, enc)) {
+        LOGE("Cannot initialize cipher %s", supported_ciphers[method]);
+        goto failed;
+    }
+    if (!EVP_CIPHER_CTX_set_key_length(evp, ss->enc_key_len)) {
+        LOGE("Invalid key length: %d", ss->enc_key_len);
+        goto failed;
+    }
+    if (method > RC4_MD5 && !IS_AEAD_METHOD(method)) {
+        EVP_CIPHER_CTX_set_padding(evp, 1);
+    }
+    /* rc4-md5和AEAD的密钥与IV/salt有关, 只能在连接中设置 */
+    if (method != RC4_MD5 && !IS_AEAD_METHOD(method)
+            && !EVP_CipherInit_ex(evp, NULL, NULL, ss->enc_key, NULL, enc)) {
+        LOGE("Cannot set key");
+        goto failed;
+    }
+    return evp;
 
-    return EVP_get_digestbyname(digest);
+failed:
+    EVP_CIPHER_CTX_free(evp);
+    return NULL;
 }
 
-static void cipher_context_init(shadowsocks_t *ss, cipher_ctx_t *ctx, int method, int enc)
+static int cipher_context_init(shadowsocks_t *ss, cipher_ctx_t *ctx, int method, int enc)
 {
     if (method <= TABLE || method >= CIPHER_NUM) {
         LOGE("cipher_context_init(): Illegal method");
-        return;
+        return -1;
     }
 
-    if (method >= SALSA20) {
-        ss->enc_iv_len = supported_ciphers_iv_size[method];
-        return;
+    if (IS_SODIUM_METHOD(method)) {
+        return 0;
     }
 
-    const char *ciphername = supported_ciphers[method];
-    cipher_evp_t *evp = &ctx->evp;
-    const cipher_kt_t *cipher = get_cipher_type(method);
-    if (cipher == NULL) {
-        LOGE("Cipher %s not found in OpenSSL library", ciphername);
-        FATAL("Cannot initialize cipher");
+    cipher_evp_t *tmpl = ss->evp_template[enc ? 1 : 0];
+    if (tmpl == NULL) {
+        return -1;
     }
-    EVP_CIPHER_CTX_init(evp);
-    if (!EVP_CipherInit_ex(evp, cipher, NULL, NULL, NULL, enc)) {
-        LOGE("Cannot initialize cipher %s", ciphername);
-        exit(EXIT_FAILURE);
+    cipher_evp_t *evp = EVP_CIPHER_CTX_new();
+    if (evp == NULL) {
+        return -1;
     }
-    if (!EVP_CIPHER_CTX_set_key_length(evp, ss->enc_key_len)) {
-        EVP_CIPHER_CTX_cleanup(evp);
-        LOGE("Invalid key length: %d", ss->enc_key_len);
-        exit(EXIT_FAILURE);
+    ctx->evp = evp;
+    if (!EVP_CIPHER_CTX_copy(evp, tmpl)) {
+        LOGE("Cannot copy cipher context");
+        return -1;
     }
-    if (method > RC4_MD5) {
-        EVP_CIPHER_CTX_set_padding(evp, 1);
+    return 0;
+}
+
+/**
+ * HKDF-SHA1(RFC 5869), AEAD用它从主密钥和salt派生每个方向的子密钥
+ **/
+static int hkdf_sha1(const uint8_t *salt, int salt_len, const uint8_t *ikm,
+        int ikm_len, const uint8_t *info, int info_len, uint8_t *okm,
+        int okm_len)
+{
+    int i, n, len;
+    unsigned int prk_len, t_len;
+    uint8_t prk[MAX_MD_SIZE];
+    uint8_t t[MAX_MD_SIZE];
+    uint8_t data[MAX_MD_SIZE + 32 + 1];
+
+    if (info_len > 32) {
+        return -1;
+    }
+
+    if (HMAC(EVP_sha1(), salt, salt_len, ikm, ikm_len, prk, &prk_len) == NULL) {
+        return -1;
+    }
+
+    t_len = 0;
+
+    for (i = 0, n = 1; i < okm_len; i += t_len, n++) {
+        len = 0;
+        memcpy(data, t, t_len);
+        len += t_len;
+        memcpy(data + len, info, info_len);
+        len += info_len;
+        data[len++] = (uint8_t)n;
+
+        if (HMAC(EVP_sha1(), prk, prk_len, data, len, t, &t_len) == NULL) {
+            return -1;
+        }
+
+        memcpy(okm + i, t, min((int)t_len, okm_len - i));
     }
+
+    return 0;
 }
 
-static void cipher_context_set_iv(shadowsocks_t *ss, cipher_ctx_t *ctx,
+/**
+ * 失败时上下文中可能还是上一个会话的子密钥, 调用者必须终止会话,
+ * 否则会以同一密钥重复使用nonce
+ **/
+static int aead_set_salt(shadowsocks_t *ss, cipher_ctx_t *ctx,
+        const uint8_t *salt, size_t salt_len, int enc)
+{
+    int rc;
+    uint8_t subkey[MAX_KEY_LENGTH];
+
+    if (hkdf_sha1(salt, (int)salt_len, ss->enc_key, ss->enc_key_len,
+                (const uint8_t *)"ss-subkey", 9, subkey, ss->enc_key_len)
+            != 0) {
+        LOGE("Cannot derive AEAD subkey");
+        return -1;
+    }
+
+    memset(ctx->iv, 0, AEAD_NONCE_LEN);
+
+    rc = 0;
+
+    if (ctx->evp == NULL
+            || !EVP_CipherInit_ex(ctx->evp, NULL, NULL, subkey, NULL, enc)) {
+        LOGE("Cannot set AEAD subkey");
+        rc = -1;
+    }
+
+    OPENSSL_cleanse(subkey, sizeof(subkey));
+
+    return rc;
+}
+
+/* nonce为小端计数器 */
+void ss_aead_nonce_increment(uint8_t *nonce)
+{
+    int i;
+
+    for (i = 0; i < AEAD_NONCE_LEN; i++) {
+        if (++nonce[i] != 0) {
+            break;
+        }
+    }
+}
+
+static int cipher_context_set_iv(shadowsocks_t *ss, cipher_ctx_t *ctx,
         uint8_t *iv, size_t iv_len, int enc)
 {
     const unsigned char *true_key;
 
-    if (iv == NULL) {
-        LOGE("cipher_context_set_iv(): IV is null");
-        return;
-    }
+    /* rc4没有IV, 调用者传入NULL */
+    if (iv_len > 0) {
+        if (iv == NULL) {
+            LOGE("cipher_context_set_iv(): IV is null");
+            return -1;
+        }
 
-    if (enc) {
-        rand_bytes(iv, iv_len);
+        if (enc) {
+            rand_bytes(iv, iv_len);
+        }
     }
 
-    if (ss->enc_method >= SALSA20) {
+    if (IS_SODIUM_METHOD(ss->enc_method)) {
         memcpy(ctx->iv, iv, iv_len);
-        return;
+        return 0;
+    }
+
+    if (IS_AEAD_METHOD(ss->enc_method)) {
+        return aead_set_salt(ss, ctx, iv, iv_len, enc);
     }
 
     if (ss->enc_method == RC4_MD5) {
@@ -304,280 +428,508 @@ static void cipher_context_set_iv(shadowsocks_t *ss, cipher_ctx_t *ctx,
         true_key = enc_md5(key_iv, 32, NULL);
         iv_len = 0;
     } else {
-        true_key = ss->enc_key;
+        /* 密钥已在模板中设置, 只换IV */
+        true_key = NULL;
     }
 
-    cipher_evp_t *evp = &ctx->evp;
+    cipher_evp_t *evp = ctx->evp;
     if (evp == NULL) {
         LOGE("cipher_context_set_iv(): Cipher context is null");
-        return;
+        return -1;
     }
     if (!EVP_CipherInit_ex(evp, NULL, NULL, true_key, iv, enc)) {
-        EVP_CIPHER_CTX_cleanup(evp);
-        FATAL("Cannot set key and IV");
+        LOGE("Cannot set key and IV");
+        return -1;
     }
+
+    return 0;
 }
 
 void cipher_context_release(shadowsocks_t *ss, cipher_ctx_t *ctx)
 {
-    if (ss->enc_method >= SALSA20) {
+    if (ctx->evp == NULL) {
         return;
     }
 
-    cipher_evp_t *evp = &ctx->evp;
-    EVP_CIPHER_CTX_cleanup(evp);
+    EVP_CIPHER_CTX_free(ctx->evp);
+    ctx->evp = NULL;
 }
 
 static int cipher_context_update(cipher_ctx_t *ctx, uint8_t *output, int *olen,
         const uint8_t *input, int ilen)
 {
-    cipher_evp_t *evp = &ctx->evp;
+    cipher_evp_t *evp = ctx->evp;
     return EVP_CipherUpdate(evp, (uint8_t *)output, olen,
             (const uint8_t *)input, (size_t)ilen);
 }
 
-char * ss_encrypt(shadowsocks_t *ss, int buf_size, char *plaintext,
-        ssize_t *len, struct enc_ctx *ctx)
+int enc_ctx_init(shadowsocks_t *ss, int method, struct enc_ctx *ctx, int enc)
 {
-    if (ctx != NULL) {
-        static int tmp_len = 0;
-        static char *tmp_buf = NULL;
+    memset(ctx, 0, sizeof(struct enc_ctx));
+    if (method == TABLE) {
+        return 0;
+    }
+    return cipher_context_init(ss, &ctx->evp, method, enc);
+}
 
-        int err = 1;
-        int iv_len = 0;
-        int p_len = *len, c_len = *len;
-        if (!ctx->init) {
-            iv_len = ss->enc_iv_len;
+int enc_ctx_reset(shadowsocks_t *ss, struct enc_ctx *ctx, int enc)
+{
+    ctx->init = 0;
+    ctx->counter = 0;
+    memset(ctx->evp.iv, 0, MAX_IV_LENGTH);
+
+    /* rc4没有IV, 换IV不会重置keystream, 只能重新复制模板 */
+    if (ss->enc_method == RC4) {
+        if (ctx->evp.evp == NULL
+                || !EVP_CIPHER_CTX_copy(ctx->evp.evp,
+                    ss->evp_template[enc ? 1 : 0])) {
+            LOGE("Cannot copy cipher context");
+            return -1;
         }
+    }
 
-        int buf_len = max(iv_len + c_len, buf_size);
-        if (tmp_len < buf_len) {
-            tmp_len = buf_len;
-            tmp_buf = realloc(tmp_buf, buf_len);
-        }
-        char *ciphertext = tmp_buf;
-
-        if (!ctx->init) {
-            uint8_t iv[MAX_IV_LENGTH];
-            cipher_context_set_iv(ss, &ctx->evp, iv, ss->enc_iv_len, 1);
-            memcpy(ciphertext, iv, iv_len);
-            ctx->counter = 0;
-            ctx->init = 1;
-        }
+    return 0;
+}
 
-        if (ss->enc_method >= SALSA20) {
-            int padding = ctx->counter % SODIUM_BLOCK_SIZE;
-            if (buf_len < iv_len + padding + c_len) {
-                buf_len = max(iv_len + (padding + c_len) * 2, buf_size);
-                ciphertext = realloc(ciphertext, buf_len);
-                tmp_len = buf_len;
-                tmp_buf = ciphertext;
-            }
-            if (padding) {
-                plaintext = realloc(plaintext, max(p_len + padding, buf_size));
-                memmove(plaintext + padding, plaintext, p_len);
-                memset(plaintext, 0, padding);
-            }
-            crypto_stream_xor_ic((uint8_t *)(ciphertext + iv_len),
-                    (const uint8_t *)plaintext,
-                    (uint64_t)(p_len + padding),
-                    (const uint8_t *)ctx->evp.iv,
-                    ctx->counter / SODIUM_BLOCK_SIZE, ss->enc_key,
-                    ss->enc_method);
-            ctx->counter += p_len;
-            if (padding) {
-                memmove(ciphertext + iv_len, ciphertext + iv_len + padding,
-                        c_len);
-            }
-        } else {
-            err = cipher_context_update(&ctx->evp,
-                    (uint8_t *)(ciphertext + iv_len),
-                    &c_len, (const uint8_t *)plaintext,
-                    p_len);
-            if (!err) {
-                free(plaintext);
-                return NULL;
-            }
+int enc_ctx_set_iv(shadowsocks_t *ss, struct enc_ctx *ctx, uint8_t *iv, int enc)
+{
+    ctx->counter = 0;
+
+    if (ss->enc_method != TABLE
+            && cipher_context_set_iv(ss, &ctx->evp, iv, ss->enc_iv_len, enc)
+            != 0) {
+        ctx->init = 0;
+        return -1;
+    }
+
+    ctx->init = 1;
+    return 0;
+}
+
+static void table_crypt_scalar(const uint8_t *table, uint8_t *dst,
+        const uint8_t *src, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        dst[i] = table[src[i]];
+    }
+}
+
+#if (NGX_HAVE_AVX512VBMI)
+
+/**
+ * 整张表放在4个zmm寄存器中, vpermi2b按低7位在两半表中各查一次,
+ * 再按最高位选择, 每次处理64字节
+ **/
+__attribute__((target("avx512bw,avx512vbmi")))
+static void table_crypt_vbmi(const uint8_t *table, uint8_t *dst,
+        const uint8_t *src, size_t len)
+{
+    __m512i t0, t1, t2, t3, x, lo, hi;
+
+    t0 = _mm512_loadu_si512(table);
+    t1 = _mm512_loadu_si512(table + 64);
+    t2 = _mm512_loadu_si512(table + 128);
+    t3 = _mm512_loadu_si512(table + 192);
+
+    while (len >= 64) {
+        x = _mm512_loadu_si512(src);
+        lo = _mm512_permutex2var_epi8(t0, x, t1);
+        hi = _mm512_permutex2var_epi8(t2, x, t3);
+        _mm512_storeu_si512(dst,
+                _mm512_mask_blend_epi8(_mm512_movepi8_mask(x), lo, hi));
+        src += 64;
+        dst += 64;
+        len -= 64;
+    }
+
+    table_crypt_scalar(table, dst, src, len);
+}
+
+#endif
+
+/* 在global_init()中按CPU选择 */
+static void (*table_crypt)(const uint8_t *table, uint8_t *dst,
+        const uint8_t *src, size_t len) = table_crypt_scalar;
+
+/**
+ * 中间对齐的整块直接交给crypto_stream_*_xor_ic; 末尾不满一块时
+ * 生成该块的keystream保存在ctx中, 下一个包的开头直接用它异或
+ **/
+static void sodium_crypt(shadowsocks_t *ss, struct enc_ctx *ctx,
+        uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i, n;
+    uint64_t padding;
+
+    padding = ctx->counter % SODIUM_BLOCK_SIZE;
+
+    if (padding) {
+        n = min(len, SODIUM_BLOCK_SIZE - padding);
+        for (i = 0; i < n; i++) {
+            dst[i] = src[i] ^ ctx->keystream[padding + i];
         }
 
-        if (*len < iv_len + c_len) {
-            plaintext = realloc(plaintext, max(iv_len + c_len, buf_size));
+        ctx->counter += n;
+        dst += n;
+        src += n;
+        len -= n;
+    }
+
+    n = len & ~((size_t)SODIUM_BLOCK_SIZE - 1);
+
+    if (n) {
+        crypto_stream_xor_ic(dst, src, n, ctx->evp.iv,
+                ctx->counter / SODIUM_BLOCK_SIZE, ss->enc_key, ss->enc_method);
+        ctx->counter += n;
+        dst += n;
+        src += n;
+        len -= n;
+    }
+
+    if (len) {
+        memset(ctx->keystream, 0, SODIUM_BLOCK_SIZE);
+        crypto_stream_xor_ic(ctx->keystream, ctx->keystream, SODIUM_BLOCK_SIZE,
+                ctx->evp.iv, ctx->counter / SODIUM_BLOCK_SIZE, ss->enc_key,
+                ss->enc_method);
+
+        for (i = 0; i < len; i++) {
+            dst[i] = src[i] ^ ctx->keystream[i];
         }
-        *len = iv_len + c_len;
-        memcpy(plaintext, ciphertext, *len);
-        return plaintext;
+
+        ctx->counter += len;
+    }
+}
+
+/* dst可以等于src, 流式加密算法的密文与明文等长 */
+static int ss_crypt(shadowsocks_t *ss, struct enc_ctx *ctx, uint8_t *dst,
+        const uint8_t *src, size_t len, int enc)
+{
+    int olen;
+
+    if (ss->enc_method == TABLE) {
+        table_crypt(enc ? ss->enc_table : ss->dec_table, dst, src, len);
+        return 0;
+    }
+
+    if (IS_SODIUM_METHOD(ss->enc_method)) {
+        sodium_crypt(ss, ctx, dst, src, len);
+        return 0;
+    }
+
+    if (!cipher_context_update(&ctx->evp, dst, &olen, src, (int)len)
+            || (size_t)olen != len) {
+        return -1;
+    }
+    ctx->counter += len;
+    return 0;
+}
+
+ngx_int_t ss_crypt_buf(shadowsocks_t *ss, struct enc_ctx *ctx, u_char *in,
+        size_t len, ngx_buf_t *out, int enc)
+{
+    u_char *dst;
+
+    if (IS_AEAD_METHOD(ss->enc_method) || !ctx->init) {
+        return NGX_ERROR;
+    }
+
+    if (in >= out->pos && in + len <= out->last) {
+        dst = in;
+
     } else {
-        char *begin = plaintext;
-        while (plaintext < begin + *len) {
-            *plaintext = (char)ss->enc_table[(uint8_t)*plaintext];
-            plaintext++;
+        if ((size_t)(out->end - out->last) < len) {
+            return NGX_ERROR;
         }
-        return begin;
+
+        dst = out->last;
+        out->last += len;
     }
+
+    return ss_crypt(ss, ctx, dst, in, len, enc) == 0 ? NGX_OK : NGX_ERROR;
 }
 
-char * ss_decrypt(shadowsocks_t *ss, int buf_size, char *ciphertext,
-        ssize_t *len, struct enc_ctx *ctx)
+ngx_int_t ss_write_iv(shadowsocks_t *ss, struct enc_ctx *ctx, ngx_buf_t *out)
 {
-    if (ctx != NULL) {
-        static int tmp_len = 0;
-        static char *tmp_buf = NULL;
+    if ((size_t)(out->end - out->last) < (size_t)ss->enc_iv_len) {
+        return NGX_ERROR;
+    }
 
-        int c_len = *len, p_len = *len;
-        int iv_len = 0;
-        int err = 1;
-        int buf_len = max(p_len, buf_size);
+    if (enc_ctx_set_iv(ss, ctx, out->last, 1) != 0) {
+        return NGX_ERROR;
+    }
 
-        if (tmp_len < buf_len) {
-            tmp_len = buf_len;
-            tmp_buf = realloc(tmp_buf, buf_len);
-        }
-        char *plaintext = tmp_buf;
-
-        if (!ctx->init) {
-            uint8_t iv[MAX_IV_LENGTH];
-            iv_len = ss->enc_iv_len;
-            p_len -= iv_len;
-            memcpy(iv, ciphertext, iv_len);
-            cipher_context_set_iv(ss, &ctx->evp, iv, ss->enc_iv_len, 0);
-            ctx->counter = 0;
-            ctx->init = 1;
-        }
+    out->last += ss->enc_iv_len;
+    return NGX_OK;
+}
 
-        if (ss->enc_method >= SALSA20) {
-            int padding = ctx->counter % SODIUM_BLOCK_SIZE;
-            if (buf_len < (p_len + padding) * 2) {
-                buf_len = max((p_len + padding) * 2, buf_size);
-                plaintext = realloc(plaintext, buf_len);
-                tmp_len = buf_len;
-                tmp_buf = plaintext;
-            }
-            if (padding) {
-                ciphertext =
-                    realloc(ciphertext, max(c_len + padding, buf_size));
-                memmove(ciphertext + iv_len + padding, ciphertext + iv_len,
-                        c_len - iv_len);
-                memset(ciphertext + iv_len, 0, padding);
-            }
-            crypto_stream_xor_ic((uint8_t *)plaintext,
-                    (const uint8_t *)(ciphertext + iv_len),
-                    (uint64_t)(c_len - iv_len + padding),
-                    (const uint8_t *)ctx->evp.iv,
-                    ctx->counter / SODIUM_BLOCK_SIZE, ss->enc_key,
-                    ss->enc_method);
-            ctx->counter += c_len - iv_len;
-            if (padding) {
-                memmove(plaintext, plaintext + padding, p_len);
-            }
-        } else {
-            err = cipher_context_update(&ctx->evp, (uint8_t *)plaintext, &p_len,
-                    (const uint8_t *)(ciphertext + iv_len),
-                    c_len - iv_len);
-        }
+ngx_int_t ss_read_iv(shadowsocks_t *ss, struct enc_ctx *ctx, ngx_buf_t *in)
+{
+    if (in->last - in->pos < ss->enc_iv_len) {
+        return NGX_AGAIN;
+    }
 
-        if (!err) {
-            free(ciphertext);
-            return NULL;
-        }
+    if (enc_ctx_set_iv(ss, ctx, in->pos, 0) != 0) {
+        return NGX_ERROR;
+    }
 
-        if (*len < p_len) {
-            ciphertext = realloc(ciphertext, max(p_len, buf_size));
-        }
-        *len = p_len;
-        memcpy(ciphertext, plaintext, *len);
-        return ciphertext;
-    } else {
-        char *begin = ciphertext;
-        while (ciphertext < begin + *len) {
-            *ciphertext = (char)ss->dec_table[(uint8_t)*ciphertext];
-            ciphertext++;
+    in->pos += ss->enc_iv_len;
+    return NGX_OK;
+}
+
+int ss_aead_seal(shadowsocks_t *ss, struct enc_ctx *ctx, uint8_t *data,
+        size_t len, uint8_t *tag)
+{
+    int olen;
+    cipher_evp_t *evp = ctx->evp.evp;
+
+    if (!EVP_CipherInit_ex(evp, NULL, NULL, NULL, ctx->evp.iv, 1)
+            || !EVP_CipherUpdate(evp, data, &olen, data, (int)len)
+            || !EVP_CipherFinal_ex(evp, data + olen, &olen)
+            || !EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_LEN,
+                tag)) {
+        return -1;
+    }
+
+    ss_aead_nonce_increment(ctx->evp.iv);
+    ctx->counter += len;
+    return 0;
+}
+
+int ss_aead_verify(shadowsocks_t *ss, struct enc_ctx *ctx,
+        const uint8_t *data, size_t len, const uint8_t *tag)
+{
+    int olen, n;
+    uint8_t buf[1024];
+    cipher_evp_t *evp = ctx->evp.evp;
+
+    if (!EVP_CipherInit_ex(evp, NULL, NULL, NULL, ctx->evp.iv, 0)) {
+        return -1;
+    }
+
+    while (len) {
+        n = len < sizeof(buf) ? (int)len : (int)sizeof(buf);
+        if (!EVP_CipherUpdate(evp, buf, &olen, data, n)) {
+            return -1;
         }
-        return begin;
+        data += n;
+        len -= n;
+    }
+
+    if (!EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_LEN,
+                (void *)tag)
+            || EVP_CipherFinal_ex(evp, buf, &olen) <= 0) {
+        return -1;
     }
+
+    return 0;
 }
 
-void enc_ctx_init(shadowsocks_t *ss, int method, struct enc_ctx *ctx, int enc)
+int ss_aead_seal_udp(shadowsocks_t *ss, struct enc_ctx *ctx, uint8_t *hdr,
+        size_t hlen, uint8_t *data, size_t len, uint8_t *tag)
 {
-    memset(ctx, 0, sizeof(struct enc_ctx));
-    cipher_context_init(ss, &ctx->evp, method, enc);
+    int olen;
+    cipher_evp_t *evp = ctx->evp.evp;
+
+    if (!EVP_CipherInit_ex(evp, NULL, NULL, NULL, ctx->evp.iv, 1)
+            || !EVP_CipherUpdate(evp, hdr, &olen, hdr, (int)hlen)
+            || !EVP_CipherUpdate(evp, data, &olen, data, (int)len)
+            || !EVP_CipherFinal_ex(evp, data + olen, &olen)
+            || !EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_LEN,
+                tag)) {
+        return -1;
+    }
+
+    ss_aead_nonce_increment(ctx->evp.iv);
+    ctx->counter += hlen + len;
+    return 0;
 }
 
-static void enc_key_init(shadowsocks_t *ss, int method, const char *pass)
+int ss_aead_open(shadowsocks_t *ss, struct enc_ctx *ctx, uint8_t *data,
+        size_t len, const uint8_t *tag)
 {
-    if (method <= TABLE || method >= CIPHER_NUM) {
-        LOGE("enc_key_init(): Illegal method");
-        return;
+    int olen;
+    cipher_evp_t *evp = ctx->evp.evp;
+
+    if (!EVP_CipherInit_ex(evp, NULL, NULL, NULL, ctx->evp.iv, 0)
+            || !EVP_CipherUpdate(evp, data, &olen, data, (int)len)
+            || !EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_LEN,
+                (void *)tag)
+            || EVP_CipherFinal_ex(evp, data + olen, &olen) <= 0) {
+        return -1;
     }
 
-    uint8_t iv[MAX_IV_LENGTH];
+    ss_aead_nonce_increment(ctx->evp.iv);
+    ctx->counter += len;
+    return 0;
+}
 
-    cipher_kt_t *cipher;
-    cipher_kt_t cipher_info;
+void ss_aead_reserve(struct enc_ctx *ctx, uint8_t *nonce)
+{
+    if (nonce) {
+        memcpy(nonce, ctx->evp.iv, AEAD_NONCE_LEN);
+    }
 
-    if (method == SALSA20 || method == CHACHA20) {
-        // Fake cipher
-        cipher = (cipher_kt_t *)&cipher_info;
-        cipher->key_len = supported_ciphers_key_size[method];
-        cipher->iv_len = supported_ciphers_iv_size[method];
-    } else {
-        cipher = (cipher_kt_t *)get_cipher_type(method);
+    ss_aead_nonce_increment(ctx->evp.iv);
+}
+
+int ss_aead_open_at(shadowsocks_t *ss, struct enc_ctx *ctx, uint8_t *nonce,
+        uint8_t *data, size_t len, const uint8_t *tag)
+{
+    int olen;
+    cipher_evp_t *evp = ctx->evp.evp;
+
+    if (!EVP_CipherInit_ex(evp, NULL, NULL, NULL, nonce, 0)
+            || !EVP_CipherUpdate(evp, data, &olen, data, (int)len)
+            || !EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_LEN,
+                (void *)tag)
+            || EVP_CipherFinal_ex(evp, data + olen, &olen) <= 0) {
+        return -1;
     }
 
-    if (cipher == NULL) {
-        do {
-            LOGE("Cipher %s not found in crypto library",
-                    supported_ciphers[method]);
-            FATAL("Cannot initialize cipher");
-        } while (0);
+    ss_aead_nonce_increment(nonce);
+    return 0;
+}
+
+static int enc_key_init(shadowsocks_t *ss, int method, const char *pass)
+{
+    if (method <= TABLE || method >= CIPHER_NUM) {
+        LOGE("enc_key_init(): Illegal method");
+        return -1;
     }
 
-    const digest_type_t *md = get_digest_type("MD5");
-    if (md == NULL) {
-        FATAL("MD5 Digest not found in crypto library");
+    int key_len, iv_len;
+    const cipher_kt_t *cipher;
+
+    if (IS_SODIUM_METHOD(method) || IS_AEAD_METHOD(method)) {
+        if (IS_AEAD_METHOD(method) && get_cipher_type(method) == NULL) {
+            LOGE("Cipher %s not found in crypto library",
+                    supported_ciphers[method]);
+            return -1;
+        }
+        key_len = supported_ciphers_key_size[method];
+        iv_len = supported_ciphers_iv_size[method];
+    } else {
+        cipher = get_cipher_type(method);
+        if (cipher == NULL) {
+            LOGE("Cipher %s not found in crypto library",
+                    supported_ciphers[method]);
+            return -1;
+        }
+        key_len = EVP_CIPHER_key_length(cipher);
+        iv_len = cipher_iv_size(cipher);
     }
 
-    ss->enc_key_len = bytes_to_key(cipher, md, (const uint8_t *)pass, ss->enc_key, iv);
+    ss->enc_key_len = bytes_to_key((const uint8_t *)pass, ss->enc_key, key_len);
     if (ss->enc_key_len == 0) {
-        FATAL("Cannot generate key and IV");
+        LOGE("Cannot generate key and IV");
+        return -1;
     }
     if (method == RC4_MD5) {
         ss->enc_iv_len = 16;
     } else {
-        ss->enc_iv_len = cipher_iv_size(cipher);
+        ss->enc_iv_len = iv_len;
     }
     ss->enc_method = method;
+
+    if (IS_SODIUM_METHOD(method)) {
+        return 0;
+    }
+
+    ss->evp_template[0] = cipher_template_new(ss, method, 0);
+    ss->evp_template[1] = cipher_template_new(ss, method, 1);
+    if (ss->evp_template[0] == NULL || ss->evp_template[1] == NULL) {
+        enc_release(ss);
+        return -1;
+    }
+    return 0;
+}
+
+int enc_method(const char *method)
+{
+    int m;
+
+    for (m = TABLE; m < CIPHER_NUM; m++) {
+        if (strcmp(method, supported_ciphers[m]) == 0) {
+            return m;
+        }
+    }
+    return NONE;
 }
 
 int enc_init(shadowsocks_t *ss, const char *pass, const char *method)
 {
     int m = TABLE;
     if (method != NULL) {
-        for (m = TABLE; m < CIPHER_NUM; m++) {
-            if (strcmp(method, supported_ciphers[m]) == 0) {
-                break;
-            }
-        }
-        if (m >= CIPHER_NUM) {
+        m = enc_method(method);
+        if (m == NONE) {
             LOGE("Invalid cipher name: %s, use table instead", method);
             m = TABLE;
         }
     }
     if (m == TABLE) {
+        ss->enc_method = TABLE;
+        ss->enc_iv_len = 0;
         enc_table_init(ss, pass);
-    } else {
-        enc_key_init(ss, m, pass);
+    } else if (enc_key_init(ss, m, pass) != 0) {
+        return NONE;
     }
     return m;
 }
 
+int enc_user_init(shadowsocks_t *ss, const shadowsocks_t *server,
+        const char *pass)
+{
+    *ss = *server;
+    ss->enc_key_len = bytes_to_key((const uint8_t *)pass, ss->enc_key,
+            server->enc_key_len);
+    return ss->enc_key_len == 0 ? -1 : 0;
+}
+
+void enc_release(shadowsocks_t *ss)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (ss->evp_template[i] != NULL) {
+            EVP_CIPHER_CTX_free(ss->evp_template[i]);
+            ss->evp_template[i] = NULL;
+        }
+    }
+}
+
+
+void ss_salt_hash_init(uint8_t *key)
+{
+    rand_bytes(key, SS_SALT_HASH_KEYBYTES);
+}
+
+void ss_salt_hash(const uint8_t *key, const uint8_t *salt, size_t len,
+        uint64_t *h)
+{
+    uint8_t out[crypto_shorthash_siphashx24_BYTES];
+
+    crypto_shorthash_siphashx24(out, salt, len, key);
+    memcpy(h, out, 2 * sizeof(uint64_t));
+}
+
 
 int global_init(void)
 {
     /** 如果这两种method，需要初始化sodium
      * method == SALSA20 || method == CHACHA20 **/
     if (sodium_init() == -1) {
-        FATAL("Failed to initialize sodium");
+        LOGE("Failed to initialize sodium");
+        return -1;
+    }
+
+#if (NGX_HAVE_AVX512VBMI)
+    if (__builtin_cpu_supports("avx512vbmi")) {
+        table_crypt = table_crypt_vbmi;
     }
+#endif
+
     return 0;
 }
 
@@ -35,12 +35,12 @@ typedef EVP_MD digest_type_t;
 #define MAX_MD_SIZE EVP_MAX_MD_SIZE
 
 typedef struct {
-    cipher_evp_t evp;
+    cipher_evp_t *evp;
     uint8_t iv[MAX_IV_LENGTH];
 } cipher_ctx_t;
 
 #define SODIUM_BLOCK_SIZE   64
-#define CIPHER_NUM          17
+#define CIPHER_NUM          21
 
 #define NONE                -1
 #define TABLE               0
@@ -60,6 +60,29 @@ typedef struct {
 #define SEED_CFB            14
 #define SALSA20             15
 #define CHACHA20            16
+#define AES_128_GCM         17
+#define AES_192_GCM         18
+#define AES_256_GCM         19
+#define CHACHA20_IETF_POLY1305 20
+
+#define IS_SODIUM_METHOD(m) ((m) == SALSA20 || (m) == CHACHA20)
+#define IS_AEAD_METHOD(m)   ((m) >= AES_128_GCM && (m) < CIPHER_NUM)
+
+/**
+ * AEAD(SIP004)的数据按chunk传输:
+ *
+ *     +--------------+------------+--------------+------------+
+ *     | enc(len) (2) | tag (16)   | enc(payload) | tag (16)   |
+ *     +--------------+------------+--------------+------------+
+ *
+ * len为大端, 最大0x3FFF; 每次加解密后nonce(12字节, 小端计数)加一
+ **/
+#define AEAD_TAG_LEN        16
+#define AEAD_NONCE_LEN      12
+#define AEAD_LEN_LEN        2
+#define AEAD_CHUNK_HDR_LEN  (AEAD_LEN_LEN + AEAD_TAG_LEN)
+#define AEAD_MAX_PAYLOAD    0x3FFF
+#define AEAD_MAX_CHUNK      (AEAD_CHUNK_HDR_LEN + AEAD_MAX_PAYLOAD + AEAD_TAG_LEN)
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #define max(a, b) (((a) > (b)) ? (a) : (b))
@@ -78,17 +101,73 @@ struct enc_ctx {
     uint8_t init;
     uint64_t counter;
     cipher_ctx_t evp;
+    uint8_t keystream[SODIUM_BLOCK_SIZE];   /* salsa20/chacha20: 当前不完整块的keystream */
 };
 
 typedef struct _shadowsocks_s shadowsocks_t;
 
-void enc_ctx_init(shadowsocks_t *ss, int method, struct enc_ctx *ctx, int enc);
+int enc_ctx_init(shadowsocks_t *ss, int method, struct enc_ctx *ctx, int enc);
+
+/**
+ * 清除IV和计数器, 保留已设置密钥的cipher, 以便给下一个连接重用;
+ * rc4从模板重新复制, 失败返回-1, 此时上下文不能再重用
+ **/
+int enc_ctx_reset(shadowsocks_t *ss, struct enc_ctx *ctx, int enc);
+/**
+ * 设置IV(AEAD为salt并派生子密钥), enc时随机生成IV写入iv
+ * 失败返回-1, 此时上下文不可用, 会话必须终止
+ **/
+int enc_ctx_set_iv(shadowsocks_t *ss, struct enc_ctx *ctx, uint8_t *iv, int enc);
 void cipher_context_release(shadowsocks_t *ss, cipher_ctx_t *ctx);
 
-char * ss_encrypt(shadowsocks_t *ss, int buf_size, char *plaintext,
-        ssize_t *len, struct enc_ctx *ctx);
-char * ss_decrypt(shadowsocks_t *ss, int buf_size, char *ciphertext,
-        ssize_t *len, struct enc_ctx *ctx);
+/**
+ * 加解密[in, in + len), 仅限流式加密算法和table(密文与明文等长):
+ *     in落在out的[pos, last)之内: 原地处理, out不变
+ *     否则: 结果追加到out->last之后, out由调用者从连接的pool中分配
+ * 不使用任何静态缓冲区, 可以在线程池中调用
+ **/
+ngx_int_t ss_crypt_buf(shadowsocks_t *ss, struct enc_ctx *ctx, u_char *in,
+        size_t len, ngx_buf_t *out, int enc);
+
+/**
+ * 第一次加密前生成IV(AEAD为salt)并追加到out中;
+ * 第一次解密前从in->pos读取IV, 数据不够时返回NGX_AGAIN
+ **/
+ngx_int_t ss_write_iv(shadowsocks_t *ss, struct enc_ctx *ctx, ngx_buf_t *out);
+ngx_int_t ss_read_iv(shadowsocks_t *ss, struct enc_ctx *ctx, ngx_buf_t *in);
+
+/**
+ * AEAD: 原地加密len字节并把tag写到tag中 / 校验tag并原地解密,
+ * 调用前需先用ss_write_iv/ss_read_iv设置salt, 成功返回0
+ **/
+int ss_aead_seal(shadowsocks_t *ss, struct enc_ctx *ctx, uint8_t *data,
+        size_t len, uint8_t *tag);
+int ss_aead_open(shadowsocks_t *ss, struct enc_ctx *ctx, uint8_t *data,
+        size_t len, const uint8_t *tag);
+
+/**
+ * AEAD: 只校验tag, 不修改数据也不推进nonce, 用于多用户时试探密钥
+ **/
+int ss_aead_verify(shadowsocks_t *ss, struct enc_ctx *ctx,
+        const uint8_t *data, size_t len, const uint8_t *tag);
+
+/**
+ * AEAD: 解密分两步, 供线程池使用:
+ *     ss_aead_reserve: 在worker中为稍后解密的payload保留ctx当前的nonce
+ *                      (nonce为NULL时只跳过), ctx的nonce加一
+ *     ss_aead_open_at: 用保留的nonce原地解密, 成功后nonce加一;
+ *                      不修改ctx的nonce, 只使用它的EVP上下文
+ **/
+void ss_aead_reserve(struct enc_ctx *ctx, uint8_t *nonce);
+int ss_aead_open_at(shadowsocks_t *ss, struct enc_ctx *ctx, uint8_t *nonce,
+        uint8_t *data, size_t len, const uint8_t *tag);
+void ss_aead_nonce_increment(uint8_t *nonce);
+
+/**
+ * AEAD UDP包: 地址头和payload不在同一块内存中, 作为一条消息原地加密
+ **/
+int ss_aead_seal_udp(shadowsocks_t *ss, struct enc_ctx *ctx, uint8_t *hdr,
+        size_t hlen, uint8_t *data, size_t len, uint8_t *tag);
 
 /*************************************************************************/
 /**   Server相关的结构&函数                                             **/
@@ -98,14 +177,38 @@ struct _shadowsocks_s {
     uint8_t dec_table[256];
     uint8_t enc_key[MAX_KEY_LENGTH];
     int enc_key_len;
-    int enc_iv_len;
+    int enc_iv_len;                 /* AEAD: salt的长度 */
     int enc_method;
+    cipher_evp_t *evp_template[2];  /* 已设置密钥的cipher, [0]解密 [1]加密 */
 };
 
+int enc_method(const char *method);
+
+/**
+ * 在配置阶段调用: 生成密钥和cipher模板, 失败(如OpenSSL不支持该算法)返回NONE
+ **/
 int enc_init(shadowsocks_t *ss, const char *pass, const char *method);
 
+/**
+ * 多用户: 复制server已初始化的method和cipher模板, 只换成用户自己的密钥.
+ * 模板仍属于server, 不能对用户的ss调用enc_release; 仅用于AEAD,
+ * 其模板不含密钥
+ **/
+int enc_user_init(shadowsocks_t *ss, const shadowsocks_t *server,
+        const char *pass);
+void enc_release(shadowsocks_t *ss);
+
 /*************************************************************************/
 /**   全局相关的结构&函数                                               **/
 /*************************************************************************/
 int global_init(void);
 
+/**
+ * 重放检查: 对salt(IV)做keyed hash(128位的SipHash-2-4), 避免客户端
+ * 构造集中在bloom filter同一块上的salt; key由ss_salt_hash_init随机生成
+ **/
+#define SS_SALT_HASH_KEYBYTES   16
+void ss_salt_hash_init(uint8_t *key);
+void ss_salt_hash(const uint8_t *key, const uint8_t *salt, size_t len,
+        uint64_t *h);
+
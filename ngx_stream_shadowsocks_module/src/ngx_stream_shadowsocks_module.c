@@ -1,9 +1,11 @@
-
-
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_stream.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 #include <openssl/evp.h>
 
 #include "ngx_stream_shadowsocks_encrypt.h"
@@ -11,14 +13,160 @@
 /**********************************/
 /***  Definitions                **/
 /**********************************/
+#define NGX_STREAM_SHADOWSOCKS_ATYP_IPV4    0x01
+#define NGX_STREAM_SHADOWSOCKS_ATYP_DOMAIN  0x03
+#define NGX_STREAM_SHADOWSOCKS_ATYP_IPV6    0x04
+#define NGX_STREAM_SHADOWSOCKS_ATYP_MASK    0x0f
+#define NGX_STREAM_SHADOWSOCKS_ONETIMEAUTH  0x10
+
+/* c->buffered: 数据在线程池中加解密或排队等待 */
+#define NGX_STREAM_SHADOWSOCKS_BUFFERED     0x20
+
+/**
+ * 一个连接的加解密上下文, 连接结束后放回所属server的freelist(每个worker一份),
+ * 下个连接直接重用其中已设置好密钥的EVP_CIPHER_CTX
+ **/
+typedef struct _ngx_stream_shadowsocks_cipher_s ngx_stream_shadowsocks_cipher_t;
+
+struct _ngx_stream_shadowsocks_cipher_s {
+    struct enc_ctx encrypt;
+    struct enc_ctx decrypt;
+    ngx_stream_shadowsocks_cipher_t *next;
+};
+
+/**
+ * 共享内存中每个用户的计数器, 以用户名为key, reload之后继续累加
+ **/
+typedef struct _ngx_stream_shadowsocks_user_node_s {
+    ngx_str_node_t sn;
+    ngx_atomic_t sessions;
+    ngx_atomic_t received;          /* bytes from client */
+    ngx_atomic_t sent;              /* bytes to client */
+} ngx_stream_shadowsocks_user_node_t;
+
+typedef struct _ngx_stream_shadowsocks_user_s {
+    ngx_str_t name;
+    ngx_str_t password;
+    shadowsocks_t ss;               /* 用户的密钥, cipher模板属于server */
+    ngx_stream_shadowsocks_user_node_t *node;
+} ngx_stream_shadowsocks_user_t;
+
+/**
+ * 来源地址 -> 该地址上次匹配的用户, 每个worker一份, 冲突时直接覆盖
+ **/
+#define NGX_STREAM_SHADOWSOCKS_PEER_CACHE   4096
+
+typedef struct _ngx_stream_shadowsocks_peer_s {
+    uint32_t hash;
+    ngx_uint_t user;                /* index in users + 1, 0: empty */
+} ngx_stream_shadowsocks_peer_t;
+
+/**
+ * 防重放: 共享内存中的一对bloom filter, 记录最近见过的salt(IV)
+ **/
+#define NGX_STREAM_SHADOWSOCKS_REPLAY_BLOCK    64      /* one cache line */
+#define NGX_STREAM_SHADOWSOCKS_REPLAY_HASHES   7       /* 7 x 9 bits of h[0] */
+#define NGX_STREAM_SHADOWSOCKS_REPLAY_WORD     (8 * sizeof(ngx_atomic_uint_t))
+
+typedef struct _ngx_stream_shadowsocks_replay_s {
+    ngx_atomic_t current;           /* 正在插入的filter */
+    ngx_atomic_t count;             /* current中的salt数 */
+    ngx_atomic_t rotating;
+    ngx_uint_t blocks;              /* 每个filter的块数 */
+    ngx_uint_t capacity;            /* current插满这么多个后轮换 */
+    ngx_atomic_t *bits[2];
+    u_char key[SS_SALT_HASH_KEYBYTES];
+} ngx_stream_shadowsocks_replay_t;
+
+typedef struct _ngx_stream_shadowsocks_main_conf_s {
+    ngx_shm_zone_t *replay_zone;
+    ngx_stream_shadowsocks_replay_t *replay;
+} ngx_stream_shadowsocks_main_conf_t;
+
 typedef struct _ngx_stream_shadowsocks_srv_conf_s {
     ngx_flag_t shadowsocks;
     ngx_str_t method;
     ngx_str_t password;
+    shadowsocks_t ss;
+    ngx_stream_shadowsocks_cipher_t *free_ciphers;
+    ngx_uint_t nfree_ciphers;       /* free_ciphers的长度 */
+    ngx_array_t *users;             /* ngx_stream_shadowsocks_user_t */
+    ngx_stream_shadowsocks_peer_t *peers;
+    ngx_shm_zone_t *shm_zone;       /* shadowsocks_users */
+#if (NGX_THREADS)
+    ngx_thread_pool_t *thread_pool;
+    size_t thread_threshold;        /* 小于这个大小的数据直接加解密 */
+#endif
 } ngx_stream_shadowsocks_srv_conf_t;
 
+/**
+ * AEAD一个方向上的分帧状态
+ **/
+typedef struct _ngx_stream_shadowsocks_frame_s {
+    ngx_chain_t *free;
+    ngx_chain_t *busy;
+    ngx_buf_t *hold;                /* 保存不完整chunk的proxy buffer */
+    size_t need;                    /* 当前chunk的总长度, 0表示长度未解出 */
+} ngx_stream_shadowsocks_frame_t;
+
+#if (NGX_THREADS)
+
+/**
+ * 一个方向上交给线程池的加解密任务, 同时只有一个在进行, 保证顺序.
+ * 数据先拷进job自己的内存(AEAD顺便分好chunk), 在线程中原地加解密,
+ * 完成后这块内存直接交给write filter发送; 会话在任务完成之前结束时,
+ * job和cipher由完成回调释放.
+ * AEAD解密时最后不完整的chunk(rest)留在这块内存中, 拼在下一个任务之前
+ **/
+typedef struct _ngx_stream_shadowsocks_job_s ngx_stream_shadowsocks_job_t;
+
+struct _ngx_stream_shadowsocks_job_s {
+    ngx_thread_task_t task;
+    shadowsocks_t *ss;
+    struct enc_ctx *ec;
+    ngx_stream_shadowsocks_srv_conf_t *conf;
+    ngx_stream_shadowsocks_cipher_t *cipher;    /* orphan: 由job释放 */
+    ngx_stream_shadowsocks_job_t *sibling;      /* orphan: 另一个方向的job */
+    ngx_connection_t *dst;
+    ngx_buf_t buf;
+    ngx_chain_t out;
+    ngx_chain_t *in;                /* 等待前一个任务的数据 */
+    ngx_chain_t **last;
+    ngx_int_t rc;
+    u_char *rest;                   /* AEAD解密: 不完整的chunk */
+    size_t nrest;
+    size_t need;                    /* rest的chunk总长度, 0表示长度未解出 */
+    u_char nonce[AEAD_NONCE_LEN];   /* 第一个payload的nonce */
+    unsigned enc:1;
+    unsigned aead:1;
+    unsigned running:1;
+    unsigned done:1;
+    unsigned orphan:1;
+};
+
+#endif
+
 typedef struct _ngx_stream_shadowsocks_ctx_s {
-    EVP_CIPHER_CTX *cipher;
+    shadowsocks_t *ss;
+    ngx_stream_shadowsocks_srv_conf_t *conf;
+    ngx_stream_shadowsocks_cipher_t *cipher;
+    ngx_stream_shadowsocks_user_t *user;
+    struct enc_ctx *encrypt;        /* upstream -> client */
+    struct enc_ctx *decrypt;        /* client -> upstream */
+    ngx_stream_shadowsocks_frame_t encrypt_frame;
+    ngx_stream_shadowsocks_frame_t decrypt_frame;
+    u_char *pos;                    /* preread: first byte not yet decrypted */
+    u_char *plain;                  /* preread: end of decrypted payload */
+    u_char *iv;                     /* 客户端的IV(salt), 在c->buffer中 */
+    ngx_buf_t *stash;               /* 放不进proxy buffer的不完整chunk */
+    ngx_str_t header;               /* udp: 请求中的地址头(明文), 回包时附加 */
+    ngx_str_t addr;
+    ngx_str_t port;
+    unsigned relay:1;               /* address header has been parsed */
+    unsigned stashing:1;            /* stash中有待补齐的chunk */
+#if (NGX_THREADS)
+    ngx_stream_shadowsocks_job_t *job[2];       /* [from_upstream] */
+#endif
 } ngx_stream_shadowsocks_ctx_t;
 
 
@@ -26,55 +174,95 @@ static ngx_int_t ngx_stream_shadowsocks_addr_variable(ngx_stream_session_t *s,
         ngx_stream_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_stream_shadowsocks_port_variable(ngx_stream_session_t *s,
         ngx_stream_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_stream_shadowsocks_user_variable(ngx_stream_session_t *s,
+        ngx_stream_variable_value_t *v, uintptr_t data);
+
+static char * ngx_stream_shadowsocks_user(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char * ngx_stream_shadowsocks_users(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static ngx_int_t ngx_stream_shadowsocks_init_zone(ngx_shm_zone_t *shm_zone,
+        void *data);
 
 static ngx_int_t ngx_stream_shadowsocks_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_stream_shadowsocks_init_post_config(ngx_conf_t *cf);
+static void * ngx_stream_shadowsocks_create_main_conf(ngx_conf_t *cf);
+static char * ngx_stream_shadowsocks_replay_filter(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_stream_shadowsocks_init_replay_zone(
+        ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_stream_shadowsocks_replay_check(
+        ngx_stream_shadowsocks_replay_t *rp, u_char *salt, size_t len);
 static void * ngx_stream_shadowsocks_create_srv_conf(ngx_conf_t *cf);
-
-static ngx_int_t ngx_stream_shadowsocks_content_handler(ngx_stream_session_t *s);
-static void ngx_stream_shadowsocks_read_handler(ngx_event_t *ev);
-
-/**********************************/
-/***  Show HexCode               **/
-/**********************************/
-static void show_line(const uint8_t *data, size_t len)
-{
-    size_t i;
-    char line[BUFSIZ];
-
-    for (i = 0; i < len; i ++) {
-        sprintf(line + (i*3), " %02X", data[i]);
-        //printf(" %02X", data[i]);
-    }
-    for (; i < 16; i ++) {
-        sprintf(line + (i*3), "   ");
-        //printf("   ");
-    }
-    sprintf(line+ (16*3), "%s", "    ");
-    //printf("\t");
-
-    for (i = 0; i < len; i ++) {
-        if (data[i] >= ' ' && data[i] < 128) {
-            sprintf(line + 52 + i, "%c", data[i]);
-            //printf("%c", data[i]);
-        } else {
-            sprintf(line + 52 + i, "%c", '.');
-        }
-    }
-
-    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "%s", line);
-}
-
-void show_hex(const void *data, size_t len)
-{
-    const uint8_t *t = (uint8_t*)data;
-    while (len > 16) {
-        show_line(t, 16);
-        t += 16;
-        len -= 16;
-    }
-    show_line(t, len);
-}
+static char * ngx_stream_shadowsocks_merge_srv_conf(ngx_conf_t *cf,
+        void *parent, void *child);
+static void ngx_stream_shadowsocks_release_conf(void *data);
+static ngx_int_t ngx_stream_shadowsocks_init_module(ngx_cycle_t *cycle);
+
+static ngx_int_t ngx_stream_shadowsocks_preread_handler(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_shadowsocks_log_handler(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_shadowsocks_identify(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *b);
+static ngx_int_t ngx_stream_shadowsocks_preread_aead(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *b);
+static ngx_int_t ngx_stream_shadowsocks_preread_udp(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *b);
+static ngx_int_t ngx_stream_shadowsocks_parse_header(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, u_char **pos, u_char *last);
+static ngx_int_t ngx_stream_shadowsocks_open_chunk(
+        ngx_stream_shadowsocks_ctx_t *ctx, u_char *p, u_char *last,
+        size_t *len);
+static ngx_int_t ngx_stream_shadowsocks_filter(ngx_stream_session_t *s,
+        ngx_chain_t *in, ngx_uint_t from_upstream);
+static ngx_int_t ngx_stream_shadowsocks_tcp_filter(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_chain_t *in,
+        ngx_uint_t from_upstream);
+static ngx_int_t ngx_stream_shadowsocks_aead_filter(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_chain_t *in,
+        ngx_uint_t from_upstream);
+static ngx_int_t ngx_stream_shadowsocks_udp_filter(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_chain_t *in);
+static ngx_int_t ngx_stream_shadowsocks_aead_encrypt(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *buf, ngx_chain_t ***ll);
+static ngx_int_t ngx_stream_shadowsocks_aead_decrypt(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *b, ngx_buf_t *buf,
+        ngx_chain_t ***ll);
+static ngx_int_t ngx_stream_shadowsocks_aead_unstash(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *buf, ngx_chain_t ***ll);
+static ngx_int_t ngx_stream_shadowsocks_aead_compact(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *b);
+static ngx_chain_t * ngx_stream_shadowsocks_get_buf(ngx_pool_t *pool,
+        ngx_stream_shadowsocks_frame_t *fr, size_t size);
+static ngx_int_t ngx_stream_shadowsocks_append_buf(ngx_pool_t *pool,
+        ngx_chain_t ***ll, ngx_buf_t *b);
+static ngx_int_t ngx_stream_shadowsocks_prepend_iv(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_chain_t **in);
+static ngx_stream_shadowsocks_cipher_t * ngx_stream_shadowsocks_get_cipher(
+        ngx_stream_shadowsocks_srv_conf_t *sscf, ngx_log_t *log);
+static void ngx_stream_shadowsocks_free_cipher(shadowsocks_t *ss,
+        ngx_stream_shadowsocks_cipher_t *cp);
+static void ngx_stream_shadowsocks_cleanup(void *data);
+
+#if (NGX_THREADS)
+static char * ngx_stream_shadowsocks_thread_pool(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_stream_shadowsocks_thread_filter(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_chain_t *in,
+        ngx_uint_t from_upstream);
+static size_t ngx_stream_shadowsocks_job_size(ngx_chain_t *in, ngx_buf_t *b,
+        struct enc_ctx *ec);
+static ngx_int_t ngx_stream_shadowsocks_job_post(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_stream_shadowsocks_job_t *job,
+        ngx_chain_t *in, size_t size);
+static ngx_int_t ngx_stream_shadowsocks_job_frame(
+        ngx_stream_shadowsocks_job_t *job);
+static void ngx_stream_shadowsocks_job_thread(void *data, ngx_log_t *log);
+static void ngx_stream_shadowsocks_job_done(ngx_event_t *ev);
+static void ngx_stream_shadowsocks_job_free(ngx_stream_shadowsocks_job_t *job);
+#endif
+
+
+static ngx_stream_filter_pt  ngx_stream_next_filter;
 
 /**********************************/
 /**********************************/
@@ -87,28 +275,55 @@ static ngx_command_t  ngx_stream_shadowsocks_commands[] = {
         offsetof(ngx_stream_shadowsocks_srv_conf_t, shadowsocks),
         NULL},
     { ngx_string("shadowsocks_method"),
-        NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+        NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
         ngx_conf_set_str_slot,
         NGX_STREAM_SRV_CONF_OFFSET,
         offsetof(ngx_stream_shadowsocks_srv_conf_t, method),
         NULL},
     { ngx_string("shadowsocks_password"),
-        NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+        NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
         ngx_conf_set_str_slot,
         NGX_STREAM_SRV_CONF_OFFSET,
         offsetof(ngx_stream_shadowsocks_srv_conf_t, password),
         NULL},
+    { ngx_string("shadowsocks_user"),
+        NGX_STREAM_SRV_CONF|NGX_CONF_TAKE2,
+        ngx_stream_shadowsocks_user,
+        NGX_STREAM_SRV_CONF_OFFSET,
+        0,
+        NULL},
+    { ngx_string("shadowsocks_users"),
+        NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+        ngx_stream_shadowsocks_users,
+        NGX_STREAM_SRV_CONF_OFFSET,
+        0,
+        NULL},
+    { ngx_string("shadowsocks_replay_filter"),
+        NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+        ngx_stream_shadowsocks_replay_filter,
+        NGX_STREAM_MAIN_CONF_OFFSET,
+        0,
+        NULL},
+#if (NGX_THREADS)
+    { ngx_string("shadowsocks_thread_pool"),
+        NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE12,
+        ngx_stream_shadowsocks_thread_pool,
+        NGX_STREAM_SRV_CONF_OFFSET,
+        0,
+        NULL},
+#endif
+    ngx_null_command
 };
 
 static ngx_stream_module_t ngx_stream_shadowsocks_module_ctx = {
     ngx_stream_shadowsocks_add_variables,/* preconfiguration */
     ngx_stream_shadowsocks_init_post_config,/* postconfiguration */
 
-    NULL,                           /* create main configuration */
+    ngx_stream_shadowsocks_create_main_conf,/* create main configuration */
     NULL,                           /* init main configuration */
 
     ngx_stream_shadowsocks_create_srv_conf,/* create server configuration */
-    NULL,                           /* merge server configuration */
+    ngx_stream_shadowsocks_merge_srv_conf,/* merge server configuration */
 };
 
 
@@ -118,7 +333,7 @@ ngx_module_t ngx_stream_shadowsocks_module = {
     ngx_stream_shadowsocks_commands,    /* module directives */
     NGX_STREAM_MODULE,                  /* module type */
     NULL,                               /* init master */
-    NULL,                               /* init module */
+    ngx_stream_shadowsocks_init_module, /* init module */
     NULL,                               /* init process */
     NULL,                               /* init thread */
     NULL,                               /* exit thread */
@@ -137,24 +352,204 @@ static ngx_stream_variable_t  ngx_stream_shadowsocks_vars[] = {
         ngx_stream_shadowsocks_port_variable, 0,
         NGX_STREAM_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("shadowsocks_user"), NULL,
+        ngx_stream_shadowsocks_user_variable, 0,
+        NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
     { ngx_null_string, NULL, NULL, 0, 0, 0 }
 };
 
 static ngx_int_t ngx_stream_shadowsocks_addr_variable(ngx_stream_session_t *s,
         ngx_stream_variable_value_t *v, uintptr_t data)
 {
-    v->valid = 0;
-    v->no_cacheable = 1;
-    v->not_found = 1;
+    ngx_stream_shadowsocks_ctx_t *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_shadowsocks_module);
+    if (ctx == NULL || !ctx->relay) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = ctx->addr.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ctx->addr.data;
     return NGX_OK;
 }
 
 static ngx_int_t ngx_stream_shadowsocks_port_variable(ngx_stream_session_t *s,
         ngx_stream_variable_value_t *v, uintptr_t data)
 {
-    v->valid = 0;
-    v->no_cacheable = 1;
-    v->not_found = 1;
+    ngx_stream_shadowsocks_ctx_t *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_shadowsocks_module);
+    if (ctx == NULL || !ctx->relay) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = ctx->port.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ctx->port.data;
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_stream_shadowsocks_user_variable(ngx_stream_session_t *s,
+        ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    ngx_stream_shadowsocks_ctx_t *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_shadowsocks_module);
+    if (ctx == NULL || ctx->user == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = ctx->user->name.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ctx->user->name.data;
+    return NGX_OK;
+}
+
+
+static void * ngx_stream_shadowsocks_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_shadowsocks_main_conf_t *smcf;
+
+    if ((smcf = ngx_pcalloc(cf->pool,
+                    sizeof(ngx_stream_shadowsocks_main_conf_t))) == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     smcf->replay_zone = NULL;
+     *     smcf->replay = NULL;
+     */
+
+    return smcf;
+}
+
+
+/**
+ * shadowsocks_replay_filter size=size;
+ * 所有server和worker共用一对bloom filter
+ **/
+static char * ngx_stream_shadowsocks_replay_filter(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_shadowsocks_main_conf_t *smcf = conf;
+
+    ssize_t                             size;
+    ngx_str_t                          *value, s;
+
+    static ngx_str_t  name = ngx_string("shadowsocks_replay_filter");
+
+    if (smcf->replay_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strncmp(value[1].data, "size=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    s.data = value[1].data + 5;
+    s.len = value[1].len - 5;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "invalid size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "size \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    smcf->replay_zone = ngx_shared_memory_add(cf, &name, size,
+            &ngx_stream_shadowsocks_module);
+    if (smcf->replay_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    smcf->replay_zone->init = ngx_stream_shadowsocks_init_replay_zone;
+    smcf->replay_zone->data = smcf;
+
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * zone中除了头部之外的页全部分给两个filter, 每个filter按64字节
+ * (一个cache line)分块, 一个salt的所有bit都在同一块中
+ **/
+static ngx_int_t ngx_stream_shadowsocks_init_replay_zone(
+        ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_stream_shadowsocks_main_conf_t *osmcf = data;
+
+    size_t                              size;
+    u_char                             *p;
+    ngx_slab_pool_t                    *shpool;
+    ngx_stream_shadowsocks_replay_t    *rp;
+    ngx_stream_shadowsocks_main_conf_t *smcf;
+
+    smcf = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (osmcf || shm_zone->shm.exists) {
+        smcf->replay = shpool->data;
+        return NGX_OK;
+    }
+
+    if ((rp = ngx_slab_calloc(shpool, sizeof(ngx_stream_shadowsocks_replay_t)))
+            == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (shpool->pfree < 2) {
+        return NGX_ERROR;
+    }
+
+    rp->blocks = (shpool->pfree - 1) * ngx_pagesize
+        / (2 * NGX_STREAM_SHADOWSOCKS_REPLAY_BLOCK);
+
+    size = 2 * rp->blocks * NGX_STREAM_SHADOWSOCKS_REPLAY_BLOCK;
+
+    if ((p = ngx_slab_calloc(shpool, size)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    rp->bits[0] = (ngx_atomic_t *) p;
+    rp->bits[1] = (ngx_atomic_t *)
+        (p + rp->blocks * NGX_STREAM_SHADOWSOCKS_REPLAY_BLOCK);
+
+    /* 每个salt约占48 bit, 两个filter合计的误判率在1e-5以下 */
+    rp->capacity = rp->blocks * NGX_STREAM_SHADOWSOCKS_REPLAY_BLOCK * 8 / 48;
+
+    ss_salt_hash_init(rp->key);
+
+    shpool->data = rp;
+    smcf->replay = rp;
+
+    ngx_log_error(NGX_LOG_INFO, shm_zone->shm.log, 0,
+            "shadowsocks_replay_filter: 2 x %uz bytes, %ui salts per filter",
+            size / 2, rp->capacity);
+
     return NGX_OK;
 }
 
@@ -167,153 +562,2462 @@ static void * ngx_stream_shadowsocks_create_srv_conf(ngx_conf_t *cf)
                     sizeof(ngx_stream_shadowsocks_srv_conf_t))) == NULL) {
         return NULL;
     }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     sscf->method = { 0, NULL };
+     *     sscf->password = { 0, NULL };
+     *     sscf->ss = { 0 };
+     *     sscf->users = NULL;
+     *     sscf->shm_zone = NULL;
+     */
+
     sscf->shadowsocks = NGX_CONF_UNSET;
+#if (NGX_THREADS)
+    sscf->thread_pool = NGX_CONF_UNSET_PTR;
+    sscf->thread_threshold = NGX_CONF_UNSET_SIZE;
+#endif
     return sscf;
 }
 
 
-static ngx_int_t ngx_stream_shadowsocks_add_variables(ngx_conf_t *cf)
+static char * ngx_stream_shadowsocks_merge_srv_conf(ngx_conf_t *cf,
+        void *parent, void *child)
 {
-    ngx_stream_variable_t  *var, *v;
+    ngx_stream_shadowsocks_srv_conf_t *prev = parent;
+    ngx_stream_shadowsocks_srv_conf_t *conf = child;
+
+    size_t                             size;
+    u_char                            *password;
+    ngx_uint_t                         i;
+    ngx_pool_cleanup_t                *cln;
+    ngx_stream_core_srv_conf_t        *cscf;
+    ngx_stream_shadowsocks_user_t     *user;
+
+    ngx_conf_merge_value(conf->shadowsocks, prev->shadowsocks, 0);
+    ngx_conf_merge_str_value(conf->method, prev->method, "table");
+    ngx_conf_merge_str_value(conf->password, prev->password, "");
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+    ngx_conf_merge_size_value(conf->thread_threshold,
+            prev->thread_threshold, 16384);
+#endif
+
+    if (!conf->shadowsocks) {
+        return NGX_CONF_OK;
+    }
 
-    for (v = ngx_stream_shadowsocks_vars; v->name.len; v++) {
-        var = ngx_stream_add_variable(cf, &v->name, v->flags);
-        if (var == NULL) {
-            return NGX_ERROR;
+    if (conf->users) {
+        if (conf->password.len) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "\"shadowsocks_password\" cannot be used "
+                    "with \"shadowsocks_user\"");
+            return NGX_CONF_ERROR;
         }
 
-        var->get_handler = v->get_handler;
-        var->data = v->data;
+        /* server自己的密钥只用来生成cipher模板 */
+        user = conf->users->elts;
+        password = user[0].password.data;
+
+    } else if (conf->shm_zone) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "no \"shadowsocks_user\" is defined for "
+                "\"shadowsocks_users\"");
+        return NGX_CONF_ERROR;
+
+    } else if (conf->password.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "no \"shadowsocks_password\" is defined for server");
+        return NGX_CONF_ERROR;
+
+    } else {
+        password = conf->password.data;
     }
 
-    return NGX_OK;
+    /* 配置项的参数以'\0'结尾, 可以直接当作C字符串使用 */
+    if (enc_method((const char *) conf->method.data) == NONE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "unsupported shadowsocks method \"%V\"", &conf->method);
+        return NGX_CONF_ERROR;
+    }
+
+    /* 密钥和key schedule只在这里生成一次, 连接中复制cipher模板即可 */
+    if (enc_init(&conf->ss, (const char *) password,
+                (const char *) conf->method.data) == NONE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "cannot initialize shadowsocks method \"%V\"",
+                &conf->method);
+        return NGX_CONF_ERROR;
+    }
+
+    if ((cln = ngx_pool_cleanup_add(cf->pool, 0)) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_stream_shadowsocks_release_conf;
+    cln->data = conf;
+
+    if (conf->users) {
+        /* 只有AEAD能通过tag判断密钥是否正确 */
+        if (!IS_AEAD_METHOD(conf->ss.enc_method)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "\"shadowsocks_user\" requires an AEAD method, "
+                    "not \"%V\"", &conf->method);
+            return NGX_CONF_ERROR;
+        }
+
+        user = conf->users->elts;
+
+        for (i = 0; i < conf->users->nelts; i++) {
+            if (enc_user_init(&user[i].ss, &conf->ss,
+                        (const char *) user[i].password.data) != 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                        "cannot initialize key of shadowsocks user \"%V\"",
+                        &user[i].name);
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        if ((conf->peers = ngx_pcalloc(cf->pool,
+                        NGX_STREAM_SHADOWSOCKS_PEER_CACHE
+                        * sizeof(ngx_stream_shadowsocks_peer_t))) == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (IS_AEAD_METHOD(conf->ss.enc_method)) {
+        cscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_core_module);
+
+        /*
+         * 地址头所在的chunk必须能完整地放进preread buffer,
+         * 默认的16k放不下salt加上最大的chunk
+         */
+        size = conf->ss.enc_iv_len + AEAD_MAX_CHUNK;
+
+        if (cscf->preread_buffer_size < size) {
+            cscf->preread_buffer_size = size;
+        }
+    }
+
+    return NGX_CONF_OK;
 }
 
 
-static ngx_int_t ngx_stream_shadowsocks_init_post_config(ngx_conf_t *cf)
+static void ngx_stream_shadowsocks_release_conf(void *data)
 {
-    ngx_stream_handler_pt        *h;
-    ngx_stream_core_main_conf_t  *cmcf;
+    ngx_stream_shadowsocks_srv_conf_t *conf = data;
 
-    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+    ngx_stream_shadowsocks_cipher_t *cp;
 
-    h = ngx_array_push(&cmcf->phases[NGX_STREAM_PREREAD_PHASE].handlers);
-    if (h == NULL) {
-        return NGX_ERROR;
+    while (conf->free_ciphers) {
+        cp = conf->free_ciphers;
+        conf->free_ciphers = cp->next;
+        ngx_stream_shadowsocks_free_cipher(&conf->ss, cp);
     }
 
-    *h = ngx_stream_shadowsocks_content_handler;
-    return NGX_OK;
+    conf->nfree_ciphers = 0;
+
+    enc_release(&conf->ss);
 }
 
-static ngx_int_t ngx_stream_shadowsocks_content_handler(ngx_stream_session_t *s)
+
+static char * ngx_stream_shadowsocks_user(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf)
 {
-    ngx_stream_shadowsocks_srv_conf_t *sscf;
-    ngx_connection_t                   *c;
+    ngx_stream_shadowsocks_srv_conf_t *sscf = conf;
 
-    c = s->connection;
+    ngx_str_t                         *value;
+    ngx_uint_t                         i;
+    ngx_stream_shadowsocks_user_t     *user;
 
-    sscf = ngx_stream_get_module_srv_conf(s, ngx_stream_shadowsocks_module);
-    if (!sscf->shadowsocks) {
-        return NGX_DECLINED;
+    value = cf->args->elts;
+
+    if (value[1].len == 0 || value[2].len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "empty user name or password in \"%V\"", &cmd->name);
+        return NGX_CONF_ERROR;
     }
 
-    if (c->type != SOCK_STREAM) {
-        return NGX_DECLINED;
+    if (sscf->users == NULL) {
+        if ((sscf->users = ngx_array_create(cf->pool, 4,
+                        sizeof(ngx_stream_shadowsocks_user_t))) == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    user = sscf->users->elts;
+
+    for (i = 0; i < sscf->users->nelts; i++) {
+        if (user[i].name.len == value[1].len
+                && ngx_strncmp(user[i].name.data, value[1].data,
+                    value[1].len) == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "duplicate shadowsocks user \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if ((user = ngx_array_push(sscf->users)) == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    c->read->handler = ngx_stream_shadowsocks_read_handler;
-    c->write->handler = NULL;
+    ngx_memzero(user, sizeof(ngx_stream_shadowsocks_user_t));
 
-    ngx_add_event(c->read, NGX_READ_EVENT, 0);
+    user->name = value[1];
+    user->password = value[2];
 
-    return NGX_DONE;    // keep this connection
-    //return NGX_OK;      // do content-phase
+    return NGX_CONF_OK;
 }
 
 
-static ngx_stream_shadowsocks_ctx_t *ngx_stream_shadowsocks_new_ctx(ngx_pool_t *pool,
-        const char *key, const char *iv)
+/**
+ * shadowsocks_users zone=name:size;
+ * 每个用户的计数器放在这个共享内存中, 一个zone只能属于一个server
+ **/
+static char * ngx_stream_shadowsocks_users(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf)
 {
-    ngx_stream_shadowsocks_ctx_t *ctx;
-    if ((ctx = ngx_palloc(pool, sizeof(ngx_stream_shadowsocks_ctx_t))) == NULL) {
-        return NULL;
+    ngx_stream_shadowsocks_srv_conf_t *sscf = conf;
+
+    u_char                            *p;
+    ssize_t                            size;
+    ngx_str_t                         *value, name, s;
+
+    if (sscf->shm_zone) {
+        return "is duplicate";
     }
-    if ((ctx->cipher = EVP_CIPHER_CTX_new()) == NULL) {
-        return NULL;
+
+    value = cf->args->elts;
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "[%s:%d] key: %s, iv: %s",
-            __FUNCTION__, __LINE__, key, iv);
+    name.data = value[1].data + 5;
 
-    if (1 != EVP_DecryptInit_ex(ctx->cipher, EVP_aes_256_cfb(), NULL, key, iv)) {
-        return NULL;
+    p = (u_char *) ngx_strchr(name.data, ':');
+
+    if (p == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = p - name.data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    sscf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+            &ngx_stream_shadowsocks_module);
+    if (sscf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (sscf->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "%V \"%V\" is already used by another server",
+                &cmd->name, &name);
+        return NGX_CONF_ERROR;
     }
-    return ctx;
+
+    sscf->shm_zone->init = ngx_stream_shadowsocks_init_zone;
+    sscf->shm_zone->data = sscf;
+
+    return NGX_CONF_OK;
 }
 
-static ngx_int_t ngx_stream_shadowsocks_decrypt(ngx_stream_session_t *s, char *buff, size_t len)
+
+#if (NGX_THREADS)
+
+/**
+ * shadowsocks_thread_pool name [threshold=size] | off;
+ * 大块数据的加解密交给线程池, 线程池用thread_pool在main中定义
+ **/
+static char * ngx_stream_shadowsocks_thread_pool(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf)
 {
-    ngx_stream_shadowsocks_srv_conf_t *sscf;
-    ngx_stream_shadowsocks_ctx_t *ctx;
-    ngx_connection_t         *c;
+    ngx_stream_shadowsocks_srv_conf_t *sscf = conf;
 
-    c = s->connection;
+    ssize_t                            size;
+    ngx_str_t                         *value, s;
+
+    if (sscf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "has invalid parameter";
+        }
+
+        sscf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if ((sscf->thread_pool = ngx_thread_pool_add(cf, &value[1])) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 2) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[2].data, "threshold=", 10) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "invalid parameter \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    s.data = value[2].data + 10;
+    s.len = value[2].len - 10;
 
-    ngx_log_error(NGX_LOG_ERR, c->log, 0, "[%s:%d]", __FUNCTION__, __LINE__);
+    size = ngx_parse_size(&s);
 
-    if ((ctx = ngx_stream_get_module_ctx(s, ngx_stream_shadowsocks_module)) == NULL) {
-        sscf = ngx_stream_get_module_srv_conf(s, ngx_stream_shadowsocks_module);
-        char key[BUFSIZ];
-        char *iv = "ss-iv";
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "invalid threshold \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    sscf->thread_threshold = (size_t) size;
+
+    return NGX_CONF_OK;
+}
 
-        memset(key, 0, sizeof(key));
-        //snprintf(key, sscf->password.len+1, "%s", sscf->password.data);
-        memcpy(key, sscf->password.data, sscf->password.len);
+#endif
 
-        ngx_log_error(NGX_LOG_ERR, c->log, 0, "[%s:%d] password %V",
-                __FUNCTION__, __LINE__, &sscf->password);
 
-        if ((ctx = ngx_stream_shadowsocks_new_ctx(c->pool, key, iv)) == NULL) {
+/**
+ * 在master中执行, 给每个用户找到(reload时)或分配计数器,
+ * worker只对计数器做原子加, 不再修改rbtree
+ **/
+static ngx_int_t ngx_stream_shadowsocks_init_zone(ngx_shm_zone_t *shm_zone,
+        void *data)
+{
+    ngx_stream_shadowsocks_srv_conf_t  *osscf = data;
+
+    size_t                              len;
+    uint32_t                            hash;
+    ngx_uint_t                          i;
+    ngx_rbtree_t                       *rbtree;
+    ngx_slab_pool_t                    *shpool;
+    ngx_rbtree_node_t                  *sentinel;
+    ngx_stream_shadowsocks_user_t      *user;
+    ngx_stream_shadowsocks_user_node_t *node;
+    ngx_stream_shadowsocks_srv_conf_t  *sscf;
+
+    sscf = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (osscf || shm_zone->shm.exists) {
+        rbtree = shpool->data;
+
+    } else {
+        if ((rbtree = ngx_slab_alloc(shpool, sizeof(ngx_rbtree_t))) == NULL) {
             return NGX_ERROR;
         }
 
-        ngx_stream_set_ctx(s, ctx, ngx_stream_shadowsocks_module);
+        if ((sentinel = ngx_slab_alloc(shpool, sizeof(ngx_rbtree_node_t)))
+                == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(rbtree, sentinel, ngx_str_rbtree_insert_value);
+
+        shpool->data = rbtree;
+
+        len = sizeof(" in shadowsocks_users zone \"\"") + shm_zone->shm.name.len;
+
+        if ((shpool->log_ctx = ngx_slab_alloc(shpool, len)) == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_sprintf(shpool->log_ctx, " in shadowsocks_users zone \"%V\"%Z",
+                &shm_zone->shm.name);
+    }
+
+    if (sscf->users == NULL) {
+        return NGX_OK;
     }
 
-    char plaintext[BUFSIZ];
-    int plaintext_len;
+    user = sscf->users->elts;
 
-    if(1 != EVP_DecryptUpdate(ctx->cipher, plaintext, &plaintext_len, buff, len)) {
-        return NGX_ERROR;
+    for (i = 0; i < sscf->users->nelts; i++) {
+        hash = ngx_crc32_short(user[i].name.data, user[i].name.len);
+
+        node = (ngx_stream_shadowsocks_user_node_t *)
+            ngx_str_rbtree_lookup(rbtree, &user[i].name, hash);
+
+        if (node == NULL) {
+            if ((node = ngx_slab_calloc(shpool,
+                            sizeof(ngx_stream_shadowsocks_user_node_t)
+                            + user[i].name.len)) == NULL) {
+                ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                        "could not allocate user \"%V\" "
+                        "in shadowsocks_users zone \"%V\"",
+                        &user[i].name, &shm_zone->shm.name);
+                return NGX_ERROR;
+            }
+
+            node->sn.str.len = user[i].name.len;
+            node->sn.str.data = (u_char *) node
+                + sizeof(ngx_stream_shadowsocks_user_node_t);
+            ngx_memcpy(node->sn.str.data, user[i].name.data,
+                    user[i].name.len);
+
+            node->sn.node.key = hash;
+
+            ngx_rbtree_insert(rbtree, &node->sn.node);
+        }
+
+        user[i].node = node;
     }
-    show_hex(plaintext, plaintext_len);
+
     return NGX_OK;
 }
 
 
-static void ngx_stream_shadowsocks_read_handler(ngx_event_t *ev)
+static ngx_int_t ngx_stream_shadowsocks_init_module(ngx_cycle_t *cycle)
 {
-    char buff[BUFSIZ];
-    int ret;
+    return global_init() == 0 ? NGX_OK : NGX_ERROR;
+}
 
-    ngx_connection_t *c = ev->data;
-    ngx_stream_session_t  *s = c->data;
 
-    ngx_log_error(NGX_LOG_ERR, ev->log, 0, "[%s:%d]", __FUNCTION__, __LINE__);
+static ngx_int_t ngx_stream_shadowsocks_add_variables(ngx_conf_t *cf)
+{
+    ngx_stream_variable_t  *var, *v;
 
-    while (1) {
-        if ((ret = read(c->fd, buff, BUFSIZ)) <= 0) {
-            if (ret < 0 && errno == EAGAIN) {
-                return;
-            }
-            ngx_stream_finalize_session(s, NGX_STREAM_BAD_REQUEST);
-            return;
+    for (v = ngx_stream_shadowsocks_vars; v->name.len; v++) {
+        var = ngx_stream_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
         }
-        //ngx_log_error(NGX_LOG_ERR, ev->log, 0, "[%s:%d] %s",
-        //        __FUNCTION__, __LINE__, buff);
-        show_hex(buff, ret);
-        ngx_stream_shadowsocks_decrypt(s, buff, ret);
-    }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_stream_shadowsocks_init_post_config(ngx_conf_t *cf)
+{
+    ngx_stream_handler_pt        *h;
+    ngx_stream_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_STREAM_PREREAD_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_stream_shadowsocks_preread_handler;
+
+    h = ngx_array_push(&cmcf->phases[NGX_STREAM_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_stream_shadowsocks_log_handler;
+
+    ngx_stream_next_filter = ngx_stream_top_filter;
+    ngx_stream_top_filter = ngx_stream_shadowsocks_filter;
+
+    return NGX_OK;
+}
+
+
+/**
+ * 在preread阶段读取客户端的IV和地址头:
+ *
+ *     +------+------+----------+----------+----------+
+ *     |  IV  | ATYP | DST.ADDR | DST.PORT | payload  |
+ *     +------+------+----------+----------+----------+
+ *
+ * c->buffer中的数据原地解密, 解析出地址后c->buffer->pos指向payload,
+ * 剩余的payload由ngx_stream_proxy_module作为preread数据发往上游.
+ * AEAD方法的IV即salt, 之后是若干chunk, 见ngx_stream_shadowsocks_preread_aead;
+ * UDP的每个包自带IV和地址头, 见ngx_stream_shadowsocks_preread_udp
+ **/
+static ngx_int_t ngx_stream_shadowsocks_preread_handler(ngx_stream_session_t *s)
+{
+    ngx_int_t                           rc;
+    ngx_buf_t                          *b;
+    ngx_connection_t                   *c;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_stream_shadowsocks_ctx_t       *ctx;
+    ngx_stream_shadowsocks_srv_conf_t  *sscf;
+    ngx_stream_shadowsocks_main_conf_t *smcf;
+
+    c = s->connection;
+
+    sscf = ngx_stream_get_module_srv_conf(s, ngx_stream_shadowsocks_module);
+    if (!sscf->shadowsocks) {
+        return NGX_DECLINED;
+    }
+
+    if (c->buffer == NULL) {
+        return NGX_AGAIN;
+    }
+
+    b = c->buffer;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_shadowsocks_module);
+    if (ctx == NULL) {
+        if ((ctx = ngx_pcalloc(c->pool,
+                        sizeof(ngx_stream_shadowsocks_ctx_t))) == NULL) {
+            return NGX_ERROR;
+        }
+
+        if ((cln = ngx_pool_cleanup_add(c->pool, 0)) == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_stream_shadowsocks_cleanup;
+        cln->data = ctx;
+
+        ctx->ss = &sscf->ss;
+        ctx->conf = sscf;
+
+        if ((ctx->cipher = ngx_stream_shadowsocks_get_cipher(sscf, c->log))
+                == NULL) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                    "shadowsocks: cannot initialize cipher \"%V\"",
+                    &sscf->method);
+            return NGX_ERROR;
+        }
+
+        ctx->encrypt = &ctx->cipher->encrypt;
+        ctx->decrypt = &ctx->cipher->decrypt;
+
+        ctx->pos = b->pos;
+
+        ngx_stream_set_ctx(s, ctx, ngx_stream_shadowsocks_module);
+
+        /* 数据要在filter中加解密, proxy不能用splice直接转发 */
+        s->filter_need_in_memory = 1;
+    }
+
+    if (c->type == SOCK_DGRAM) {
+        rc = ngx_stream_shadowsocks_preread_udp(s, ctx, b);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        goto relay;
+    }
+
+    if (!ctx->decrypt->init) {
+        ctx->iv = b->pos;
+
+        if (sscf->users) {
+            rc = ngx_stream_shadowsocks_identify(s, ctx, b);
+
+            if (rc == NGX_DECLINED) {
+                ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                        "shadowsocks: no matching user, "
+                        "wrong password or method?");
+                return NGX_STREAM_BAD_REQUEST;
+            }
+
+        } else {
+            rc = ss_read_iv(ctx->ss, ctx->decrypt, b);
+        }
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        ctx->pos = b->pos;
+        ctx->plain = b->pos;
+    }
+
+    if (IS_AEAD_METHOD(ctx->ss->enc_method)) {
+        rc = ngx_stream_shadowsocks_preread_aead(s, ctx, b);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        goto relay;
+    }
+
+    if (ctx->pos < b->last) {
+        if (ss_crypt_buf(ctx->ss, ctx->decrypt, ctx->pos,
+                    b->last - ctx->pos, b, 0) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                    "shadowsocks: decrypt failed");
+            return NGX_ERROR;
+        }
+
+        ctx->pos = b->last;
+    }
+
+    rc = ngx_stream_shadowsocks_parse_header(s, ctx, &b->pos, b->last);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+relay:
+
+    smcf = ngx_stream_get_module_main_conf(s, ngx_stream_shadowsocks_module);
+
+    /* 地址头已通过校验(AEAD)才记录salt, 伪造的salt不会占用filter */
+    if (smcf->replay && ctx->ss->enc_iv_len
+            && ngx_stream_shadowsocks_replay_check(smcf->replay, ctx->iv,
+                ctx->ss->enc_iv_len) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                "shadowsocks: replayed IV (salt) from client");
+        return NGX_STREAM_BAD_REQUEST;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+            "shadowsocks: relay to %V:%V", &ctx->addr, &ctx->port);
+
+    ctx->relay = 1;
+
+    return NGX_OK;
+}
+
+
+/**
+ * 逐个解开c->buffer中完整的chunk, 把payload依次挪到salt之后拼成连续的明文,
+ * 地址头解析完后c->buffer中只留下明文(由proxy作为preread数据发出),
+ * 末尾不完整的chunk拷到ctx->stash中, 由filter补齐后再解密
+ **/
+static ngx_int_t ngx_stream_shadowsocks_preread_aead(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *b)
+{
+    u_char     *p;
+    size_t      len, n;
+    ngx_int_t   rc;
+
+    for ( ;; ) {
+        p = ctx->pos;
+
+        rc = ngx_stream_shadowsocks_open_chunk(ctx, p, b->last, &len);
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+
+        if (rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                    "shadowsocks: invalid chunk, wrong password or method?");
+            return NGX_STREAM_BAD_REQUEST;
+        }
+
+        ctx->plain = ngx_movemem(ctx->plain, p + AEAD_CHUNK_HDR_LEN, len);
+        ctx->pos = p + AEAD_CHUNK_HDR_LEN + len + AEAD_TAG_LEN;
+    }
+
+    rc = ngx_stream_shadowsocks_parse_header(s, ctx, &b->pos, ctx->plain);
+
+    if (rc == NGX_AGAIN) {
+        /* 未解密的数据挪到明文之后, 给后面的chunk腾出空间 */
+        if (ctx->pos != ctx->plain) {
+            n = b->last - ctx->pos;
+            ngx_memmove(ctx->plain, ctx->pos, n);
+            ctx->pos = ctx->plain;
+            b->last = ctx->plain + n;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    n = b->last - ctx->pos;
+
+    if (n) {
+        if ((ctx->stash = ngx_create_temp_buf(s->connection->pool,
+                        AEAD_MAX_CHUNK)) == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->stash->last = ngx_cpymem(ctx->stash->last, ctx->pos, n);
+        ctx->stashing = 1;
+    }
+
+    b->last = ctx->plain;
+
+    return NGX_OK;
+}
+
+
+/**
+ * 同时查两个filter: 上一轮的只读, 当前的用原子操作置位;
+ * 当前filter中所有bit原本就已置位, 说明salt出现过(包括别的worker
+ * 同时在插入同一个salt). 当前filter插满后清空上一轮的, 两者互换
+ **/
+static ngx_int_t ngx_stream_shadowsocks_replay_check(
+        ngx_stream_shadowsocks_replay_t *rp, u_char *salt, size_t len)
+{
+    uint64_t                            h[2];
+    ngx_uint_t                          i, bit, cur, seen, off;
+    ngx_atomic_t                       *old, *new, *w;
+    ngx_atomic_uint_t                   v, mask;
+
+    ss_salt_hash(rp->key, salt, len, h);
+
+    off = (ngx_uint_t) (h[1] % rp->blocks)
+        * (NGX_STREAM_SHADOWSOCKS_REPLAY_BLOCK / sizeof(ngx_atomic_t));
+
+    cur = rp->current;
+    old = rp->bits[cur ^ 1] + off;
+    new = rp->bits[cur] + off;
+
+    for (i = 0; i < NGX_STREAM_SHADOWSOCKS_REPLAY_HASHES; i++) {
+        bit = (ngx_uint_t) (h[0] >> (9 * i)) & 0x1ff;
+        mask = (ngx_atomic_uint_t) 1 << (bit % NGX_STREAM_SHADOWSOCKS_REPLAY_WORD);
+
+        if (!(old[bit / NGX_STREAM_SHADOWSOCKS_REPLAY_WORD] & mask)) {
+            break;
+        }
+    }
+
+    if (i == NGX_STREAM_SHADOWSOCKS_REPLAY_HASHES) {
+        return NGX_DECLINED;
+    }
+
+    seen = 1;
+
+    for (i = 0; i < NGX_STREAM_SHADOWSOCKS_REPLAY_HASHES; i++) {
+        bit = (ngx_uint_t) (h[0] >> (9 * i)) & 0x1ff;
+        mask = (ngx_atomic_uint_t) 1 << (bit % NGX_STREAM_SHADOWSOCKS_REPLAY_WORD);
+        w = &new[bit / NGX_STREAM_SHADOWSOCKS_REPLAY_WORD];
+
+        for ( ;; ) {
+            v = *w;
+
+            if (v & mask) {
+                break;
+            }
+
+            if (ngx_atomic_cmp_set(w, v, v | mask)) {
+                seen = 0;
+                break;
+            }
+        }
+    }
+
+    if (seen) {
+        return NGX_DECLINED;
+    }
+
+    if ((ngx_uint_t) ngx_atomic_fetch_add(&rp->count, 1) + 1 < rp->capacity) {
+        return NGX_OK;
+    }
+
+    /* 只有一个worker做轮换, 其他worker照常查询 */
+    if (ngx_atomic_cmp_set(&rp->rotating, 0, 1)) {
+        if (rp->count >= rp->capacity) {
+            cur = rp->current ^ 1;
+
+            ngx_memzero((void *) rp->bits[cur],
+                    rp->blocks * NGX_STREAM_SHADOWSOCKS_REPLAY_BLOCK);
+
+            rp->count = 0;
+            ngx_memory_barrier();
+            rp->current = cur;
+        }
+
+        rp->rotating = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+/**
+ * 多用户: 依次用各用户的密钥校验第一个chunk长度头的tag(UDP为整个包),
+ * 通过的即为该用户. 先试这个来源地址上次匹配的用户, 通常一次即可.
+ * 成功后b->pos指向salt之后, 解密上下文已按该用户的密钥设置好
+ **/
+static ngx_int_t ngx_stream_shadowsocks_identify(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *b)
+{
+    u_char                            *data;
+    size_t                             len, iv_len;
+    uint32_t                           hash;
+    ngx_uint_t                         i, n;
+    ngx_connection_t                  *c;
+    struct sockaddr_in                *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6               *sin6;
+#endif
+    ngx_stream_shadowsocks_peer_t     *peer;
+    ngx_stream_shadowsocks_user_t     *user;
+    ngx_stream_shadowsocks_srv_conf_t *sscf;
+
+    c = s->connection;
+    sscf = ctx->conf;
+    iv_len = sscf->ss.enc_iv_len;
+
+    if (c->type == SOCK_DGRAM) {
+        if ((size_t) (b->last - b->pos) < iv_len + AEAD_TAG_LEN) {
+            return NGX_DECLINED;
+        }
+
+        len = b->last - b->pos - iv_len - AEAD_TAG_LEN;
+
+    } else {
+        if ((size_t) (b->last - b->pos) < iv_len + AEAD_CHUNK_HDR_LEN) {
+            return NGX_AGAIN;
+        }
+
+        len = AEAD_LEN_LEN;
+    }
+
+    data = b->pos + iv_len;
+
+    switch (c->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) c->sockaddr;
+        hash = ngx_crc32_short(sin6->sin6_addr.s6_addr, 16);
+        break;
+#endif
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) c->sockaddr;
+        hash = ngx_crc32_short((u_char *) &sin->sin_addr, 4);
+        break;
+
+    default:
+        hash = 0;
+        break;
+    }
+
+    peer = &sscf->peers[hash % NGX_STREAM_SHADOWSOCKS_PEER_CACHE];
+    user = sscf->users->elts;
+    n = sscf->users->nelts;
+
+    if (peer->user && peer->hash == hash) {
+        i = peer->user - 1;
+
+        if (enc_ctx_set_iv(&user[i].ss, ctx->decrypt, b->pos, 0) != 0) {
+            return NGX_ERROR;
+        }
+
+        if (ss_aead_verify(&user[i].ss, ctx->decrypt, data, len, data + len)
+                == 0) {
+            goto found;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (i + 1 == peer->user && peer->hash == hash) {
+            continue;
+        }
+
+        if (enc_ctx_set_iv(&user[i].ss, ctx->decrypt, b->pos, 0) != 0) {
+            return NGX_ERROR;
+        }
+
+        if (ss_aead_verify(&user[i].ss, ctx->decrypt, data, len, data + len)
+                == 0) {
+            goto found;
+        }
+    }
+
+    return NGX_DECLINED;
+
+found:
+
+    peer->hash = hash;
+    peer->user = i + 1;
+
+    ctx->user = &user[i];
+    ctx->ss = &user[i].ss;
+
+    b->pos += iv_len;
+
+    if (user[i].node) {
+        (void) ngx_atomic_fetch_add(&user[i].node->sessions, 1);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+            "shadowsocks: user \"%V\"", &user[i].name);
+
+    return NGX_OK;
+}
+
+
+/**
+ * nginx为每个UDP包建立一个session, c->buffer就是整个包:
+ *
+ *     +------+------+----------+----------+----------+-----+
+ *     |  IV  | ATYP | DST.ADDR | DST.PORT | payload  | tag |
+ *     +------+------+----------+----------+----------+-----+
+ *
+ * 整个包一次解密(AEAD只有一个tag, nonce为0), 不完整的包直接丢弃.
+ * 明文的地址头留在c->buffer中, 回包时原样使用
+ **/
+static ngx_int_t ngx_stream_shadowsocks_preread_udp(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *b)
+{
+    u_char     *hdr;
+    ngx_int_t   rc;
+
+    ctx->iv = b->pos;
+
+    if (ctx->conf->users) {
+        rc = ngx_stream_shadowsocks_identify(s, ctx, b);
+
+    } else {
+        rc = ss_read_iv(ctx->ss, ctx->decrypt, b);
+    }
+
+    if (rc != NGX_OK) {
+        goto invalid;
+    }
+
+    if (IS_AEAD_METHOD(ctx->ss->enc_method)) {
+        if (b->last - b->pos < AEAD_TAG_LEN) {
+            goto invalid;
+        }
+
+        b->last -= AEAD_TAG_LEN;
+
+        if (ss_aead_open(ctx->ss, ctx->decrypt, b->pos, b->last - b->pos,
+                    b->last) != 0) {
+            goto invalid;
+        }
+
+    } else if (b->pos < b->last) {
+        if (ss_crypt_buf(ctx->ss, ctx->decrypt, b->pos, b->last - b->pos, b,
+                    0) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                    "shadowsocks: decrypt failed");
+            return NGX_ERROR;
+        }
+    }
+
+    hdr = b->pos;
+
+    rc = ngx_stream_shadowsocks_parse_header(s, ctx, &b->pos, b->last);
+    if (rc == NGX_AGAIN) {
+        goto invalid;
+    }
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ctx->header.data = hdr;
+    ctx->header.len = b->pos - hdr;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+            "shadowsocks: invalid udp packet, wrong password or method?");
+
+    return NGX_STREAM_BAD_REQUEST;
+}
+
+
+static ngx_int_t ngx_stream_shadowsocks_parse_header(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, u_char **pos, u_char *last)
+{
+    u_char     *p, *addr;
+    size_t      len, size;
+    ngx_uint_t  atyp, port;
+
+    p = *pos;
+    size = last - p;
+
+    if (size < 1) {
+        return NGX_AGAIN;
+    }
+
+    atyp = p[0];
+
+    if (atyp & NGX_STREAM_SHADOWSOCKS_ONETIMEAUTH) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                "shadowsocks: one time auth is not supported");
+        return NGX_STREAM_BAD_REQUEST;
+    }
+
+    switch (atyp & NGX_STREAM_SHADOWSOCKS_ATYP_MASK) {
+
+    case NGX_STREAM_SHADOWSOCKS_ATYP_IPV4:
+        len = 1 + 4;
+        if (size < len + 2) {
+            return NGX_AGAIN;
+        }
+
+        if ((addr = ngx_pnalloc(s->connection->pool,
+                        NGX_INET_ADDRSTRLEN)) == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->addr.len = ngx_inet_ntop(AF_INET, p + 1, addr,
+                NGX_INET_ADDRSTRLEN);
+        break;
+
+#if (NGX_HAVE_INET6)
+    case NGX_STREAM_SHADOWSOCKS_ATYP_IPV6:
+        len = 1 + 16;
+        if (size < len + 2) {
+            return NGX_AGAIN;
+        }
+
+        if ((addr = ngx_pnalloc(s->connection->pool,
+                        NGX_INET6_ADDRSTRLEN + 2)) == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* 带上"[]", 以便proxy_pass中的"$shadowsocks_addr:$shadowsocks_port" */
+        addr[0] = '[';
+        ctx->addr.len = ngx_inet_ntop(AF_INET6, p + 1, addr + 1,
+                NGX_INET6_ADDRSTRLEN) + 2;
+        addr[ctx->addr.len - 1] = ']';
+        break;
+#endif
+
+    case NGX_STREAM_SHADOWSOCKS_ATYP_DOMAIN:
+        if (size < 2) {
+            return NGX_AGAIN;
+        }
+
+        len = 2 + p[1];
+        if (size < len + 2) {
+            return NGX_AGAIN;
+        }
+
+        if (p[1] == 0) {
+            ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                    "shadowsocks: empty domain name");
+            return NGX_STREAM_BAD_REQUEST;
+        }
+
+        if ((addr = ngx_pnalloc(s->connection->pool, p[1])) == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(addr, p + 2, p[1]);
+        ctx->addr.len = p[1];
+        break;
+
+    default:
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                "shadowsocks: invalid address type %ui, "
+                "wrong password or method?", atyp);
+        return NGX_STREAM_BAD_REQUEST;
+    }
+
+    ctx->addr.data = addr;
+
+    port = (p[len] << 8) + p[len + 1];
+
+    if ((ctx->port.data = ngx_pnalloc(s->connection->pool,
+                    NGX_INT_T_LEN)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->port.len = ngx_sprintf(ctx->port.data, "%ui", port) - ctx->port.data;
+
+    *pos = p + len + 2;
+
+    return NGX_OK;
+}
+
+
+/**
+ * 解开[p, last)开头的chunk, payload原地解密, *len为payload长度;
+ * 数据不完整时返回NGX_AGAIN, 已解出的长度保存在decrypt_frame.need中
+ **/
+static ngx_int_t ngx_stream_shadowsocks_open_chunk(
+        ngx_stream_shadowsocks_ctx_t *ctx, u_char *p, u_char *last,
+        size_t *len)
+{
+    size_t                          n, size;
+    ngx_stream_shadowsocks_frame_t *fr;
+
+    fr = &ctx->decrypt_frame;
+    size = last - p;
+
+    if (fr->need == 0) {
+        if (size < AEAD_CHUNK_HDR_LEN) {
+            return NGX_AGAIN;
+        }
+
+        if (ss_aead_open(ctx->ss, ctx->decrypt, p, AEAD_LEN_LEN,
+                    p + AEAD_LEN_LEN) != 0) {
+            return NGX_ERROR;
+        }
+
+        n = (p[0] << 8) + p[1];
+        if (n == 0 || n > AEAD_MAX_PAYLOAD) {
+            return NGX_ERROR;
+        }
+
+        fr->need = AEAD_CHUNK_HDR_LEN + n + AEAD_TAG_LEN;
+    }
+
+    if (size < fr->need) {
+        return NGX_AGAIN;
+    }
+
+    n = fr->need - AEAD_CHUNK_HDR_LEN - AEAD_TAG_LEN;
+
+    if (ss_aead_open(ctx->ss, ctx->decrypt, p + AEAD_CHUNK_HDR_LEN, n,
+                p + AEAD_CHUNK_HDR_LEN + n) != 0) {
+        return NGX_ERROR;
+    }
+
+    fr->need = 0;
+    *len = n;
+
+    return NGX_OK;
+}
+
+
+/**
+ * 挂在ngx_stream_write_filter之前, 原地加解密ngx_stream_proxy_module
+ * 收到的数据:
+ *     from_upstream: upstream_buf中的数据加密后发往客户端, 首次发送前附加IV
+ *     !from_upstream: downstream_buf中的数据解密后发往上游
+ *
+ * 只处理落在对应proxy buffer中的数据, preread数据(已在preread阶段解密)
+ * 和PROXY protocol头不在其中, 原样透传
+ **/
+static ngx_int_t ngx_stream_shadowsocks_filter(ngx_stream_session_t *s,
+        ngx_chain_t *in, ngx_uint_t from_upstream)
+{
+    ngx_connection_t              *c;
+    ngx_stream_shadowsocks_ctx_t  *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_shadowsocks_module);
+    if (ctx == NULL || !ctx->relay || s->upstream == NULL) {
+        return ngx_stream_next_filter(s, in, from_upstream);
+    }
+
+    c = s->connection;
+
+    if (c->type == SOCK_DGRAM) {
+        if (!from_upstream) {
+            /* 客户端的包已在preread阶段解密 */
+            return ngx_stream_next_filter(s, in, from_upstream);
+        }
+
+        return ngx_stream_shadowsocks_udp_filter(s, ctx, in);
+    }
+
+#if (NGX_THREADS)
+    if (ctx->conf->thread_pool) {
+        return ngx_stream_shadowsocks_thread_filter(s, ctx, in, from_upstream);
+    }
+#endif
+
+    return ngx_stream_shadowsocks_tcp_filter(s, ctx, in, from_upstream);
+}
+
+
+static ngx_int_t ngx_stream_shadowsocks_tcp_filter(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_chain_t *in,
+        ngx_uint_t from_upstream)
+{
+    ngx_buf_t                     *b, *buf;
+    ngx_chain_t                   *cl;
+    struct enc_ctx                *ec;
+
+    if (IS_AEAD_METHOD(ctx->ss->enc_method)) {
+        return ngx_stream_shadowsocks_aead_filter(s, ctx, in, from_upstream);
+    }
+
+    if (from_upstream) {
+        b = &s->upstream->upstream_buf;
+        ec = ctx->encrypt;
+
+    } else {
+        b = &s->upstream->downstream_buf;
+        ec = ctx->decrypt;
+    }
+
+    for (cl = in; cl; cl = cl->next) {
+        buf = cl->buf;
+
+        if (buf->pos == buf->last
+                || buf->pos < b->start || buf->last > b->end) {
+            continue;
+        }
+
+        if (!ec->init) {
+            /* 发往客户端的第一个包: 生成IV, 放在数据之前 */
+            if (ngx_stream_shadowsocks_prepend_iv(s, ctx, &in) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        if (ss_crypt_buf(ctx->ss, ec, buf->pos, buf->last - buf->pos, buf,
+                    from_upstream) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                    "shadowsocks: %s failed",
+                    from_upstream ? "encrypt" : "decrypt");
+            return NGX_ERROR;
+        }
+    }
+
+    return ngx_stream_next_filter(s, in, from_upstream);
+}
+
+
+/**
+ * AEAD的密文与明文不等长, 不能像流式加密那样原地替换, 但payload本身
+ * 仍在proxy buffer中原地加解密, 只是用额外的ngx_buf_t描述:
+ *
+ *     加密: 每段payload(<= 0x3FFF)前后插入长度头和tag(ctx自己的小buffer),
+ *           proxy的buf本身描述最后一段payload
+ *     解密: 每个chunk的payload用一个ngx_buf_t描述, 最后一段用proxy的buf本身;
+ *           不完整的chunk留在proxy buffer中(hold), 等proxy把后续数据接在
+ *           它后面; buffer剩余空间放不下这个chunk时, 在数据全部发出之后
+ *           把它挪到buffer开头, 整个buffer都放不下(proxy_buffer_size小于
+ *           chunk)时拷到ctx->stash中补齐
+ *
+ * proxy的buf总是在它所在区域的其他ngx_buf_t之后发出, 所以proxy认为buf
+ * 空闲而重用buffer时, 其中的数据一定已经发完了
+ **/
+static ngx_int_t ngx_stream_shadowsocks_aead_filter(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_chain_t *in,
+        ngx_uint_t from_upstream)
+{
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b, *buf;
+    ngx_chain_t                    *cl, *out, **ll;
+    ngx_connection_t               *c, *dst;
+    ngx_stream_upstream_t          *u;
+    ngx_stream_shadowsocks_frame_t *fr;
+
+    c = s->connection;
+    u = s->upstream;
+
+    if (from_upstream) {
+        b = &u->upstream_buf;
+        fr = &ctx->encrypt_frame;
+        dst = c;
+
+    } else {
+        b = &u->downstream_buf;
+        fr = &ctx->decrypt_frame;
+        dst = u->peer.connection;
+    }
+
+    out = NULL;
+    ll = &out;
+
+    for (cl = in; cl; cl = cl->next) {
+        buf = cl->buf;
+
+        if (buf->pos == buf->last
+                || buf->pos < b->start || buf->last > b->end) {
+            if (ngx_stream_shadowsocks_append_buf(c->pool, &ll, buf)
+                    != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if (from_upstream) {
+            if (!ctx->encrypt->init) {
+                /* 发往客户端的第一个包: 生成salt, 放在数据之前 */
+                if (ngx_stream_shadowsocks_prepend_iv(s, ctx, &out)
+                        != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                if (ll == &out) {
+                    ll = &out->next;
+                }
+            }
+
+            rc = ngx_stream_shadowsocks_aead_encrypt(s, ctx, buf, &ll);
+
+        } else {
+            rc = ngx_stream_shadowsocks_aead_decrypt(s, ctx, b, buf, &ll);
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (out == NULL && !dst->buffered) {
+        /* 数据都留在hold中, 没有可发送的 */
+        rc = NGX_OK;
+
+    } else {
+        rc = ngx_stream_next_filter(s, out, from_upstream);
+    }
+
+    ngx_chain_update_chains(c->pool, &fr->free, &fr->busy, &out,
+            (ngx_buf_tag_t) &ngx_stream_shadowsocks_module);
+
+    if (rc == NGX_OK && fr->hold) {
+        if (ngx_stream_shadowsocks_aead_compact(s, ctx, b) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return rc;
+}
+
+
+/**
+ * 上游的每个回包(proxy的一个buf)单独加密成一个UDP包:
+ *
+ *     [IV + 地址头](ctx的小buffer) [payload](proxy buffer中原地加密) [tag]
+ *
+ * 只有每个包的最后一个buf带flush, ngx_udp_send_chain据此把它们
+ * 合并成一个包发出. 小buffer在发完之后回到encrypt_frame.free中重用
+ **/
+static ngx_int_t ngx_stream_shadowsocks_udp_filter(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_chain_t *in)
+{
+    u_char                         *hdr;
+    size_t                          size;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b, *buf;
+    ngx_chain_t                    *cl, *out, **ll, *prefix, *tag;
+    ngx_connection_t               *c;
+    ngx_stream_shadowsocks_frame_t *fr;
+
+    c = s->connection;
+    b = &s->upstream->upstream_buf;
+    fr = &ctx->encrypt_frame;
+
+    /* 包头和tag用同样大小的buffer, 互相重用时不用重新分配 */
+    size = ngx_max(ctx->ss->enc_iv_len + ctx->header.len, AEAD_TAG_LEN);
+
+    out = NULL;
+    ll = &out;
+
+    for (cl = in; cl; cl = cl->next) {
+        buf = cl->buf;
+
+        if (buf->pos == buf->last
+                || buf->pos < b->start || buf->last > b->end) {
+            if (ngx_stream_shadowsocks_append_buf(c->pool, &ll, buf)
+                    != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if ((prefix = ngx_stream_shadowsocks_get_buf(c->pool, fr, size))
+                == NULL) {
+            return NGX_ERROR;
+        }
+
+        prefix->buf->flush = 0;
+        prefix->buf->last_buf = 0;
+
+        /* 每个包都有新的IV(salt) */
+        if (ss_write_iv(ctx->ss, ctx->encrypt, prefix->buf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        hdr = prefix->buf->last;
+        prefix->buf->last = ngx_cpymem(hdr, ctx->header.data,
+                ctx->header.len);
+
+        *ll = prefix;
+        ll = &prefix->next;
+
+        if (!IS_AEAD_METHOD(ctx->ss->enc_method)) {
+            if (ss_crypt_buf(ctx->ss, ctx->encrypt, hdr, ctx->header.len,
+                        prefix->buf, 1) != NGX_OK
+                    || ss_crypt_buf(ctx->ss, ctx->encrypt, buf->pos,
+                        buf->last - buf->pos, buf, 1) != NGX_OK) {
+                goto failed;
+            }
+
+            if (ngx_stream_shadowsocks_append_buf(c->pool, &ll, buf)
+                    != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if ((tag = ngx_stream_shadowsocks_get_buf(c->pool, fr, size))
+                == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ss_aead_seal_udp(ctx->ss, ctx->encrypt, hdr, ctx->header.len,
+                    buf->pos, buf->last - buf->pos, tag->buf->last) != 0) {
+            goto failed;
+        }
+
+        tag->buf->last += AEAD_TAG_LEN;
+
+        /* 包的结尾由tag标记 */
+        tag->buf->flush = 1;
+        tag->buf->last_buf = buf->last_buf;
+        buf->flush = 0;
+        buf->last_buf = 0;
+
+        if (ngx_stream_shadowsocks_append_buf(c->pool, &ll, buf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        *ll = tag;
+        ll = &tag->next;
+    }
+
+    rc = ngx_stream_next_filter(s, out, 1);
+
+    ngx_chain_update_chains(c->pool, &fr->free, &fr->busy, &out,
+            (ngx_buf_tag_t) &ngx_stream_shadowsocks_module);
+
+    return rc;
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0, "shadowsocks: encrypt failed");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t ngx_stream_shadowsocks_aead_encrypt(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *buf, ngx_chain_t ***ll)
+{
+    u_char                         *p, *last;
+    size_t                          len;
+    ngx_chain_t                    *hdr, *tag, *cl;
+    ngx_stream_shadowsocks_frame_t *fr;
+
+    fr = &ctx->encrypt_frame;
+
+    p = buf->pos;
+    last = buf->last;
+
+    while (p < last) {
+        len = ngx_min((size_t) (last - p), AEAD_MAX_PAYLOAD);
+
+        if ((hdr = ngx_stream_shadowsocks_get_buf(s->connection->pool, fr,
+                        AEAD_CHUNK_HDR_LEN)) == NULL
+                || (tag = ngx_stream_shadowsocks_get_buf(s->connection->pool,
+                        fr, AEAD_CHUNK_HDR_LEN)) == NULL) {
+            return NGX_ERROR;
+        }
+
+        hdr->buf->last[0] = (u_char) (len >> 8);
+        hdr->buf->last[1] = (u_char) len;
+
+        if (ss_aead_seal(ctx->ss, ctx->encrypt, hdr->buf->last, AEAD_LEN_LEN,
+                    hdr->buf->last + AEAD_LEN_LEN) != 0
+                || ss_aead_seal(ctx->ss, ctx->encrypt, p, len, tag->buf->last)
+                != 0) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                    "shadowsocks: encrypt failed");
+            return NGX_ERROR;
+        }
+
+        hdr->buf->last += AEAD_CHUNK_HDR_LEN;
+        tag->buf->last += AEAD_TAG_LEN;
+
+        **ll = hdr;
+        *ll = &hdr->next;
+
+        if (p + len == last) {
+            buf->pos = p;
+
+            if (ngx_stream_shadowsocks_append_buf(s->connection->pool, ll,
+                        buf) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+        } else {
+            if ((cl = ngx_stream_shadowsocks_get_buf(s->connection->pool, fr,
+                            0)) == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl->buf->pos = p;
+            cl->buf->last = p + len;
+
+            **ll = cl;
+            *ll = &cl->next;
+        }
+
+        **ll = tag;
+        *ll = &tag->next;
+
+        p += len;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_stream_shadowsocks_aead_decrypt(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *b, ngx_buf_t *buf,
+        ngx_chain_t ***ll)
+{
+    u_char                         *p, *payload;
+    size_t                          len;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *hold;
+    ngx_chain_t                    *cl;
+    ngx_connection_t               *c;
+    ngx_stream_shadowsocks_frame_t *fr;
+
+    c = s->connection;
+    fr = &ctx->decrypt_frame;
+
+    if (ctx->stashing) {
+        rc = ngx_stream_shadowsocks_aead_unstash(s, ctx, buf, ll);
+        if (rc != NGX_OK || buf->pos == buf->last) {
+            return rc;
+        }
+    }
+
+    if (fr->hold) {
+        /* proxy把新数据紧接着收在不完整的chunk之后 */
+        hold = fr->hold;
+
+        if (buf->pos != hold->last) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                    "shadowsocks: unexpected buffer %p, expected %p",
+                    buf->pos, hold->last);
+            return NGX_ERROR;
+        }
+
+        hold->last = buf->last;
+        buf->pos = buf->last;
+
+        fr->hold = NULL;
+
+    } else {
+        hold = buf;
+    }
+
+    p = hold->pos;
+
+    for ( ;; ) {
+        rc = ngx_stream_shadowsocks_open_chunk(ctx, p, hold->last, &len);
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+
+        if (rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                    "shadowsocks: invalid chunk from client");
+            return NGX_ERROR;
+        }
+
+        payload = p + AEAD_CHUNK_HDR_LEN;
+        p = payload + len + AEAD_TAG_LEN;
+
+        if (p == hold->last) {
+            hold->pos = payload;
+            hold->last = payload + len;
+
+            return ngx_stream_shadowsocks_append_buf(c->pool, ll, hold);
+        }
+
+        if ((cl = ngx_stream_shadowsocks_get_buf(c->pool, fr, 0)) == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf->pos = payload;
+        cl->buf->last = payload + len;
+
+        **ll = cl;
+        *ll = &cl->next;
+    }
+
+    hold->pos = p;
+    fr->hold = hold;
+
+    return NGX_OK;
+}
+
+
+/**
+ * 补齐stash中不完整的chunk, 最多拷贝一个chunk
+ **/
+static ngx_int_t ngx_stream_shadowsocks_aead_unstash(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *buf, ngx_chain_t ***ll)
+{
+    size_t                          n, len, need;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *st;
+    ngx_stream_shadowsocks_frame_t *fr;
+
+    st = ctx->stash;
+    fr = &ctx->decrypt_frame;
+
+    for ( ;; ) {
+        need = fr->need ? fr->need : AEAD_CHUNK_HDR_LEN;
+
+        if ((size_t) (st->last - st->pos) < need) {
+            n = ngx_min(need - (st->last - st->pos),
+                    (size_t) (buf->last - buf->pos));
+            st->last = ngx_cpymem(st->last, buf->pos, n);
+            buf->pos += n;
+        }
+
+        rc = ngx_stream_shadowsocks_open_chunk(ctx, st->pos, st->last, &len);
+
+        if (rc == NGX_AGAIN) {
+            if (buf->pos == buf->last) {
+                return NGX_OK;
+            }
+
+            continue;
+        }
+
+        if (rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                    "shadowsocks: invalid chunk from client");
+            return NGX_ERROR;
+        }
+
+        st->pos += AEAD_CHUNK_HDR_LEN;
+        st->last = st->pos + len;
+
+        ctx->stashing = 0;
+
+        return ngx_stream_shadowsocks_append_buf(s->connection->pool, ll, st);
+    }
+}
+
+
+/**
+ * 在proxy buffer中的数据全部发出之后调用, 为hold中的chunk腾出空间
+ **/
+static ngx_int_t ngx_stream_shadowsocks_aead_compact(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_buf_t *b)
+{
+    size_t                          n, need;
+    ngx_buf_t                      *hold, *st;
+    ngx_stream_shadowsocks_frame_t *fr;
+
+    fr = &ctx->decrypt_frame;
+    hold = fr->hold;
+    need = fr->need ? fr->need : AEAD_CHUNK_HDR_LEN;
+
+    if (hold->last != b->last || (size_t) (b->end - hold->pos) >= need) {
+        return NGX_OK;
+    }
+
+    n = hold->last - hold->pos;
+
+    if (need > (size_t) (b->end - b->start)) {
+        if (ctx->stash == NULL) {
+            if ((ctx->stash = ngx_create_temp_buf(s->connection->pool,
+                            AEAD_MAX_CHUNK)) == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        st = ctx->stash;
+        st->pos = st->start;
+        st->last = ngx_cpymem(st->start, hold->pos, n);
+
+        ctx->stashing = 1;
+
+        hold->pos = hold->last;
+        fr->hold = NULL;
+
+        return NGX_OK;
+    }
+
+    ngx_memmove(b->start, hold->pos, n);
+
+    hold->pos = b->start;
+    hold->last = b->start + n;
+
+    b->pos = b->start;
+    b->last = hold->last;
+
+    return NGX_OK;
+}
+
+
+/**
+ * size: 需要自带的内存大小(长度头, tag或UDP包头), 为0时只是指向
+ * proxy buffer的描述符
+ **/
+static ngx_chain_t * ngx_stream_shadowsocks_get_buf(ngx_pool_t *pool,
+        ngx_stream_shadowsocks_frame_t *fr, size_t size)
+{
+    ngx_buf_t   *b;
+    ngx_chain_t *cl;
+
+    if ((cl = ngx_chain_get_free_buf(pool, &fr->free)) == NULL) {
+        return NULL;
+    }
+
+    b = cl->buf;
+
+    if (size && (size_t) (b->end - b->start) < size) {
+        if ((b->start = ngx_palloc(pool, size)) == NULL) {
+            return NULL;
+        }
+
+        b->end = b->start + size;
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+    b->temporary = 1;
+    b->flush = 1;
+    b->tag = (ngx_buf_tag_t) &ngx_stream_shadowsocks_module;
+
+    return cl;
+}
+
+
+static ngx_int_t ngx_stream_shadowsocks_append_buf(ngx_pool_t *pool,
+        ngx_chain_t ***ll, ngx_buf_t *b)
+{
+    ngx_chain_t *cl;
+
+    if ((cl = ngx_alloc_chain_link(pool)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    **ll = cl;
+    *ll = &cl->next;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_stream_shadowsocks_prepend_iv(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_chain_t **in)
+{
+    ngx_buf_t   *iv;
+    ngx_chain_t *ln;
+
+    if (ctx->ss->enc_iv_len == 0) {
+        return enc_ctx_set_iv(ctx->ss, ctx->encrypt, NULL, 1) == 0
+               ? NGX_OK : NGX_ERROR;
+    }
+
+    if ((iv = ngx_create_temp_buf(s->connection->pool,
+                    ctx->ss->enc_iv_len)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ss_write_iv(ctx->ss, ctx->encrypt, iv) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if ((ln = ngx_alloc_chain_link(s->connection->pool)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    ln->buf = iv;
+    ln->next = *in;
+    *in = ln;
+
+    return NGX_OK;
+}
+
+
+static ngx_stream_shadowsocks_cipher_t * ngx_stream_shadowsocks_get_cipher(
+        ngx_stream_shadowsocks_srv_conf_t *sscf, ngx_log_t *log)
+{
+    ngx_stream_shadowsocks_cipher_t *cp;
+
+    cp = sscf->free_ciphers;
+
+    if (cp) {
+        sscf->free_ciphers = cp->next;
+        sscf->nfree_ciphers--;
+        cp->next = NULL;
+        return cp;
+    }
+
+    if ((cp = ngx_calloc(sizeof(ngx_stream_shadowsocks_cipher_t), log))
+            == NULL) {
+        return NULL;
+    }
+
+    if (enc_ctx_init(&sscf->ss, sscf->ss.enc_method, &cp->encrypt, 1) != 0
+            || enc_ctx_init(&sscf->ss, sscf->ss.enc_method, &cp->decrypt, 0)
+            != 0) {
+        ngx_stream_shadowsocks_free_cipher(&sscf->ss, cp);
+        return NULL;
+    }
+
+    return cp;
+}
+
+
+static void ngx_stream_shadowsocks_free_cipher(shadowsocks_t *ss,
+        ngx_stream_shadowsocks_cipher_t *cp)
+{
+    cipher_context_release(ss, &cp->encrypt.evp);
+    cipher_context_release(ss, &cp->decrypt.evp);
+    ngx_free(cp);
+}
+
+
+/**
+ * 连接结束时把收发的字节数累加到用户的计数器上
+ **/
+static ngx_int_t ngx_stream_shadowsocks_log_handler(ngx_stream_session_t *s)
+{
+    ngx_stream_shadowsocks_ctx_t       *ctx;
+    ngx_stream_shadowsocks_user_node_t *node;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_shadowsocks_module);
+    if (ctx == NULL || ctx->user == NULL || ctx->user->node == NULL) {
+        return NGX_OK;
+    }
+
+    node = ctx->user->node;
+
+    (void) ngx_atomic_fetch_add(&node->received, s->received);
+    (void) ngx_atomic_fetch_add(&node->sent, s->connection->sent);
+
+    return NGX_OK;
+}
+
+
+static void ngx_stream_shadowsocks_cleanup(void *data)
+{
+    ngx_stream_shadowsocks_ctx_t *ctx = data;
+
+#if (NGX_THREADS)
+    ngx_uint_t                    i;
+    ngx_stream_shadowsocks_job_t *job, *running[2];
+
+    for (i = 0; i < 2; i++) {
+        job = ctx->job[i];
+        running[i] = (job && job->running) ? job : NULL;
+    }
+
+    for (i = 0; i < 2; i++) {
+        job = ctx->job[i];
+
+        if (job == NULL) {
+            continue;
+        }
+
+        ctx->job[i] = NULL;
+
+        if (!job->running) {
+            ngx_stream_shadowsocks_job_free(job);
+            continue;
+        }
+
+        /* 线程还在使用cipher和job的内存, 交给完成回调释放 */
+        job->orphan = 1;
+        job->cipher = ctx->cipher;
+        job->sibling = running[i ^ 1];
+    }
+
+    if (running[0] || running[1]) {
+        ctx->cipher = NULL;
+        return;
+    }
+#endif
+
+    if (ctx->cipher == NULL) {
+        return;
+    }
+
+    /**
+     * 同时存在的连接不会超过worker_connections, freelist再长也用不上,
+     * 连接高峰过后多出来的直接释放
+     **/
+    if (ctx->conf->nfree_ciphers >= ngx_cycle->connection_n) {
+        ngx_stream_shadowsocks_free_cipher(&ctx->conf->ss, ctx->cipher);
+        ctx->cipher = NULL;
+        return;
+    }
+
+    /* 密钥还在, 只清掉IV等连接相关的状态 */
+    if (enc_ctx_reset(&ctx->conf->ss, ctx->encrypt, 1) != 0
+            || enc_ctx_reset(&ctx->conf->ss, ctx->decrypt, 0) != 0) {
+        ngx_stream_shadowsocks_free_cipher(&ctx->conf->ss, ctx->cipher);
+        ctx->cipher = NULL;
+        return;
+    }
+
+    ctx->cipher->next = ctx->conf->free_ciphers;
+    ctx->conf->free_ciphers = ctx->cipher;
+    ctx->conf->nfree_ciphers++;
+    ctx->cipher = NULL;
+}
+
+
+#if (NGX_THREADS)
+
+/**
+ * 数据达到thread_threshold时交给线程池加解密, 小的数据直接处理.
+ * 任务进行中, 或者上一个任务的数据还没发完时, 收到的数据排在job->in中,
+ * 所以每个方向上的数据仍然按顺序加解密和发送
+ **/
+static ngx_int_t ngx_stream_shadowsocks_thread_filter(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_chain_t *in,
+        ngx_uint_t from_upstream)
+{
+    size_t                          size;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b;
+    ngx_uint_t                      queued, passed, offload;
+    ngx_chain_t                    *cl, *ln;
+    ngx_connection_t               *c, *dst;
+    struct enc_ctx                 *ec;
+    ngx_stream_upstream_t          *u;
+    ngx_stream_shadowsocks_job_t   *job;
+
+    c = s->connection;
+    u = s->upstream;
+
+    if (from_upstream) {
+        b = &u->upstream_buf;
+        ec = ctx->encrypt;
+        dst = c;
+
+    } else {
+        b = &u->downstream_buf;
+        ec = ctx->decrypt;
+        dst = u->peer.connection;
+    }
+
+    job = ctx->job[from_upstream];
+
+    if (job == NULL) {
+        size = ngx_stream_shadowsocks_job_size(in, b, ec);
+
+        if (size == 0 || size < ctx->conf->thread_threshold) {
+            return ngx_stream_shadowsocks_tcp_filter(s, ctx, in,
+                    from_upstream);
+        }
+
+        if ((job = ngx_calloc(sizeof(ngx_stream_shadowsocks_job_t), c->log))
+                == NULL) {
+            return NGX_ERROR;
+        }
+
+        job->ss = ctx->ss;
+        job->ec = ec;
+        job->conf = ctx->conf;
+        job->enc = from_upstream;
+        job->aead = IS_AEAD_METHOD(ctx->ss->enc_method);
+        job->out.buf = &job->buf;
+        job->last = &job->in;
+
+        job->task.ctx = job;
+        job->task.handler = ngx_stream_shadowsocks_job_thread;
+        job->task.event.handler = ngx_stream_shadowsocks_job_done;
+        job->task.event.data = job;
+
+        ctx->job[from_upstream] = job;
+    }
+
+    passed = 0;
+
+    /* proxy的chain link会被重用, 排队时用自己的 */
+    if (job->running || job->in) {
+        for (ln = in; ln; ln = ln->next) {
+            if (ngx_stream_shadowsocks_append_buf(c->pool, &job->last,
+                        ln->buf) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        in = NULL;
+    }
+
+    if (job->running) {
+        goto wait;
+    }
+
+    dst->buffered &= ~NGX_STREAM_SHADOWSOCKS_BUFFERED;
+
+    rc = NGX_OK;
+
+    if (job->done) {
+        job->done = 0;
+
+        if (job->rc != NGX_OK) {
+            goto failed;
+        }
+
+        rc = ngx_stream_next_filter(s, &job->out, from_upstream);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        passed = 1;
+    }
+
+    queued = 0;
+
+    if (job->in) {
+        in = job->in;
+        job->in = NULL;
+        job->last = &job->in;
+        queued = 1;
+    }
+
+    if (in == NULL) {
+        if (passed || !dst->buffered) {
+            return rc;
+        }
+
+        return ngx_stream_next_filter(s, NULL, from_upstream);
+    }
+
+    size = ngx_stream_shadowsocks_job_size(in, b, ec);
+
+    /* job中有不完整的chunk时, 后续的数据不论大小都要接在它后面 */
+    offload = size && (size >= ctx->conf->thread_threshold || job->nrest);
+
+    if (offload && !passed
+            && job->buf.pos != job->buf.last && dst->buffered) {
+        /* 先试着发出上一个任务的数据, 发完了才能重用job的内存 */
+        rc = ngx_stream_next_filter(s, NULL, from_upstream);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        passed = 1;
+    }
+
+    if (!offload) {
+        rc = ngx_stream_shadowsocks_tcp_filter(s, ctx, in, from_upstream);
+
+    } else if (job->buf.pos != job->buf.last) {
+        /* 写事件之后再来 */
+        for (ln = in; ln; ln = ln->next) {
+            if (ngx_stream_shadowsocks_append_buf(c->pool, &job->last,
+                        ln->buf) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        in = NULL;
+
+    } else {
+        rc = ngx_stream_shadowsocks_job_post(s, ctx, job, in, size);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_DECLINED) {
+            /* 只收到不完整的chunk, 留在job中等后续数据 */
+            rc = NGX_OK;
+
+        } else if (rc == NGX_DONE) {
+            /* 线程池的队列满了, 已经在这里加解密 */
+            if (job->rc != NGX_OK) {
+                goto failed;
+            }
+
+            rc = ngx_stream_next_filter(s, &job->out, from_upstream);
+            passed = 1;
+
+        } else {
+            job->dst = dst;
+        }
+    }
+
+    if (queued) {
+        for (cl = in; cl; /* void */) {
+            ln = cl;
+            cl = cl->next;
+            ngx_free_chain(c->pool, ln);
+        }
+    }
+
+    if (!job->running && job->in == NULL) {
+        return rc;
+    }
+
+wait:
+
+    dst->buffered |= NGX_STREAM_SHADOWSOCKS_BUFFERED;
+
+    if (!passed && (dst->buffered & ~NGX_STREAM_SHADOWSOCKS_BUFFERED)) {
+        return ngx_stream_next_filter(s, NULL, from_upstream);
+    }
+
+    return NGX_AGAIN;
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0, "shadowsocks: %s failed",
+            from_upstream ? "encrypt" : "decrypt");
+
+    return NGX_ERROR;
+}
+
+
+/**
+ * 可以交给线程池的数据量, 为0时直接处理: 第一次加密要先发出IV,
+ * preread数据和PROXY protocol头不在proxy buffer中, 原样透传
+ **/
+static size_t ngx_stream_shadowsocks_job_size(ngx_chain_t *in, ngx_buf_t *b,
+        struct enc_ctx *ec)
+{
+    size_t       size;
+    ngx_buf_t   *buf;
+    ngx_chain_t *cl;
+
+    if (!ec->init) {
+        return 0;
+    }
+
+    size = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        buf = cl->buf;
+
+        if (buf->pos == buf->last) {
+            continue;
+        }
+
+        if (buf->pos < b->start || buf->last > b->end) {
+            return 0;
+        }
+
+        size += buf->last - buf->pos;
+    }
+
+    return size;
+}
+
+
+/**
+ * 把数据拷进job的内存, proxy的buffer随即可以重用. AEAD加密在拷贝时就
+ * 分好chunk并写好长度头的明文, 线程中只做加密:
+ *
+ *     [len][len tag][payload][payload tag] ...
+ *
+ * AEAD解密时数据接在上次剩下的不完整chunk之后, 由job_frame分帧
+ **/
+static ngx_int_t ngx_stream_shadowsocks_job_post(ngx_stream_session_t *s,
+        ngx_stream_shadowsocks_ctx_t *ctx, ngx_stream_shadowsocks_job_t *job,
+        ngx_chain_t *in, size_t size)
+{
+    u_char                         *p, *pos, *rest;
+    size_t                          n, left, need, nrest;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *buf;
+    ngx_chain_t                    *cl;
+    ngx_stream_shadowsocks_frame_t *fr;
+
+    need = size;
+    rest = job->rest;
+    nrest = job->nrest;
+
+    if (job->aead && job->enc) {
+        need += (size + AEAD_MAX_PAYLOAD - 1) / AEAD_MAX_PAYLOAD
+            * (AEAD_CHUNK_HDR_LEN + AEAD_TAG_LEN);
+
+    } else if (job->aead && nrest == 0) {
+        /* 接过直接解密时留在hold或stash中的不完整chunk */
+        fr = &ctx->decrypt_frame;
+
+        if (ctx->stashing) {
+            rest = ctx->stash->pos;
+            nrest = ctx->stash->last - ctx->stash->pos;
+            ctx->stashing = 0;
+
+        } else if (fr->hold) {
+            rest = fr->hold->pos;
+            nrest = fr->hold->last - fr->hold->pos;
+            fr->hold->pos = fr->hold->last;
+            fr->hold = NULL;
+        }
+
+        job->need = fr->need;
+        fr->need = 0;
+    }
+
+    need += nrest;
+
+    if ((size_t) (job->buf.end - job->buf.start) < need) {
+        if ((p = ngx_alloc(need, s->connection->log)) == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(p, rest, nrest);
+
+        if (job->buf.start) {
+            ngx_free(job->buf.start);
+        }
+
+        job->buf.start = p;
+        job->buf.end = p + need;
+
+    } else {
+        ngx_memmove(job->buf.start, rest, nrest);
+    }
+
+    p = job->buf.start + nrest;
+    left = 0;
+
+    job->buf.last_buf = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        buf = cl->buf;
+
+        for (pos = buf->pos; pos < buf->last; pos += n) {
+            if (left == 0) {
+                if (job->aead && job->enc) {
+                    left = ngx_min(size, AEAD_MAX_PAYLOAD);
+                    p[0] = (u_char) (left >> 8);
+                    p[1] = (u_char) left;
+                    p += AEAD_CHUNK_HDR_LEN;
+
+                } else {
+                    left = size;
+                }
+
+                size -= left;
+            }
+
+            n = ngx_min((size_t) (buf->last - pos), left);
+            p = ngx_cpymem(p, pos, n);
+            left -= n;
+
+            if (job->aead && job->enc && left == 0) {
+                p += AEAD_TAG_LEN;
+            }
+        }
+
+        buf->pos = buf->last;
+
+        if (buf->last_buf) {
+            job->buf.last_buf = 1;
+        }
+    }
+
+    job->buf.pos = job->buf.start;
+    job->buf.last = p;
+    job->buf.temporary = 1;
+    job->buf.flush = 1;
+
+    if (job->aead && !job->enc) {
+        rc = ngx_stream_shadowsocks_job_frame(job);
+
+        if (rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                    "shadowsocks: invalid chunk from client");
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_DECLINED) {
+            return NGX_DECLINED;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+            "shadowsocks: %s job, %uz bytes",
+            job->enc ? "encrypt" : "decrypt", job->buf.last - job->buf.pos);
+
+    if (ngx_thread_task_post(ctx->conf->thread_pool, &job->task) != NGX_OK) {
+        ngx_stream_shadowsocks_job_thread(job, s->connection->log);
+        return NGX_DONE;
+    }
+
+    job->running = 1;
+
+    return NGX_OK;
+}
+
+
+/**
+ * AEAD解密: 长度头很短, 在worker中依次解开并为每个payload保留nonce,
+ * 线程中只解payload. 完整的chunk到buf.last为止, 之后的部分记为rest;
+ * 没有完整的chunk时返回NGX_DECLINED
+ **/
+static ngx_int_t ngx_stream_shadowsocks_job_frame(
+        ngx_stream_shadowsocks_job_t *job)
+{
+    u_char  *p, *last;
+    size_t   n;
+
+    p = job->buf.start;
+    last = job->buf.last;
+
+    for ( ;; ) {
+        if (job->need == 0) {
+            if ((size_t) (last - p) < AEAD_CHUNK_HDR_LEN) {
+                break;
+            }
+
+            if (ss_aead_open(job->ss, job->ec, p, AEAD_LEN_LEN,
+                        p + AEAD_LEN_LEN) != 0) {
+                return NGX_ERROR;
+            }
+
+            n = (p[0] << 8) + p[1];
+            if (n == 0 || n > AEAD_MAX_PAYLOAD) {
+                return NGX_ERROR;
+            }
+
+            job->need = AEAD_CHUNK_HDR_LEN + n + AEAD_TAG_LEN;
+        }
+
+        if ((size_t) (last - p) < job->need) {
+            break;
+        }
+
+        /* 之后的payload的nonce依次加二, 只需记下第一个 */
+        ss_aead_reserve(job->ec, p == job->buf.start ? job->nonce : NULL);
+
+        p += job->need;
+        job->need = 0;
+    }
+
+    job->rest = p;
+    job->nrest = last - p;
+    job->buf.last = p;
+
+    return p == job->buf.start ? NGX_DECLINED : NGX_OK;
+}
+
+
+/**
+ * 在线程中执行, 只访问job和它的cipher
+ **/
+static void ngx_stream_shadowsocks_job_thread(void *data, ngx_log_t *log)
+{
+    ngx_stream_shadowsocks_job_t *job = data;
+
+    u_char                       *p, *last, *plain;
+    size_t                        len;
+    u_char                        nonce[AEAD_NONCE_LEN];
+
+    p = job->buf.pos;
+    last = job->buf.last;
+
+    if (!job->aead) {
+        job->rc = ss_crypt_buf(job->ss, job->ec, p, last - p, &job->buf,
+                job->enc);
+        return;
+    }
+
+    if (!job->enc) {
+        /* 解密后把payload依次挪到一起, 整块交给write filter */
+        ngx_memcpy(nonce, job->nonce, AEAD_NONCE_LEN);
+        plain = p;
+
+        while (p < last) {
+            len = (p[0] << 8) | p[1];
+
+            if (ss_aead_open_at(job->ss, job->ec, nonce,
+                        p + AEAD_CHUNK_HDR_LEN, len,
+                        p + AEAD_CHUNK_HDR_LEN + len) != 0) {
+                job->rc = NGX_ERROR;
+                return;
+            }
+
+            /* 跳过下一个chunk的长度头 */
+            ss_aead_nonce_increment(nonce);
+
+            plain = ngx_movemem(plain, p + AEAD_CHUNK_HDR_LEN, len);
+            p += AEAD_CHUNK_HDR_LEN + len + AEAD_TAG_LEN;
+        }
+
+        job->buf.last = plain;
+        job->rc = NGX_OK;
+        return;
+    }
+
+    while (p < last) {
+        len = (p[0] << 8) | p[1];
+
+        if (ss_aead_seal(job->ss, job->ec, p, AEAD_LEN_LEN, p + AEAD_LEN_LEN)
+                != 0
+                || ss_aead_seal(job->ss, job->ec, p + AEAD_CHUNK_HDR_LEN, len,
+                    p + AEAD_CHUNK_HDR_LEN + len) != 0) {
+            job->rc = NGX_ERROR;
+            return;
+        }
+
+        p += AEAD_CHUNK_HDR_LEN + len + AEAD_TAG_LEN;
+    }
+
+    job->rc = NGX_OK;
+}
+
+
+/**
+ * 任务完成, 回到worker的事件循环中: 继续proxy在这个方向上的处理,
+ * thread_filter随后把结果交给write filter
+ **/
+static void ngx_stream_shadowsocks_job_done(ngx_event_t *ev)
+{
+    ngx_stream_shadowsocks_job_t *job = ev->data;
+
+    ngx_event_t                  *wev;
+
+    job->running = 0;
+
+    if (job->orphan) {
+        if (job->sibling && job->sibling->running) {
+            /* cipher由另一个方向的job释放 */
+            job->sibling->sibling = NULL;
+
+        } else {
+            ngx_stream_shadowsocks_free_cipher(&job->conf->ss, job->cipher);
+        }
+
+        ngx_stream_shadowsocks_job_free(job);
+        return;
+    }
+
+    job->done = 1;
+
+    wev = job->dst->write;
+    wev->handler(wev);
+}
+
+
+static void ngx_stream_shadowsocks_job_free(ngx_stream_shadowsocks_job_t *job)
+{
+    if (job->buf.start) {
+        ngx_free(job->buf.start);
+    }
+
+    ngx_free(job);
 }
 
+#endif